@@ -1,9 +1,26 @@
 #include "Casio/FZ-1_API.h"
+#include "Casio/FZ-1_DSP.h"
 #include "3/tinywav/tinywav.h"
 #include "3/tinyxml2/tinyxml2.h"
 #include <assert.h>
 #include <ctype.h>
+#include <errno.h>
+#include <math.h>
 #include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <iterator>
+#include <mutex>
+#include <thread>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
 
 namespace Casio::FZ_1::API {
 
@@ -84,6 +101,329 @@ void print_value_array(XmlPrinter &p, const char *name, size_t count, const T *o
 }
 
 
+//------------------------------------------------------------------------------
+// .wav output helpers
+
+static int32_t sample_rate_hz(SampleRate freq) {
+    switch(freq) {
+        case SR_36kHz: return 36000;
+        case SR_18kHz: return 18000;
+        case SR_9kHz: return 9000;
+        default: return 0;
+    }
+}
+
+// A counting semaphore, to limit the number of concurrent file writes
+struct WriteGate {
+    WriteGate(size_t count): count_(std::max<size_t>(count, 1)) {}
+
+    void acquire() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [this] { return count_ > 0; });
+        count_--;
+    }
+
+    void release() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            count_++;
+        }
+        cv_.notify_one();
+    }
+
+private:
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    size_t count_;
+};
+
+// Sampler metadata for a .wav file: the MIDI note the sample plays at its
+// original pitch, and its loops (inclusive sample offsets into the data).
+struct WavSamplerInfo {
+    uint8_t unity_note = 60;
+    std::vector<std::pair<uint32_t, uint32_t>> loops;
+};
+
+// The sampler metadata for the samples [start, start + count) of a voice: its
+// loops up to loop_end_point (as voice_address_range()), skipping any which
+// are empty, or not wholly within the range (e.g. unused loops, which are
+// set to play_end).
+static WavSamplerInfo wav_sampler_info(
+    const Voice &v, size_t start, size_t count) {
+
+    WavSamplerInfo info;
+    info.unity_note = std::min<uint8_t>(v.midi_origin, 127);
+    size_t loops = std::min<size_t>(
+        std::max<int8_t>(v.loop_end_point, 0) + 1, std::size(v.loop_start));
+    for(size_t i = 0; i < loops; i++) {
+        int64_t
+            loop_start = (v.loop_start[i] & LOOP_START_ADDRESS_MASK) -
+                static_cast<int64_t>(start),
+            loop_end = (v.loop_end[i] & LOOP_END_ADDRESS_MASK) -
+                static_cast<int64_t>(start);
+        if((loop_start >= 0) && (loop_start < loop_end) &&
+            (loop_end < static_cast<int64_t>(count))) {
+            info.loops.emplace_back(loop_start, loop_end);
+        }
+    }
+    return info;
+}
+
+// The 'cue ' and 'smpl' chunks for info (with positions scaled by the
+// resampling ratio, and clamped to the count samples written)
+static std::vector<uint32_t> sampler_chunks(const WavSamplerInfo &info,
+    uint32_t samplerate, double scale, size_t count) {
+
+    std::vector<uint32_t> words;
+    auto chunk = [&](const char *id, size_t length) {
+        uint32_t tag;
+        memcpy(&tag, id, sizeof(tag));
+        words.push_back(tag);
+        words.push_back(static_cast<uint32_t>(length * sizeof(uint32_t)));
+    };
+    auto position = [&](uint32_t offset) {
+        double p = round(offset * scale);
+        return static_cast<uint32_t>(std::min(p, count - 1.0));
+    };
+    const uint32_t loops = static_cast<uint32_t>(info.loops.size());
+    uint32_t data_tag;
+    memcpy(&data_tag, "data", sizeof(data_tag));
+
+    // a cue point at each loop's start, which the loop refers to by id
+    if(loops) {
+        chunk("cue ", 1 + (6 * loops));
+        words.push_back(loops);
+        for(uint32_t i = 0; i < loops; i++) {
+            uint32_t start = position(info.loops[i].first);
+            words.insert(words.end(), { i + 1, start, data_tag, 0, 0, start });
+        }
+    }
+    chunk("smpl", 9 + (6 * loops));
+    words.insert(words.end(), {
+        0, 0, // manufacturer, product
+        static_cast<uint32_t>(1000000000.0 / samplerate + 0.5), // period (ns)
+        info.unity_note, 0, // MIDI unity note, pitch fraction
+        0, 0, // SMPTE format, offset
+        loops, 0, // loop count, sampler data size
+    });
+    for(uint32_t i = 0; i < loops; i++) {
+        words.insert(words.end(), {
+            i + 1, 0, // cue point id, type (forward)
+            position(info.loops[i].first), position(info.loops[i].second),
+            0, 0, // fraction, play count (infinite)
+        });
+    }
+    return words;
+}
+
+// The canonical 44 byte header of a mono .wav file: the RIFF/WAVE header,
+// the 'fmt ' chunk and the 'data' chunk's header
+struct WavHeader {
+    char riff_tag[4] = { 'R', 'I', 'F', 'F' };
+    uint32_t riff_size = 0;
+    char wave_tag[4] = { 'W', 'A', 'V', 'E' };
+    char fmt_tag[4] = { 'f', 'm', 't', ' ' };
+    uint32_t fmt_size = 16;
+    uint16_t audio_format = 0; // 1 = PCM, 3 = IEEE float
+    uint16_t channels = 1;
+    uint32_t sample_rate = 0;
+    uint32_t byte_rate = 0;
+    uint16_t block_align = 0;
+    uint16_t bits_per_sample = 0;
+    char data_tag[4] = { 'd', 'a', 't', 'a' };
+    uint32_t data_size = 0;
+};
+static_assert(sizeof(WavHeader) == 44, "WavHeader should be 44 bytes");
+
+// A piece of a file, for write_file()
+struct FilePiece {
+    const void *data;
+    size_t size;
+};
+
+// Create (or truncate) a file and write pieces to it in one go: with a single
+// writev() call where available (unless it comes up short).
+static Result write_file(
+    std::string_view filename, std::initializer_list<FilePiece> pieces) {
+#ifdef _WIN32
+    FILE *file = fopen(filename.data(), "wb");
+    if(!file) {
+        return RESULT_WAVE_OPEN_ERROR;
+    }
+    bool ok = true;
+    for(const FilePiece &piece: pieces) {
+        if(piece.size && (fwrite(piece.data, piece.size, 1, file) != 1)) {
+            ok = false;
+            break;
+        }
+    }
+    if(fclose(file)) {
+        ok = false;
+    }
+#else
+    int fd = open(filename.data(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if(fd < 0) {
+        return RESULT_WAVE_OPEN_ERROR;
+    }
+    iovec iov[8];
+    int count = 0;
+    for(const FilePiece &piece: pieces) {
+        if(piece.size) {
+            assert(count < static_cast<int>(std::size(iov)));
+            iov[count++] = { const_cast<void*>(piece.data), piece.size };
+        }
+    }
+    bool ok = true;
+    for(iovec *next = iov; count; ) {
+        ssize_t w = writev(fd, next, count);
+        if((w < 0) && (errno == EINTR)) {
+            continue;
+        }
+        if(w <= 0) {
+            ok = false;
+            break;
+        }
+        // skip past whatever was written, in case it wasn't everything
+        while(count && (static_cast<size_t>(w) >= next->iov_len)) {
+            w -= next->iov_len;
+            next++;
+            count--;
+        }
+        if(count) {
+            next->iov_base = static_cast<uint8_t*>(next->iov_base) + w;
+            next->iov_len -= w;
+        }
+    }
+    if(close(fd)) {
+        ok = false;
+    }
+#endif
+    return ok ? RESULT_OK : RESULT_WAVE_WRITE_ERROR;
+}
+
+// write a contiguous run of samples to a mono .wav file, resampling them if
+// asked to (holding gate, if supplied, only while the file is open), and
+// followed by sampler metadata if info is supplied
+static Result write_wav(std::string_view filename, SampleRate freq,
+    const int16_t *samples, size_t count, const WavOptions &options,
+    WriteGate *gate = nullptr, const WavSamplerInfo *info = nullptr) {
+
+    const uint32_t in_rate = sample_rate_hz(freq);
+    if(!in_rate) {
+        return RESULT_WAVE_BAD_SAMPLERATE;
+    }
+    const WavFormat format = options.format;
+    if((format != WAV_PCM16) && (format != WAV_FLOAT32)) {
+        return RESULT_WAVE_BAD_FORMAT;
+    }
+    const uint32_t samplerate = options.rate ? options.rate : in_rate;
+
+    // convert (and resample) the whole range in one go: 16-bit samples at
+    // their own rate are written exactly as they are
+    constexpr size_t CHUNK_SAMPLES = 16384;
+    std::vector<float> float_buffer;
+    std::vector<int16_t> pcm_buffer;
+    if(samplerate != in_rate) {
+        DSP::Resampler resampler(in_rate, samplerate, options.quality);
+        float_buffer.reserve(resampler.output_length(count));
+        float chunk[CHUNK_SAMPLES];
+        for(size_t i = 0; i < count; i += CHUNK_SAMPLES) {
+            size_t len = std::min(count - i, CHUNK_SAMPLES);
+            DSP::int16_to_float(samples + i, chunk, len);
+            resampler.process(chunk, len, float_buffer);
+        }
+        resampler.flush(float_buffer);
+        if(format == WAV_PCM16) {
+            pcm_buffer.resize(float_buffer.size());
+            DSP::float_to_int16(
+                float_buffer.data(), pcm_buffer.data(), pcm_buffer.size());
+            samples = pcm_buffer.data();
+            count = pcm_buffer.size();
+        }
+    } else if(format == WAV_FLOAT32) {
+        float_buffer.resize(count);
+        DSP::int16_to_float(samples, float_buffer.data(), count);
+    }
+
+    // everything's size is known by now, so the header is complete before
+    // anything is written
+    std::vector<uint32_t> chunks;
+    if(info) {
+        chunks = sampler_chunks(*info, samplerate,
+            static_cast<double>(samplerate) / in_rate,
+            (format == WAV_PCM16) ? count : float_buffer.size());
+    }
+    const FilePiece
+        payload = (format == WAV_PCM16) ?
+            FilePiece{ samples, count * sizeof(int16_t) } :
+            FilePiece{
+                float_buffer.data(), float_buffer.size() * sizeof(float) },
+        trailer{ chunks.data(), chunks.size() * sizeof(uint32_t) };
+    // (the data is always a whole number of words, so needs no padding)
+    if((payload.size + trailer.size) > (UINT32_MAX - sizeof(WavHeader))) {
+        return RESULT_WAVE_WRITE_ERROR;
+    }
+    const uint16_t bytes = (format == WAV_PCM16) ? 2 : 4;
+    WavHeader header;
+    header.riff_size = static_cast<uint32_t>(
+        sizeof(WavHeader) - 8 + payload.size + trailer.size);
+    header.audio_format = (format == WAV_PCM16) ? 1 : 3;
+    header.sample_rate = samplerate;
+    header.byte_rate = samplerate * bytes;
+    header.block_align = bytes;
+    header.bits_per_sample = bytes * 8;
+    header.data_size = static_cast<uint32_t>(payload.size);
+
+    struct Hold {
+        Hold(WriteGate *gate): gate_(gate) {
+            if(gate_) { gate_->acquire(); }
+        }
+        ~Hold() {
+            if(gate_) { gate_->release(); }
+        }
+        WriteGate *gate_;
+    } hold(gate);
+
+    return write_file(filename, {
+        { &header, sizeof(header) }, payload, trailer });
+}
+
+// write interleaved floating point frames (of channels samples each) to a
+// .wav file, converting them to 16-bit PCM (clamped) if asked to
+static Result write_wav_frames(std::string_view filename, const float *frames,
+    size_t count, uint16_t channels, uint32_t samplerate, WavFormat format) {
+
+    if((format != WAV_PCM16) && (format != WAV_FLOAT32)) {
+        return RESULT_WAVE_BAD_FORMAT;
+    }
+    const size_t samples = count * channels;
+    std::vector<int16_t> pcm_buffer;
+    if(format == WAV_PCM16) {
+        pcm_buffer.resize(samples);
+        DSP::float_to_int16(frames, pcm_buffer.data(), samples);
+    }
+    const FilePiece payload = (format == WAV_PCM16) ?
+        FilePiece{ pcm_buffer.data(), samples * sizeof(int16_t) } :
+        FilePiece{ frames, samples * sizeof(float) };
+    // (the data is always a whole number of words, so needs no padding)
+    if(payload.size > (UINT32_MAX - sizeof(WavHeader))) {
+        return RESULT_WAVE_WRITE_ERROR;
+    }
+    const uint16_t bytes = (format == WAV_PCM16) ? 2 : 4;
+    WavHeader header;
+    header.riff_size = static_cast<uint32_t>(
+        sizeof(WavHeader) - 8 + payload.size);
+    header.audio_format = (format == WAV_PCM16) ? 1 : 3;
+    header.channels = channels;
+    header.sample_rate = samplerate;
+    header.byte_rate = samplerate * bytes * channels;
+    header.block_align = bytes * channels;
+    header.bits_per_sample = bytes * 8;
+    header.data_size = static_cast<uint32_t>(payload.size);
+    return write_file(filename, { { &header, sizeof(header) }, payload });
+}
+
+
 //------------------------------------------------------------------------------
 
 #define FZ_RESULT_STRING(name_, _) #name_,
@@ -114,6 +454,116 @@ bool result_success(Result r) {
 }
 
 
+//------------------------------------------------------------------------------
+// Hashing
+
+// XXH64 (seed 0) over a whole number of 64-bit words: enough for blocks and
+// for arrays of block hashes. The four accumulators are independent, so a
+// block's 32 stripes run as four parallel multiply chains.
+static constexpr uint64_t
+    XXH_P1 = 0x9e3779b185ebca87,
+    XXH_P2 = 0xc2b2ae3d27d4eb4f,
+    XXH_P3 = 0x165667b19e3779f9,
+    XXH_P4 = 0x85ebca77c2b2ae63,
+    XXH_P5 = 0x27d4eb2f165667c5;
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t xxh_round(uint64_t acc, uint64_t input) {
+    return rotl64(acc + (input * XXH_P2), 31) * XXH_P1;
+}
+
+static inline uint64_t xxh_merge(uint64_t h, uint64_t acc) {
+    return ((h ^ xxh_round(0, acc)) * XXH_P1) + XXH_P4;
+}
+
+static uint64_t xxh64(const void *data, size_t words) {
+    const uint8_t *p = static_cast<const uint8_t*>(data);
+    auto load = [&p]() {
+        uint64_t w;
+        memcpy(&w, p, sizeof(w));
+        p += sizeof(w);
+        return w;
+    };
+    uint64_t h;
+    size_t i = 0;
+    if(words >= 4) {
+        uint64_t acc[4] = { XXH_P1 + XXH_P2, XXH_P2, 0, 0 - XXH_P1 };
+        for(; (i + 4) <= words; i += 4) {
+            for(auto &a: acc) {
+                a = xxh_round(a, load());
+            }
+        }
+        h = rotl64(acc[0], 1) + rotl64(acc[1], 7) +
+            rotl64(acc[2], 12) + rotl64(acc[3], 18);
+        for(auto a: acc) {
+            h = xxh_merge(h, a);
+        }
+    } else {
+        h = XXH_P5;
+    }
+    h += words * sizeof(uint64_t);
+    for(; i < words; i++) {
+        h ^= xxh_round(0, load());
+        h = (rotl64(h, 27) * XXH_P1) + XXH_P4;
+    }
+    h ^= h >> 33;
+    h *= XXH_P2;
+    h ^= h >> 29;
+    h *= XXH_P3;
+    h ^= h >> 32;
+    return h;
+}
+
+
+//------------------------------------------------------------------------------
+// Voice sample addresses
+
+static int32_t rebase_masked(int32_t address, int32_t mask, int32_t delta) {
+    return (address & ~mask) | ((address + delta) & mask);
+}
+
+void rebase_voice(Voice &v, int32_t delta) {
+    v.data_start += delta;
+    v.data_end += delta;
+    v.play_start += delta;
+    v.play_end += delta;
+    for(auto &loop_start: v.loop_start) {
+        loop_start = rebase_masked(loop_start, LOOP_START_ADDRESS_MASK, delta);
+    }
+    for(auto &loop_end: v.loop_end) {
+        loop_end = rebase_masked(loop_end, LOOP_END_ADDRESS_MASK, delta);
+    }
+}
+
+
+std::string voice_wav_filename(
+    std::string_view base, size_t n, const Voice &v) {
+
+    char number[24];
+    snprintf(number, sizeof(number), "_%02zu", n + 1);
+    std::string name{ v.name, strnlen(v.name, sizeof(v.name)) };
+    while(!name.empty() && (name.back() == ' ')) {
+        name.pop_back();
+    }
+    for(char &c: name) {
+        if(!isalnum(static_cast<unsigned char>(c)) && (c != '-')) {
+            c = '_';
+        }
+    }
+    std::string result{ base };
+    result += number;
+    if(!name.empty()) {
+        result += '_';
+        result += name;
+    }
+    result += ".wav";
+    return result;
+}
+
+
 //------------------------------------------------------------------------------
 // MemoryBlocks
 
@@ -185,24 +635,16 @@ EffectBlockFileHeader *MemoryBlocks::effect_header() const {
 }
 
 Bank *MemoryBlocks::bank(size_t n) const {
-    if(auto *h = header()) {
-        if(n < h->bank_count) {
-            return bank_block(n);
-        }
+    const Section &s = sections_[BT_BANK];
+    if(n < s.length) {
+        return bank_block(s.start + n);
     }
     return nullptr;
 }
 
 Voice *MemoryBlocks::voice(size_t n) const {
-    size_t
-        bank_count = 0,
-        voice_count = 0;
-    if(auto *h = header()) {
-        bank_count = h->bank_count;
-        voice_count = h->voice_count;
-    }
-    if(n < voice_count) {
-        if(auto *vb = voice_block( bank_count + (n / 4) )) {
+    if(n < voice_count_) {
+        if(auto *vb = voice_block(sections_[BT_VOICE].start + (n / 4))) {
             return &(*vb)[n % 4];
         }
     }
@@ -210,19 +652,165 @@ Voice *MemoryBlocks::voice(size_t n) const {
 }
 
 Wave *MemoryBlocks::wave(size_t n) const {
-    size_t
-        offset = 0,
-        wave_block_count = 0;
-    if(auto *h = header()) {
-        offset = h->bank_count + ((h->voice_count + 3) / 4);
-        wave_block_count = h->wave_block_count;
-    }
-    if(n < wave_block_count) {
-        return wave_block(n + offset);
+    const Section &s = sections_[BT_WAVE];
+    if(n < s.length) {
+        return wave_block(s.start + n);
     }
     return nullptr;
 }
 
+Span<Bank, sizeof(BankBlock)> MemoryBlocks::banks() const {
+    const Section &s = sections_[BT_BANK];
+    if(s.length) {
+        return { bank_block(s.start), s.length };
+    }
+    return {};
+}
+
+Span<Voice, sizeof(VoicePad_)> MemoryBlocks::voices() const {
+    if(voice_count_) {
+        return { &(*voice_block(sections_[BT_VOICE].start))[0], voice_count_ };
+    }
+    return {};
+}
+
+Span<Wave> MemoryBlocks::waves() const {
+    const Section &s = sections_[BT_WAVE];
+    if(s.length) {
+        return { wave_block(s.start), s.length };
+    }
+    return {};
+}
+
+Span<int16_t> MemoryBlocks::samples() const {
+    auto wave_span = waves();
+    if(wave_span.empty()) {
+        return {};
+    }
+    constexpr size_t WAVE_SAMPLES = std::size(Wave{}.samples);
+    return { wave_span.data()->samples, wave_span.size() * WAVE_SAMPLES };
+}
+
+Span<int16_t> MemoryBlocks::samples(size_t offset, size_t count) const {
+    auto all = samples();
+    if((offset <= all.size()) && (count <= (all.size() - offset))) {
+        return { all.data() + offset, count };
+    }
+    return {};
+}
+
+Result MemoryBlocks::dump_wav(std::string_view filename, SampleRate freq,
+    size_t offset, size_t count, const WavOptions &options) const {
+
+    auto all = samples();
+    if(offset >= all.size()) {
+        return RESULT_WAVE_BAD_OFFSET;
+    }
+    // as with MemoryWave::dump_wav(), stop at the end of the wave data
+    count = std::min(count, all.size() - offset);
+    return write_wav(filename, freq, all.data() + offset, count, options);
+}
+
+Span<int16_t> MemoryBlocks::voice_samples(size_t n) const {
+    auto all = samples();
+    if(Voice *v = voice(n)) {
+        size_t
+            start = std::max(v->data_start, 0),
+            end = std::max(v->data_end, 0) + size_t{1};
+        end = std::min(end, all.size());
+        if(start < end) {
+            return { all.data() + start, end - start };
+        }
+    }
+    return {};
+}
+
+SampleAnalysis MemoryBlocks::analyze_voice(size_t n, int16_t silence) const {
+    return analyze_samples(voice_samples(n), silence);
+}
+
+std::vector<SampleAnalysis> MemoryBlocks::analyze_voices(int16_t silence) const {
+    std::vector<SampleAnalysis> analyses;
+    for(size_t n = 0; n < voices().size(); n++) {
+        analyses.push_back(analyze_voice(n, silence));
+    }
+    return analyses;
+}
+
+Result MemoryBlocks::dump_voice_wavs(std::string_view base,
+    const WavOptions &options, std::vector<std::string> *filenames) const {
+
+    if(filenames) {
+        filenames->clear();
+    }
+    // every voice is a view into the same (already loaded) wave data
+    for(size_t n = 0; n < voices().size(); n++) {
+        std::string filename;
+        auto result = dump_voice_wav(n, base, options, &filename);
+        if(!result_success(result)) {
+            return result;
+        }
+        if(filenames && !filename.empty()) {
+            filenames->push_back(std::move(filename));
+        }
+    }
+    return RESULT_OK;
+}
+
+Result MemoryBlocks::dump_voice_wav(size_t n, std::string_view base,
+    const WavOptions &options, std::string *filename) const {
+    return dump_voice_wav(n, base, options, filename, nullptr);
+}
+
+Result MemoryBlocks::dump_voice_wav(size_t n, std::string_view base,
+    const WavOptions &options, std::string *filename, WriteGate *gate) const {
+
+    if(filename) {
+        filename->clear();
+    }
+    Voice *v = voice(n);
+    if(!v) {
+        return RESULT_MISSING_VOICE;
+    }
+    auto data = voice_samples(n);
+    if(data.empty()) {
+        return RESULT_OK;
+    }
+    std::string name = voice_wav_filename(base, n, *v);
+    const auto info = wav_sampler_info(
+        *v, data.data() - samples().data(), data.size());
+    auto result = write_wav(name, SampleRate(v->frequency),
+        data.data(), data.size(), options, gate, &info);
+    if(result_success(result) && filename) {
+        *filename = std::move(name);
+    }
+    return result;
+}
+
+Result MemoryBlocks::render_voice_wav(size_t n, std::string_view filename,
+    const RenderNote &note, const WavOptions &options) const {
+
+    Voice *v = voice(n);
+    if(!v) {
+        return RESULT_MISSING_VOICE;
+    }
+    const uint32_t rate = options.rate ? options.rate : RENDER_RATE;
+    std::vector<float> out;
+    auto result = render_voice(*v, samples(), note, rate, out);
+    if(!result_success(result)) {
+        return result;
+    }
+    return write_wav_frames(
+        filename, out.data(), out.size(), 1, rate, options.format);
+}
+
+MemoryBlocks::Section MemoryBlocks::section(BlockType type) const {
+    if(type < BT_NONE) {
+        return sections_[type];
+    }
+    return {};
+}
+
 BlockType MemoryBlocks::block_type(size_t n) const {
     if(n < count_) {
         return block_types_[n];
@@ -244,11 +832,63 @@ char MemoryBlocks::block_type_as_char(size_t n) const {
 void MemoryBlocks::reset() {
     storage_.reset();
     block_types_.reset();
+    dirty_.reset();
+    hashes_.reset();
+    for(auto &s: sections_) {
+        s = {};
+    }
+    voice_count_ = 0;
     data_ = nullptr;
     count_ = 0;
     file_type_ = TYPE_UNKNOWN;
 }
 
+bool MemoryBlocks::is_dirty(size_t n) const {
+    return (n < count_) && dirty_[n];
+}
+
+size_t MemoryBlocks::dirty_count() const {
+    size_t dirty = 0;
+    for(size_t i = 0; i < count_; i++) {
+        dirty += dirty_[i];
+    }
+    return dirty;
+}
+
+void MemoryBlocks::clean() {
+    for(size_t i = 0; i < count_; i++) {
+        dirty_[i] = false;
+    }
+}
+
+void MemoryBlocks::touch(size_t n) {
+    assert(n < count_);
+    dirty_[n] = true;
+    hashes_[n] = xxh64(block_data(n), sizeof(UnknownBlock) / sizeof(uint64_t));
+}
+
+// (parse() has already hashed everything)
+void MemoryBlocks::touch_all() {
+    for(size_t i = 0; i < count_; i++) {
+        dirty_[i] = true;
+    }
+}
+
+uint64_t MemoryBlocks::block_hash(size_t n) const {
+    return (n < count_) ? hashes_[n] : 0;
+}
+
+uint64_t MemoryBlocks::digest() const {
+    return xxh64(hashes_.get(), count_);
+}
+
+void MemoryBlocks::rehash() {
+    for(size_t i = 0; i < count_; i++) {
+        hashes_[i] = xxh64(
+            block_data(i), sizeof(UnknownBlock) / sizeof(uint64_t));
+    }
+}
+
 Result MemoryBlocks::unpack(MemoryObjectPtr& object) {
     object = nullptr;
     auto *h = header();
@@ -263,86 +903,294 @@ Result MemoryBlocks::unpack(MemoryObjectPtr& object) {
         Effect *e = effect_header();
         assert(e);
         current = MemoryEffect::create(*e, current);
+        current->dirty_ = false;
         if(!first) { first = current; }
     }
-    size_t
-        bank_count = h->bank_count,
-        voice_count = h->voice_count,
-        wave_count = h->wave_block_count;
-    for(size_t i = 0; i < bank_count; i++) {
-        if(Bank *b = bank(i)) {
-            current = MemoryBank::create(*b, current);
-            if(!first) { first = current; }
-        } else {
-            return RESULT_MISSING_BANK;
-        }
+    auto bank_span = banks();
+    auto voice_span = voices();
+    auto wave_span = waves();
+    if(bank_span.size() != h->bank_count) {
+        return RESULT_MISSING_BANK;
     }
-    for(size_t i = 0; i < voice_count; i++) {
-        if(Voice *v = voice(i)) {
-            current = MemoryVoice::create(*v, current);
-            if(!first) { first = current; }
-        } else {
-            return RESULT_MISSING_VOICE;
-        }
+    if(voice_span.size() != h->voice_count) {
+        return RESULT_MISSING_VOICE;
     }
-    for(size_t i = 0; i < wave_count; i++) {
-        if(Wave *w = wave(i)) {
-            current = MemoryWave::create(*w, current);
-            if(!first) { first = current; }
-        } else {
-            return RESULT_MISSING_WAVE;
-        }
+    if(wave_span.size() != static_cast<size_t>(h->wave_block_count)) {
+        return RESULT_MISSING_WAVE;
+    }
+    for(Bank &b: bank_span) {
+        current = MemoryBank::create(b, current);
+        current->dirty_ = false;
+        if(!first) { first = current; }
+    }
+    for(Voice &v: voice_span) {
+        current = MemoryVoice::create(v, current);
+        current->dirty_ = false;
+        if(!first) { first = current; }
     }
+    for(Wave &w: wave_span) {
+        current = MemoryWave::create(w, current);
+        current->dirty_ = false;
+        if(!first) { first = current; }
+    }
+    // remember where each object came from, so that repack() can tell if it
+    // has been moved since
+    MemoryObject::place(first,
+        [](auto &object, size_t block_index, size_t index) {
+            object.placed_ = (block_index * 4) + index;
+        });
     object = first;
     return RESULT_OK;
 }
 
-void *MemoryBlocks::block_data(size_t n) const {
-    return (n < count_) ? &static_cast<UnknownBlock*>(data_)[n] : nullptr;
-}
-
+Result MemoryBlocks::merge(const std::vector<const MemoryBlocks*> &in,
+    MemoryBlocks &out, FzFileType type) {
 
-Result MemoryBlocks::load(std::unique_ptr<uint8_t[]> &&storage, size_t count) {
-    if(count) {
-        storage_ = std::move(storage);
-        data_ = storage_.get();
-        count_ = count;
-        file_type_ = FzFileType{ header()->file_type };
-    } else {
-        file_type_ = TYPE_UNKNOWN;
+    constexpr size_t WAVE_SAMPLES = std::size(Wave{}.samples);
+    size_t
+        bank_count = 0,
+        voice_count = 0,
+        wave_count = 0;
+    const Effect *effect = nullptr;
+    for(const MemoryBlocks *mb: in) {
+        if(!mb || !mb->header()) {
+            return RESULT_BAD_HEADER;
+        }
+        if(!effect && mb->section(BT_EFFECT).length) {
+            effect = mb->effect_header();
+        }
+        bank_count += mb->banks().size();
+        voice_count += mb->voices().size();
+        wave_count += mb->waves().size();
+    }
+    size_t
+        voice_block_count = (voice_count + 3) / 4,
+        n = bank_count + voice_block_count + wave_count;
+    if(!n) {
         return RESULT_NO_BLOCKS;
     }
-    return parse();
-}
-
+    // the file header lives in block 0, so that can't be a wave block
+    if(!bank_count && !voice_count) {
+        return RESULT_MISSING_VOICE;
+    }
+    // (the header counts are 8 and 16 bits wide, and a bank's voice_index
+    // can only refer to voices 0-63)
+    if( (bank_count > UINT8_MAX) || (voice_count > Bank::MAXV) ||
+        (n > INT16_MAX) ) {
+        return RESULT_MERGE_TOO_LARGE;
+    }
 
-Result MemoryBlocks::parse() {
-    block_types_ = std::make_unique<BlockType[]>(count_);
-    FzFileHeader *h = header();
+    // one allocation for the whole image, written section by section
+    auto storage = std::make_unique<uint8_t[]>(n * 1024);
+    auto *blocks = reinterpret_cast<UnknownBlock*>(storage.get());
+    auto *bank_blocks = static_cast<BankBlock*>(
+        static_cast<Block*>(blocks));
+    auto *voice_blocks = static_cast<VoiceBlock*>(
+        static_cast<Block*>(blocks + bank_count));
+    auto *wave_blocks = static_cast<WaveBlock*>(
+        static_cast<Block*>(blocks + bank_count + voice_block_count));
     size_t
-        bank_blocks = h->bank_count,
-        voice_blocks = h->voice_count,
-        wave_blocks = h->wave_block_count,
-        iterator = 0;
-    if(!bank_blocks && !voice_blocks) {
-        if(h->block_count == 1) {
-            block_types_[0] = BT_EFFECT;
-            return RESULT_OK;
+        bank_base = 0,
+        voice_base = 0,
+        wave_base = 0;
+    for(const MemoryBlocks *mb: in) {
+        for(const Bank &b: mb->banks()) {
+            Bank &dst = bank_blocks[bank_base++];
+            dst = b;
+            const size_t used = std::min<size_t>(b.voice_count, b.MAXV);
+            for(size_t i = 0; i < used; i++) {
+                dst.voice_index[i] += voice_base;
+            }
         }
-    }
-    if(bank_blocks) {
-        if(bank_blocks > count_) {
-            return RESULT_MISMATCHED_BANK_BLOCK;
+        auto delta = static_cast<int32_t>(wave_base * WAVE_SAMPLES);
+        for(const Voice &v: mb->voices()) {
+            Voice &dst = voice_blocks[voice_base / 4][voice_base % 4];
+            dst = v;
+            rebase_voice(dst, delta);
+            voice_base++;
         }
-        for(size_t i = 0; i < bank_blocks; i++) {
-            block_types_[iterator++] = BT_BANK;
+        auto wave_span = mb->waves();
+        if(!wave_span.empty()) {
+            memcpy(&wave_blocks[wave_base], wave_span.data(),
+                wave_span.size() * sizeof(WaveBlock));
+            wave_base += wave_span.size();
         }
     }
-    if(voice_blocks) {
-        size_t voice_count = (voice_blocks + 3) / 4;
+    if(effect && (type == TYPE_FULL)) {
+        Effect &dst = *static_cast<EffectBlock*>(static_cast<Block*>(blocks));
+        dst = *effect;
+    }
+    blocks->header = {
+        .indicator = FzFileHeader::INDICATOR,
+        .version = 1,
+        .file_type = type,
+        .bank_count = static_cast<uint8_t>(bank_count),
+        .voice_count = static_cast<uint8_t>(voice_count),
+        .unused1_ = 0,
+        .block_count = static_cast<int16_t>(n),
+        .wave_block_count = static_cast<int16_t>(wave_count),
+        .unused2_ = 0,
+    };
+
+    out.reset();
+    auto result = out.load(std::move(storage), n);
+    if(result_success(result)) {
+        out.touch_all();
+    }
+    return result;
+}
+
+// The lowest and highest sample addresses used by a voice: its data and play
+// ranges, plus loops up to loop_end_point (which may be 8, for all loops)
+static void voice_address_range(const Voice &v, int32_t &lo, int32_t &hi) {
+    lo = std::min({ v.data_start, v.data_end, v.play_start, v.play_end });
+    hi = std::max({ v.data_start, v.data_end, v.play_start, v.play_end });
+    size_t loops = std::min<size_t>(
+        std::max<int8_t>(v.loop_end_point, 0) + 1, std::size(v.loop_start));
+    for(size_t i = 0; i < loops; i++) {
+        int32_t
+            start = v.loop_start[i] & LOOP_START_ADDRESS_MASK,
+            end = v.loop_end[i] & LOOP_END_ADDRESS_MASK;
+        lo = std::min({ lo, start, end });
+        hi = std::max({ hi, start, end });
+    }
+}
+
+Result MemoryBlocks::compact(size_t *removed) {
+    constexpr size_t WAVE_SAMPLES = std::size(Wave{}.samples);
+    if(removed) {
+        *removed = 0;
+    }
+    if(!header()) {
+        return RESULT_BAD_HEADER;
+    }
+    auto wave_span = waves();
+    auto voice_span = voices();
+    size_t wave_count = wave_span.size();
+    if(!wave_count) {
+        return RESULT_OK;
+    }
+
+    // mark the blocks covered by each voice
+    auto live = std::make_unique<bool[]>(wave_count);
+    for(const Voice &v: voice_span) {
+        int32_t lo, hi;
+        voice_address_range(v, lo, hi);
+        size_t
+            first = std::max(lo, 0) / WAVE_SAMPLES,
+            last = std::min<size_t>(std::max(hi, 0) / WAVE_SAMPLES,
+                wave_count - 1);
+        for(size_t b = first; b <= last; b++) {
+            live[b] = true;
+        }
+    }
+
+    // new_index[b] is where block b will end up, if it's kept
+    auto new_index = std::make_unique<size_t[]>(wave_count);
+    size_t kept = 0;
+    for(size_t b = 0; b < wave_count; b++) {
+        new_index[b] = kept;
+        kept += live[b];
+    }
+    if(kept == wave_count) {
+        return RESULT_OK;
+    }
+
+    // each voice lies inside a single run of live blocks, which moves as one
+    for(Voice &v: voice_span) {
+        int32_t lo, hi;
+        voice_address_range(v, lo, hi);
+        size_t first = std::max(lo, 0) / WAVE_SAMPLES;
+        if(first < wave_count) {
+            // (blocks only ever move down)
+            auto delta = static_cast<int32_t>(
+                (first - new_index[first]) * WAVE_SAMPLES);
+            rebase_voice(v, -delta);
+        }
+    }
+    for(size_t b = 0; b < wave_count; b++) {
+        if(live[b] && (new_index[b] != b)) {
+            wave_span[new_index[b]] = wave_span[b];
+        }
+    }
+
+    size_t dropped = wave_count - kept;
+    FzFileHeader *h = header();
+    h->block_count -= dropped;
+    h->wave_block_count -= dropped;
+    count_ -= dropped;
+    auto result = parse();
+    if(result_success(result)) {
+        touch_all();
+        if(removed) {
+            *removed = dropped;
+        }
+    }
+    return result;
+}
+
+void *MemoryBlocks::block_data(size_t n) const {
+    return (n < count_) ? &static_cast<UnknownBlock*>(data_)[n] : nullptr;
+}
+
+
+Result MemoryBlocks::load(std::unique_ptr<uint8_t[]> &&storage, size_t count) {
+    if(count) {
+        storage_ = std::move(storage);
+        data_ = storage_.get();
+        count_ = count;
+        file_type_ = FzFileType{ header()->file_type };
+    } else {
+        file_type_ = TYPE_UNKNOWN;
+        return RESULT_NO_BLOCKS;
+    }
+    return parse();
+}
+
+
+Result MemoryBlocks::parse() {
+    block_types_ = std::make_unique<BlockType[]>(count_);
+    dirty_ = std::make_unique<bool[]>(count_);
+    hashes_ = std::make_unique<uint64_t[]>(count_);
+    rehash();
+    // the section table is only filled in once the layout is known to be valid
+    for(auto &s: sections_) {
+        s = {};
+    }
+    voice_count_ = 0;
+    FzFileHeader *h = header();
+    size_t
+        bank_blocks = h->bank_count,
+        voice_blocks = h->voice_count,
+        wave_blocks = h->wave_block_count,
+        iterator = 0;
+    Section
+        effect = { 0, (file_type_ == TYPE_FULL) ? size_t{1} : 0 },
+        bank,
+        voice,
+        wave;
+    if(!bank_blocks && !voice_blocks) {
+        if(h->block_count == 1) {
+            block_types_[0] = BT_EFFECT;
+            sections_[BT_EFFECT] = { 0, 1 };
+            return RESULT_OK;
+        }
+    }
+    if(bank_blocks) {
+        if(bank_blocks > count_) {
+            return RESULT_MISMATCHED_BANK_BLOCK;
+        }
+        bank = { iterator, bank_blocks };
+        for(size_t i = 0; i < bank_blocks; i++) {
+            block_types_[iterator++] = BT_BANK;
+        }
+    }
+    if(voice_blocks) {
+        size_t voice_count = (voice_blocks + 3) / 4;
         if((voice_count + iterator) > count_) {
             return RESULT_MISMATCHED_VOICE_BLOCK;
         }
+        voice = { iterator, voice_count };
         for(size_t i = 0; i < voice_count; i++) {
             block_types_[iterator++] = BT_VOICE;
         }
@@ -351,6 +1199,7 @@ Result MemoryBlocks::parse() {
         if(wave_blocks + iterator > count_) {
             return RESULT_MISMATCHED_WAVE_BLOCK;
         }
+        wave = { iterator, wave_blocks };
         for(size_t i = 0; i < wave_blocks; i++) {
             block_types_[iterator++] = BT_WAVE;
         }
@@ -358,6 +1207,11 @@ Result MemoryBlocks::parse() {
     if(iterator != count_) {
         return RESULT_MISMATCHED_BLOCK_COUNT;
     }
+    sections_[BT_EFFECT] = effect;
+    sections_[BT_BANK] = bank;
+    sections_[BT_VOICE] = voice;
+    sections_[BT_WAVE] = wave;
+    voice_count_ = voice_blocks;
     return RESULT_OK;
 }
 
@@ -368,11 +1222,9 @@ Result MemoryBlocks::parse() {
 template<typename T, typename U>
 auto MemoryObject::create(const U &u, MemoryObjectPtr prev) {
     auto result = std::make_shared<T>(Lock{}, u, prev);
-    if(prev) {
-        // link() must be called *after* the result object is fully constructed
-        // (otherwise a std::bad_weak_ptr exception is thrown)
-        prev->link(result);
-    }
+    // link() must be called *after* the result object is fully constructed
+    // (otherwise a std::bad_weak_ptr exception is thrown)
+    link(prev, result);
     return result;
 }
 
@@ -396,6 +1248,60 @@ MemoryObjectPtr MemoryObject::insert_before(MemoryObjectPtr obj) {
     return shared_from_this();
 }
 
+MemoryObjectPtr MemoryObject::remove() {
+    auto self = shared_from_this(); // (in case only the list holds this)
+    auto p = prev_.lock();
+    auto n = next_;
+    if(p) {
+        p->next_ = n;
+    }
+    if(n) {
+        n->prev_ = p;
+    }
+    prev_.reset();
+    next_.reset();
+    return n;
+}
+
+template<typename F>
+size_t MemoryObject::place(const MemoryObjectPtr &in, F &&f) {
+    size_t
+        voice_index = 0,
+        i = 0;
+    // any partially filled voice block is closed by the next non-voice object
+    auto end_voice_block = [&] {
+        if(voice_index) {
+            voice_index = 0;
+            i++;
+        }
+    };
+    visit(in, overloaded{
+        [&](MemoryEffect &effect) {
+            end_voice_block();
+            f(effect, i, 0);
+        },
+        [&](MemoryBank &bank) {
+            end_voice_block();
+            f(bank, i, 0);
+            i++;
+        },
+        [&](MemoryVoice &voice) {
+            f(voice, i, voice_index);
+            if(++voice_index == 4) {
+                voice_index = 0;
+                i++;
+            }
+        },
+        [&](MemoryWave &wave) {
+            end_voice_block();
+            f(wave, i, 0);
+            i++;
+        },
+    });
+    end_voice_block();
+    return i;
+}
+
 Result MemoryObject::pack(MemoryObjectPtr in, MemoryBlocks &out, FzFileType type) {
     // TODO: this current implementation assumes that the input list is sorted
     //   (i.e.) (Effect->)Bank(s)->Voice(s)->Wave(s). It will probably break if
@@ -407,8 +1313,7 @@ Result MemoryObject::pack(MemoryObjectPtr in, MemoryBlocks &out, FzFileType type
         bank_count = 0,
         voice_count = 0,
         wave_count = 0;
-    auto o = in;
-    while(o) {
+    for(MemoryObject *o = in.get(); o; o = o->next_.get()) {
         switch(o->type()) {
             case BT_BANK: {
                 bank_count++;
@@ -435,7 +1340,6 @@ Result MemoryObject::pack(MemoryObjectPtr in, MemoryBlocks &out, FzFileType type
                 return RESULT_BAD_BLOCK;
             }
         }
-        o = o->next();
     }
     if(!n) {
         return RESULT_NO_BLOCKS;
@@ -467,39 +1371,83 @@ Result MemoryObject::pack(MemoryObjectPtr in, MemoryBlocks &out, FzFileType type
         .unused2_ = 0,
     };
 
-    o = in;
-    size_t
-        voice_index = 0,
-        i = 0;
-    while(o && i < n) {
-        const bool is_voice = o->type() == BT_VOICE;
-        if(!is_voice) {
-            if(voice_index) {
-                voice_index = 0;
-                i++;
-            }
-        }
-        size_t index = is_voice ? voice_index : 0;
-        if(!o->pack(block + i, index)) {
-            return RESULT_BAD_BLOCK_INDEX;
-        }
-        if(is_voice) {
-            voice_index++;
-            if(voice_index == 4) {
-                voice_index = 0;
-                i++;
-            }
-        } else {
-            if(o->type() != BT_EFFECT) {
-                i++;
+    bool packed = true;
+    size_t i = place(in, [&](auto &object, size_t block_index, size_t index) {
+        if(block_index < n) {
+            if(!object.pack(block + block_index, index)) {
+                packed = false;
             }
+            object.dirty_ = false;
+            object.placed_ = (block_index * 4) + index;
         }
-        o = o->next();
+    });
+    if(!packed) {
+        return RESULT_BAD_BLOCK_INDEX;
     }
     if(i != n) {
         return RESULT_MISMATCHED_BLOCK_COUNT;
     }
-    return out.load(std::move(storage), n);
+    auto result = out.load(std::move(storage), n);
+    if(result_success(result)) {
+        // everything is new, as far as any previous dump is concerned
+        out.touch_all();
+    }
+    return result;
+}
+
+Result MemoryObject::repack(MemoryObjectPtr in, MemoryBlocks &out) {
+    auto *h = out.header();
+    if(!h) {
+        return RESULT_NO_BLOCKS;
+    }
+    size_t
+        effect_count = 0,
+        bank_count = 0,
+        voice_count = 0,
+        wave_count = 0;
+    visit(in, overloaded{
+        [&](MemoryEffect &) { effect_count++; },
+        [&](MemoryBank &) { bank_count++; },
+        [&](MemoryVoice &) { voice_count++; },
+        [&](MemoryWave &) { wave_count++; },
+    });
+    const FzFileType file_type = out.file_type();
+    const bool has_effect =
+        (file_type == TYPE_FULL) || (file_type == TYPE_EFFECT);
+    if( (effect_count != (has_effect ? 1 : 0)) ||
+        (bank_count != h->bank_count) ||
+        (voice_count != h->voice_count) ||
+        (wave_count != static_cast<size_t>(h->wave_block_count)) ) {
+        return RESULT_MISMATCHED_BLOCK_COUNT;
+    }
+    // Matching counts aren't enough: the objects must also land in blocks of
+    // their own type (the effect shares block 0 with whatever follows it)
+    bool matched = true;
+    size_t n = place(in, [&](auto &object, size_t block_index, size_t) {
+        if( (object.type_ != BT_EFFECT) &&
+            (out.block_type(block_index) != object.type_) ) {
+            matched = false;
+        }
+    });
+    if(!matched || (n != out.count())) {
+        return RESULT_MISMATCHED_BLOCK_COUNT;
+    }
+    // An object which has moved (e.g. by remove() and insert_after()) is
+    // rewritten in its new place, even if its data is unchanged
+    bool packed = true;
+    place(in, [&](auto &object, size_t block_index, size_t index) {
+        const size_t placed = (block_index * 4) + index;
+        if(object.dirty_ || (object.placed_ != placed)) {
+            if(!object.pack(out.block(block_index), index)) {
+                packed = false;
+                return;
+            }
+            out.touch(block_index);
+            object.dirty_ = false;
+            object.placed_ = placed;
+        }
+    });
+    return packed ? RESULT_OK : RESULT_BAD_BLOCK_INDEX;
 }
 
 
@@ -513,7 +1461,7 @@ std::shared_ptr<MemoryBank> MemoryBank::create(
 }
 
 MemoryBank::MemoryBank(Lock, const XmlElement &element, MemoryObjectPtr prev):
-    MemoryObject(prev) {
+    MemoryObject(BT_BANK, prev) {
 #define READ_VALUE_ARRAY(name_, count_) \
     read_value_array(element, #name_, count_, bank_.name_)
 
@@ -583,7 +1531,7 @@ std::shared_ptr<MemoryEffect> MemoryEffect::create(
 }
 
 MemoryEffect::MemoryEffect(Lock, const XmlElement &element, MemoryObjectPtr prev):
-    MemoryObject(prev) {
+    MemoryObject(BT_EFFECT, prev) {
 #define READ_VALUE(name_) \
     read_value(element, #name_, effect_.name_)
 
@@ -667,7 +1615,7 @@ std::shared_ptr<MemoryVoice> MemoryVoice::create(
 }
 
 MemoryVoice::MemoryVoice(Lock, const XmlElement &element, MemoryObjectPtr prev):
-    MemoryObject(prev) {
+    MemoryObject(BT_VOICE, prev) {
 #define READ_VALUE(name_) \
     read_value(element, #name_, voice_.name_)
 #define READ_UNSIGNED_VALUE(name_) \
@@ -806,8 +1754,25 @@ std::shared_ptr<MemoryWave> MemoryWave::create(
     return MemoryObject::create<MemoryWave>(u, prev);
 }
 
+std::shared_ptr<MemoryWave> MemoryWave::create(
+    const int16_t *samples, size_t count, MemoryObjectPtr prev) {
+    auto result = std::make_shared<MemoryWave>(Lock{}, samples, count, prev);
+    link(prev, result);
+    return result;
+}
+
+MemoryWave::MemoryWave(
+    Lock, const int16_t *samples, size_t count, MemoryObjectPtr prev):
+    MemoryObject(BT_WAVE, prev) {
+    if(count > 512) {
+        count = 512;
+    }
+    memcpy(wave_.samples, samples, count * sizeof(int16_t));
+    memset(wave_.samples + count, 0, (512 - count) * sizeof(int16_t));
+}
+
 MemoryWave::MemoryWave(Lock, const XmlElement &element, MemoryObjectPtr prev):
-    MemoryObject(prev) {
+    MemoryObject(BT_WAVE, prev) {
 
     read_unsigned_value(element, "index", index_);
     const char
@@ -822,6 +1787,9 @@ MemoryWave::MemoryWave(Lock, const XmlElement &element, MemoryObjectPtr prev):
         wave_.samples[index++] = static_cast<int16_t>(sample);
         current += 4;
     }
+    // samples are decoded straight into wave_, so any short text must not leave
+    // the remainder uninitialized
+    memset(wave_.samples + index, 0, (512 - index) * sizeof(int16_t));
 }
 
 bool MemoryWave::pack(Block *block, size_t index) {
@@ -856,19 +1824,14 @@ void MemoryWave::print(XmlPrinter &p) {
     p.CloseElement();
 }
 
-Result MemoryWave::dump_wav(
-    std::string_view filename, SampleRate freq, size_t offset, size_t count) {
+Result MemoryWave::dump_wav(std::string_view filename, SampleRate freq,
+    size_t offset, size_t count, const WavOptions &options) {
 
-    int32_t samplerate = 0;
-    switch(freq) {
-        case SR_36kHz: samplerate = 36000; break;
-        case SR_18kHz: samplerate = 18000; break;
-        case SR_9kHz: samplerate = 9000; break;
-        default: return RESULT_WAVE_BAD_SAMPLERATE;
+    if(!sample_rate_hz(freq)) {
+        return RESULT_WAVE_BAD_SAMPLERATE;
     }
-    assert(samplerate);
 
-    auto iter = shared_from_this();
+    MemoryObjectPtr iter = shared_from_this();
     while((offset >= 512) && iter) {
         offset -= 512;
         iter = iter->next();
@@ -877,13 +1840,9 @@ Result MemoryWave::dump_wav(
         }
     }
 
-    TinyWav tw;
-    float float_buffer[512];
-    int r = tinywav_open_write(
-        &tw, 1, samplerate, TW_FLOAT32, TW_INTERLEAVED, filename.data());
-    if(r) {
-        return RESULT_WAVE_OPEN_ERROR;
-    }
+    // gather the range from consecutive waves, then write it in one go
+    std::vector<int16_t> samples;
+    samples.reserve(count);
     while(iter && count) {
         size_t len = 0;
         if(offset < 512) {
@@ -894,132 +1853,1215 @@ Result MemoryWave::dump_wav(
         }
         auto *wave = iter->wave();
         assert(wave);
-        for(size_t i = 0; i < len; i++) {
-            float_buffer[i] = wave->samples[i + offset] / 32768.f;
-        }
-
-        int samples = tinywav_write_f(&tw, float_buffer, len);
-        if(samples != static_cast<int>(len)) {
-            return RESULT_WAVE_WRITE_ERROR;
-        }
+        samples.insert(samples.end(),
+            wave->samples + offset, wave->samples + offset + len);
         count -= len;
         offset = 0;
         iter = iter->next();
     }
-    tinywav_close_write(&tw);
-    return RESULT_OK;
+    return write_wav(filename, freq, samples.data(), samples.size(), options);
 }
 
 //------------------------------------------------------------------------------
-// Loader
+// MemorySnapshot
 
-Result Loader::flag_check(uint8_t flags) {
-    if(flags & FILE_OPEN_ERROR) {
-        return RESULT_FILE_OPEN_ERROR;
-    }
-    if(flags & FILE_READ_ERROR) {
-        return RESULT_FILE_READ_ERROR;
-    }
-    if(flags & XML_PARSE_ERROR) {
-        return RESULT_XML_PARSE_ERROR;
-    }
-    return RESULT_OK;
+MemorySnapshotPtr MemorySnapshot::capture(const MemoryObjectPtr &first) {
+    std::vector<ChunkPtr> chunks;
+    std::shared_ptr<Chunk> chunk;
+    auto add = [&](auto &&payload) {
+        if(!chunk || chunk->size() == CHUNK_SIZE) {
+            chunk = std::make_shared<Chunk>();
+            chunk->reserve(CHUNK_SIZE);
+            chunks.push_back(chunk);
+        }
+        chunk->push_back(std::make_shared<const Payload>(payload));
+    };
+    visit(first, overloaded{
+        [&](MemoryBank &b) { add(*b.bank()); },
+        [&](MemoryEffect &e) { add(*e.effect()); },
+        [&](MemoryVoice &v) { add(*v.voice()); },
+        [&](MemoryWave &w) { add(*w.wave()); },
+    });
+    return std::make_shared<const MemorySnapshot>(Lock{}, std::move(chunks));
 }
 
+MemorySnapshotPtr MemorySnapshot::empty() {
+    return std::make_shared<const MemorySnapshot>(
+        Lock{}, std::vector<ChunkPtr>{});
+}
 
-//------------------------------------------------------------------------------
-// BlockLoader
-
-BlockLoader::BlockLoader(std::string_view filename) {
-    FILE *file = fopen(filename.data(), "rb");
-    if(!file) {
-        flags_ |= FILE_OPEN_ERROR;
-        return;
+MemorySnapshot::MemorySnapshot(Lock, std::vector<ChunkPtr> &&chunks):
+    chunks_(std::move(chunks)) {
+    offsets_.reserve(chunks_.size());
+    for(const auto &chunk: chunks_) {
+        offsets_.push_back(count_);
+        count_ += chunk->size();
     }
-    FileCloser close_file(file);
+}
 
-    fseek(file, 0, SEEK_END);
-    size_ = ftell(file);
-    if(size_) {
-        rewind(file);
-        storage_ = std::make_unique<uint8_t[]>(size_);
-        size_t r = fread(storage_.get(), size_, 1, file);
-        if(r == 1) {
-            return;
+MemoryObjectPtr MemorySnapshot::unpack() const {
+    MemoryObjectPtr
+        current,
+        first;
+    for(const auto &chunk: chunks_) {
+        for(const auto &item: *chunk) {
+            std::visit([&current](const auto &payload) {
+                using T = std::decay_t<decltype(payload)>;
+                if constexpr(std::is_same_v<T, Bank>) {
+                    current = MemoryBank::create(payload, current);
+                } else if constexpr(std::is_same_v<T, Effect>) {
+                    current = MemoryEffect::create(payload, current);
+                } else if constexpr(std::is_same_v<T, Voice>) {
+                    current = MemoryVoice::create(payload, current);
+                } else {
+                    current = MemoryWave::create(payload, current);
+                }
+            }, *item);
+            if(!first) { first = current; }
         }
     }
-    flags_ |= FILE_READ_ERROR;
-    storage_ = nullptr;
-    size_ = 0;
+    return first;
 }
 
-BlockLoader::BlockLoader(std::unique_ptr<uint8_t[]>&& storage, size_t size):
-    storage_(std::move(storage)),
-    size_(size) {}
+BlockType MemorySnapshot::type(size_t n) const {
+    if(auto *p = payload(n)) {
+        return static_cast<BlockType>(p->index());
+    }
+    return BT_NONE;
+}
 
-BlockLoader::BlockLoader(const void *storage, size_t size):
-    storage_(std::make_unique<uint8_t[]>(size)),
-    size_(size) {
-    memcpy(storage_.get(), storage, size);
+const Bank *MemorySnapshot::bank(size_t n) const {
+    auto *p = payload(n);
+    return p ? std::get_if<Bank>(p) : nullptr;
 }
 
-Result BlockLoader::load(MemoryBlocks &mb) {
-    mb.reset();
-    if(auto r = flag_check(flags_); !result_success(r)) {
-        return r;
-    }
-    if(!size_) {
-        return RESULT_NO_BLOCKS;
+const Effect *MemorySnapshot::effect(size_t n) const {
+    auto *p = payload(n);
+    return p ? std::get_if<Effect>(p) : nullptr;
+}
+
+const Voice *MemorySnapshot::voice(size_t n) const {
+    auto *p = payload(n);
+    return p ? std::get_if<Voice>(p) : nullptr;
+}
+
+const Wave *MemorySnapshot::wave(size_t n) const {
+    auto *p = payload(n);
+    return p ? std::get_if<Wave>(p) : nullptr;
+}
+
+MemorySnapshotPtr MemorySnapshot::replace(size_t n, Payload payload) const {
+    if(n >= count_) {
+        return nullptr;
     }
-    if(size_ % 1024) {
-        return RESULT_BAD_FILE_SIZE;
+    auto item = std::make_shared<const Payload>(std::move(payload));
+    return edit(n, [&item](Chunk &chunk, size_t i) {
+        chunk[i] = std::move(item);
+    });
+}
+
+MemorySnapshotPtr MemorySnapshot::insert(size_t n, Payload payload) const {
+    if(n > count_) {
+        return nullptr;
     }
-    const auto &h = header_(storage_.get());
-    if(h.indicator != FzFileHeader::INDICATOR) {
-        return RESULT_BAD_HEADER;
+    auto item = std::make_shared<const Payload>(std::move(payload));
+    if(chunks_.empty()) {
+        auto chunk = std::make_shared<const Chunk>(Chunk{ std::move(item) });
+        return std::make_shared<const MemorySnapshot>(
+            Lock{}, std::vector<ChunkPtr>{ std::move(chunk) });
     }
-    if(h.version != 1) {
-        return RESULT_BAD_FILE_VERSION;
+    // appending goes into the last chunk
+    if(n == count_) {
+        return edit(n - 1, [&item](Chunk &chunk, size_t) {
+            chunk.push_back(std::move(item));
+        });
     }
-    int16_t blocks = size_ / 1024;
-    if(blocks != h.block_count) {
-        return RESULT_BAD_BLOCK_COUNT;
+    return edit(n, [&item](Chunk &chunk, size_t i) {
+        chunk.insert(chunk.begin() + i, std::move(item));
+    });
+}
+
+MemorySnapshotPtr MemorySnapshot::erase(size_t n) const {
+    if(n >= count_) {
+        return nullptr;
     }
-    return mb.load(std::move(storage_), blocks);
+    return edit(n, [](Chunk &chunk, size_t i) {
+        chunk.erase(chunk.begin() + i);
+    });
 }
 
+const MemorySnapshot::Payload *MemorySnapshot::payload(size_t n) const {
+    if(n < count_) {
+        size_t c = chunk_of(n);
+        return (*chunks_[c])[n - offsets_[c]].get();
+    }
+    return nullptr;
+}
 
-//------------------------------------------------------------------------------
-// XmlLoader
+size_t MemorySnapshot::chunk_of(size_t n) const {
+    assert(n < count_);
+    auto it = std::upper_bound(offsets_.begin(), offsets_.end(), n);
+    return (it - offsets_.begin()) - 1;
+}
 
-XmlLoader::XmlLoader(std::string_view filename) {
-    FILE *file = fopen(filename.data(), "rb");
-    if(!file) {
-        flags_ |= FILE_OPEN_ERROR;
-        return;
-    }
-    FileCloser close_file(file);
+// Copy-on-write edit of the single chunk containing object n: every other
+// chunk (and every object) is shared with this version. Chunks which grow too
+// large are split, and empty chunks are dropped.
+template<typename F>
+MemorySnapshotPtr MemorySnapshot::edit(size_t n, F &&change) const {
+    size_t c = chunk_of(n);
+    auto chunk = std::make_shared<Chunk>(*chunks_[c]);
+    change(*chunk, n - offsets_[c]);
 
-    fseek(file, 0, SEEK_END);
-    size_t size = ftell(file);
-    std::unique_ptr<char[]> storage;
-    if(size) {
-        rewind(file);
-        storage = std::make_unique<char[]>(size);
-        size_t r = fread(storage.get(), size, 1, file);
-        if(r != 1) {
-            flags_ |= FILE_READ_ERROR;
-            return;
-        }
-    }
-    xml_ = std::make_unique<XmlDocument>();
-    auto e = xml_->Parse(storage.get(), size);
-    if(e != tinyxml2::XML_SUCCESS) {
-        flags_ |= XML_PARSE_ERROR;
+    std::vector<ChunkPtr> chunks;
+    chunks.reserve(chunks_.size() + 1);
+    chunks.insert(chunks.end(), chunks_.begin(), chunks_.begin() + c);
+    if(chunk->size() > 2 * CHUNK_SIZE) {
+        auto tail = std::make_shared<Chunk>(
+            chunk->begin() + CHUNK_SIZE, chunk->end());
+        chunk->resize(CHUNK_SIZE);
+        chunks.push_back(std::move(chunk));
+        chunks.push_back(std::move(tail));
+    } else if(!chunk->empty()) {
+        chunks.push_back(std::move(chunk));
     }
+    chunks.insert(chunks.end(), chunks_.begin() + c + 1, chunks_.end());
+    return std::make_shared<const MemorySnapshot>(Lock{}, std::move(chunks));
 }
 
-XmlLoader::XmlLoader(std::unique_ptr<XmlDocument> &&xml):
+
+//------------------------------------------------------------------------------
+// SnapshotPublisher
+
+MemorySnapshotPtr SnapshotPublisher::load() const {
+    return std::atomic_load(&current_);
+}
+
+void SnapshotPublisher::publish(MemorySnapshotPtr snapshot) {
+    std::atomic_store(&current_, std::move(snapshot));
+}
+
+bool SnapshotPublisher::publish(
+    MemorySnapshotPtr &expected, MemorySnapshotPtr desired) {
+    return std::atomic_compare_exchange_strong(
+        &current_, &expected, std::move(desired));
+}
+
+
+//------------------------------------------------------------------------------
+// Memory budget planning
+
+Result voice_footprints(
+    const MemoryObjectPtr &first, std::vector<VoiceFootprint> &footprints) {
+
+    constexpr size_t WAVE_SAMPLES = std::size(Wave{}.samples);
+    footprints.clear();
+    bool rates_ok = true;
+    visit(first, [&](MemoryVoice &mv) {
+        const Voice &v = *mv.voice();
+        if(v.frequency > SR_9kHz) {
+            rates_ok = false;
+        }
+        int32_t lo, hi;
+        voice_address_range(v, lo, hi);
+        lo = std::max(lo, 0);
+        hi = std::max(hi, lo);
+        footprints.push_back({
+            .voice = footprints.size(),
+            .rate = SampleRate(v.frequency),
+            .samples = static_cast<size_t>(hi - lo) + 1,
+            .blocks = (hi / WAVE_SAMPLES) - (lo / WAVE_SAMPLES) + 1,
+        });
+    });
+    return rates_ok ? RESULT_OK : RESULT_WAVE_BAD_SAMPLERATE;
+}
+
+Result plan_budget(const MemoryObjectPtr &first,
+    const std::vector<double> &priorities, const BudgetOptions &options,
+    BudgetPlan &plan) {
+
+    constexpr size_t WAVE_SAMPLES = std::size(Wave{}.samples);
+    plan = {};
+    auto result = voice_footprints(first, plan.footprints);
+    if(!result_success(result)) {
+        return result;
+    }
+
+    // Each voice has up to four options: leave it out, keep it at its current
+    // rate, or downsample it by one or two steps. (Downsampled data would be
+    // laid out afresh, so its footprint depends only on its sample count.)
+    struct Option {
+        size_t blocks;
+        double score;
+    };
+    constexpr size_t MAX_OPTIONS = 4;
+    const size_t voice_count = plan.footprints.size();
+    std::vector<Option> voice_options(voice_count * MAX_OPTIONS);
+    std::vector<uint8_t> option_counts(voice_count);
+    size_t most_blocks = 0;
+    for(size_t v = 0; v < voice_count; v++) {
+        const VoiceFootprint &f = plan.footprints[v];
+        double priority = (v < priorities.size()) ? priorities[v] : 1.0;
+        Option *o = &voice_options[v * MAX_OPTIONS];
+        size_t n = 0;
+        o[n++] = { 0, 0.0 };
+        o[n++] = { f.blocks, priority * options.downsample_weight[0] };
+        for(size_t step = 1; (f.rate + step) <= SR_9kHz; step++) {
+            size_t samples = (f.samples + (1 << step) - 1) >> step;
+            o[n++] = {
+                (samples + WAVE_SAMPLES - 1) / WAVE_SAMPLES,
+                priority * options.downsample_weight[step],
+            };
+        }
+        option_counts[v] = n;
+        most_blocks += f.blocks;
+    }
+
+    // Multiple-choice knapsack: best[b] is the best score achievable by the
+    // voices so far within b blocks, and chosen[] records the option that
+    // each voice took for every b, so the plan can be recovered afterwards.
+    const size_t budget = std::min(options.budget, most_blocks);
+    std::vector<double>
+        best(budget + 1, 0.0),
+        next(budget + 1);
+    std::vector<uint8_t> chosen(voice_count * (budget + 1));
+    for(size_t v = 0; v < voice_count; v++) {
+        const Option *o = &voice_options[v * MAX_OPTIONS];
+        uint8_t *c = &chosen[v * (budget + 1)];
+        for(size_t b = 0; b <= budget; b++) {
+            double score = best[b];
+            uint8_t choice = 0;
+            for(uint8_t i = 1; i < option_counts[v]; i++) {
+                if((o[i].blocks <= b) &&
+                    ((best[b - o[i].blocks] + o[i].score) > score)) {
+                    score = best[b - o[i].blocks] + o[i].score;
+                    choice = i;
+                }
+            }
+            next[b] = score;
+            c[b] = choice;
+        }
+        best.swap(next);
+    }
+
+    plan.choices.resize(voice_count);
+    plan.score = best[budget];
+    size_t b = budget;
+    for(size_t v = voice_count; v--;) {
+        uint8_t choice = chosen[(v * (budget + 1)) + b];
+        const Option &o = voice_options[(v * MAX_OPTIONS) + choice];
+        BudgetChoice &c = plan.choices[v];
+        c.voice = v;
+        c.included = choice;
+        c.rate = SampleRate(
+            plan.footprints[v].rate + (choice ? choice - 1 : 0));
+        c.blocks = o.blocks;
+        c.score = o.score;
+        plan.blocks += o.blocks;
+        b -= o.blocks;
+    }
+    return RESULT_OK;
+}
+
+
+//------------------------------------------------------------------------------
+// Sample analysis
+
+SampleAnalysis analyze_samples(Span<int16_t> samples, int16_t silence) {
+    DSP::SampleStats stats;
+    DSP::sample_stats(samples.data(), samples.size(), silence, stats);
+    SampleAnalysis analysis;
+    analysis.count = stats.count;
+    analysis.clipped = stats.clipped;
+    analysis.leading_silence = stats.leading_silence;
+    analysis.trailing_silence = stats.trailing_silence;
+    if(stats.count) {
+        const double n = static_cast<double>(stats.count);
+        analysis.peak =
+            std::max(-int32_t{stats.min}, int32_t{stats.max}) / 32768.f;
+        analysis.rms = static_cast<float>(sqrt(stats.sum_squares / n) / 32768);
+        analysis.dc_offset = static_cast<float>(stats.sum / n / 32768);
+    }
+    return analysis;
+}
+
+
+//------------------------------------------------------------------------------
+// Loop search
+
+namespace {
+
+// normalized cross-correlation of a and b (of n samples), given the energy
+// (sum of squares) of each
+float correlation(
+    const float *a, const float *b, size_t n, double ea, double eb) {
+    if((ea <= 0) || (eb <= 0)) {
+        return -1.f; // (silence doesn't make a useful loop)
+    }
+    return static_cast<float>(DSP::dot(a, b, n) / sqrt(ea * eb));
+}
+
+// A (start, end) pair, as offsets into the region being searched
+struct LoopMatch {
+    size_t start = 0;
+    size_t end = 0;
+    float score = -1.f;
+};
+
+} // (anonymous)
+
+Result find_loops(Span<int16_t> samples, size_t first, size_t last,
+    const LoopSearchOptions &options, std::vector<LoopCandidate> &loops) {
+
+    loops.clear();
+    if((first > last) || (last >= samples.size())) {
+        return RESULT_WAVE_BAD_OFFSET;
+    }
+    const size_t
+        wanted = std::min<size_t>(options.candidates, 8),
+        window = std::max<size_t>(options.window, 8),
+        step = std::max<size_t>(options.decimation, 1),
+        min_length = std::max<size_t>(options.min_length, 1),
+        n = last - first + 1;
+    if(!wanted || (n < window + min_length + 2)) {
+        return RESULT_OK;
+    }
+
+    // the region as floats, with running energies (for window energies)
+    std::vector<float> x(n);
+    DSP::int16_to_float(&samples[first], x.data(), n);
+    std::vector<double> energy(n + 1);
+    float peak = 0.f;
+    for(size_t i = 0; i < n; i++) {
+        energy[i + 1] = energy[i] + double(x[i]) * x[i];
+        peak = std::max(peak, fabsf(x[i]));
+    }
+    if(peak == 0.f) {
+        return RESULT_OK;
+    }
+
+    // the coarse copy: averages of step samples
+    const size_t
+        coarse_n = n / step,
+        coarse_window = std::max<size_t>(window / step, 1);
+    std::vector<float> y(coarse_n);
+    std::vector<double> coarse_energy(coarse_n + 1);
+    for(size_t c = 0; c < coarse_n; c++) {
+        float sum = 0.f;
+        for(size_t i = 0; i < step; i++) {
+            sum += x[c * step + i];
+        }
+        y[c] = sum / step;
+        coarse_energy[c + 1] = coarse_energy[c] + double(y[c]) * y[c];
+    }
+
+    // loop ends: the sample before a rising zero crossing, spread across the
+    // later half of the region (as far as a shortest loop allows)
+    const size_t
+        earliest = std::max(window + min_length, n / 2),
+        latest = n - 2,
+        spread = std::max<size_t>(options.ends, 1);
+    std::vector<size_t> ends;
+    if(earliest <= latest) {
+        const size_t span = latest - earliest + 1;
+        for(size_t k = 0; k < spread; k++) {
+            size_t
+                e = earliest + (span * k) / spread,
+                limit = earliest + (span * (k + 1)) / spread;
+            for(; e < limit; e++) {
+                if((x[e] < 0.f) && (x[e + 1] >= 0.f)) {
+                    ends.push_back(e);
+                    break;
+                }
+            }
+        }
+    }
+
+    // coarse pass: the best start for each end
+    std::vector<LoopMatch> matches;
+    for(size_t e: ends) {
+        const size_t ce = e / step;
+        if((ce + 1 < coarse_window) || (ce >= coarse_n) ||
+            (e < min_length + step)) {
+            continue;
+        }
+        const float *a = &y[ce + 1 - coarse_window];
+        const double ea =
+            coarse_energy[ce + 1] - coarse_energy[ce + 1 - coarse_window];
+        const size_t last_start = (e + 1 - min_length) / step;
+        LoopMatch best;
+        for(size_t cs = coarse_window; cs <= last_start; cs++) {
+            const double eb =
+                coarse_energy[cs] - coarse_energy[cs - coarse_window];
+            float score = correlation(
+                a, &y[cs - coarse_window], coarse_window, ea, eb);
+            if(score > best.score) {
+                best = { cs * step, e, score };
+            }
+        }
+        if(best.score > -1.f) {
+            matches.push_back(best);
+        }
+    }
+    auto by_score = [](const LoopMatch &a, const LoopMatch &b) {
+        return a.score > b.score;
+    };
+    std::sort(matches.begin(), matches.end(), by_score);
+    matches.resize(std::min(matches.size(), wanted * 4));
+
+    // fine pass: every start around each coarse match, at full resolution,
+    // penalising any jump in level or slope across the joint
+    for(LoopMatch &m: matches) {
+        const size_t
+            e = m.end,
+            lo = std::max(window, m.start - std::min(m.start, 2 * step)),
+            hi = std::min(e + 1 - min_length, m.start + 2 * step);
+        const float *a = &x[e + 1 - window];
+        const double ea = energy[e + 1] - energy[e + 1 - window];
+        LoopMatch best;
+        for(size_t s = lo; s <= hi; s++) {
+            const double eb = energy[s] - energy[s - window];
+            const float
+                joint = fabsf(x[s] - x[e + 1]) + fabsf(x[s - 1] - x[e]),
+                score = correlation(a, &x[s - window], window, ea, eb) -
+                    joint / (2 * peak);
+            if(score > best.score) {
+                best = { s, e, score };
+            }
+        }
+        m = best;
+    }
+    std::sort(matches.begin(), matches.end(), by_score);
+
+    // the best candidates which aren't near-duplicates of a better one
+    for(const LoopMatch &m: matches) {
+        if((m.score <= -1.f) || (loops.size() >= wanted)) {
+            break;
+        }
+        bool distinct = std::all_of(loops.begin(), loops.end(),
+            [&](const LoopCandidate &c) {
+                const int64_t
+                    start = int64_t(first + m.start),
+                    end = int64_t(first + m.end);
+                return
+                    (std::abs(start - c.start) >= int64_t(window)) ||
+                    (std::abs(end - c.end) >= int64_t(window));
+            });
+        if(distinct) {
+            LoopCandidate c;
+            c.start = static_cast<int32_t>(first + m.start);
+            c.end = static_cast<int32_t>(first + m.end);
+            c.score = m.score;
+            // the poorer the match, the longer the suggested cross fade
+            c.xfade_time = static_cast<int16_t>(
+                lrintf(std::clamp(1.f - m.score, 0.f, 1.f) * 1023));
+            loops.push_back(c);
+        }
+    }
+    return RESULT_OK;
+}
+
+void apply_loops(Voice &v, const std::vector<LoopCandidate> &loops) {
+    const size_t count = std::min(loops.size(), std::size(v.loop_start));
+    if(!count) {
+        return;
+    }
+    for(size_t i = 0; i < std::size(v.loop_start); i++) {
+        const bool used = i < count;
+        const int32_t
+            start = used ? loops[i].start : v.play_end,
+            end = used ? loops[i].end : v.play_end;
+        v.loop_start[i] = (v.loop_start[i] & ~LOOP_START_ADDRESS_MASK) |
+            (start & LOOP_START_ADDRESS_MASK);
+        v.loop_end[i] = (v.loop_end[i] & ~LOOP_END_ADDRESS_MASK) |
+            (end & LOOP_END_ADDRESS_MASK);
+        v.loop_xfade_time[i] = used ? loops[i].xfade_time : 0;
+    }
+    v.loop_sustain_point = 0;
+    v.loop_end_point = static_cast<int8_t>(count - 1);
+}
+
+Result MemoryBlocks::find_voice_loops(size_t n,
+    const LoopSearchOptions &options, std::vector<LoopCandidate> *loops) {
+
+    if(loops) {
+        loops->clear();
+    }
+    Voice *v = voice(n);
+    if(!v) {
+        return RESULT_MISSING_VOICE;
+    }
+    auto all = samples();
+    if(all.empty() || (v->play_end < 0) || (v->play_start > v->play_end)) {
+        return RESULT_OK;
+    }
+    const size_t
+        first = std::max(v->play_start, 0),
+        last = std::min<size_t>(v->play_end, all.size() - 1);
+    if(first > last) {
+        return RESULT_OK;
+    }
+    std::vector<LoopCandidate> found;
+    auto result = find_loops(all, first, last, options, found);
+    if(!result_success(result)) {
+        return result;
+    }
+    if(!found.empty()) {
+        apply_loops(*v, found);
+        // (four voices to a block)
+        touch(section(BT_VOICE).start + n / 4);
+    }
+    if(loops) {
+        *loops = std::move(found);
+    }
+    return RESULT_OK;
+}
+
+
+//------------------------------------------------------------------------------
+// Silence trimming
+
+Result trim_waves(const MemoryObjectPtr &first, const TrimOptions &options,
+    size_t *removed) {
+
+    constexpr size_t WAVE_SAMPLES = std::size(Wave{}.samples);
+    if(removed) {
+        *removed = 0;
+    }
+    std::vector<MemoryVoice*> voices;
+    std::vector<MemoryWave*> waves;
+    visit(first, overloaded{
+        [&](MemoryVoice &v) { voices.push_back(&v); },
+        [&](MemoryWave &w) { waves.push_back(&w); },
+    });
+    const size_t total = waves.size() * WAVE_SAMPLES;
+    if(!total) {
+        return RESULT_OK;
+    }
+    // (as MemoryBlocks::samples(), the waves make one run of samples)
+    auto sample = [&](size_t address) -> int16_t& {
+        return waves[address / WAVE_SAMPLES]->wave()->samples[
+            address % WAVE_SAMPLES];
+    };
+    const int16_t silence = std::max<int16_t>(options.silence, 0);
+
+    // The first and last non-silent samples of [lo, hi] (or SIZE_MAX), found
+    // a block at a time from either end, so only the silence is scanned
+    DSP::SampleStats stats;
+    auto first_loud = [&](size_t lo, size_t hi) {
+        for(size_t a = lo; a <= hi;) {
+            size_t n = std::min(hi + 1 - a, WAVE_SAMPLES - (a % WAVE_SAMPLES));
+            DSP::sample_stats(&sample(a), n, silence, stats);
+            if(stats.leading_silence < n) {
+                return a + stats.leading_silence;
+            }
+            a += n;
+        }
+        return SIZE_MAX;
+    };
+    auto last_loud = [&](size_t lo, size_t hi) {
+        for(size_t b = hi + 1; b > lo;) {
+            size_t n = std::min(b - lo, ((b - 1) % WAVE_SAMPLES) + 1);
+            DSP::sample_stats(&sample(b - n), n, silence, stats);
+            if(stats.trailing_silence < n) {
+                return b - 1 - stats.trailing_silence;
+            }
+            b -= n;
+        }
+        return SIZE_MAX;
+    };
+
+    // the samples each voice keeps: its data without the silence at either
+    // end, plus all of its loops
+    struct Range {
+        size_t lo, hi;
+        size_t target = 0; // where lo moves to
+        float gain = 1.f;
+    };
+    std::vector<Range> keep(voices.size(), { SIZE_MAX, 0 });
+    std::vector<Range> ranges;
+    for(size_t i = 0; i < voices.size(); i++) {
+        const Voice &v = *voices[i]->voice();
+        if((v.data_start < 0) || (size_t(v.data_start) >= total)) {
+            continue; // (no wave data to trim)
+        }
+        const size_t last = total - 1;
+        size_t
+            lo = v.data_start,
+            hi = std::min<size_t>(std::max(v.data_end, v.data_start), last),
+            loud_lo = first_loud(lo, hi),
+            loud_hi = loud_lo;
+        if(loud_lo == SIZE_MAX) {
+            loud_lo = loud_hi = lo;
+        } else {
+            loud_hi = last_loud(loud_lo, hi);
+        }
+        size_t loops = std::min<size_t>(
+            std::max<int8_t>(v.loop_end_point, 0) + 1, std::size(v.loop_start));
+        for(size_t l = 0; l < loops; l++) {
+            int32_t
+                start = v.loop_start[l] & LOOP_START_ADDRESS_MASK,
+                end = v.loop_end[l] & LOOP_END_ADDRESS_MASK;
+            if(start < end) { // (an empty loop is just a marker)
+                loud_lo = std::min<size_t>(
+                    loud_lo, std::min<size_t>(start, last));
+                loud_hi = std::max<size_t>(
+                    loud_hi, std::min<size_t>(end, last));
+            }
+        }
+        keep[i] = { loud_lo, loud_hi };
+        ranges.push_back(keep[i]);
+    }
+    if(ranges.empty()) {
+        return RESULT_OK;
+    }
+
+    // voices which share wave data keep the union of their ranges
+    std::sort(ranges.begin(), ranges.end(),
+        [](const Range &a, const Range &b) { return a.lo < b.lo; });
+    size_t merged = 0;
+    for(size_t i = 1; i < ranges.size(); i++) {
+        if(ranges[i].lo <= ranges[merged].hi + 1) {
+            ranges[merged].hi = std::max(ranges[merged].hi, ranges[i].hi);
+        } else {
+            ranges[++merged] = ranges[i];
+        }
+    }
+    ranges.resize(merged + 1);
+    auto range_of = [&](size_t address) -> const Range& {
+        auto it = std::upper_bound(ranges.begin(), ranges.end(), address,
+            [](size_t a, const Range &r) { return a < r.lo; });
+        return *(it - 1);
+    };
+
+    if(options.normalize) {
+        for(Range &r: ranges) {
+            int32_t peak = 0;
+            for(size_t a = r.lo; a <= r.hi;) {
+                size_t n = std::min(
+                    r.hi + 1 - a, WAVE_SAMPLES - (a % WAVE_SAMPLES));
+                DSP::sample_stats(&sample(a), n, silence, stats);
+                peak = std::max(
+                    { peak, -int32_t{stats.min}, int32_t{stats.max} });
+                a += n;
+            }
+            if(peak > silence) {
+                // (so a full scale peak is 32767, and doesn't clip)
+                r.gain = options.peak * 32767.f / peak;
+            }
+        }
+    }
+
+    // move each range down over the gaps, a block-bounded run at a time (the
+    // destination never passes the source, so nothing is overwritten before
+    // it has been read), scaling it as it goes
+    std::vector<bool> touched(waves.size());
+    size_t d = 0;
+    for(Range &r: ranges) {
+        r.target = d;
+        for(size_t s = r.lo; s <= r.hi;) {
+            size_t n = std::min({ r.hi + 1 - s,
+                WAVE_SAMPLES - (s % WAVE_SAMPLES),
+                WAVE_SAMPLES - (d % WAVE_SAMPLES) });
+            int16_t *out = &sample(d);
+            if(d != s) {
+                memmove(out, &sample(s), n * sizeof(int16_t));
+            }
+            if(r.gain != 1.f) {
+                DSP::apply_gain(out, n, r.gain);
+            }
+            if((d != s) || (r.gain != 1.f)) {
+                touched[d / WAVE_SAMPLES] = true;
+            }
+            s += n;
+            d += n;
+        }
+    }
+    const size_t kept = (d + WAVE_SAMPLES - 1) / WAVE_SAMPLES;
+    if(d % WAVE_SAMPLES) {
+        int16_t
+            *tail = &sample(d),
+            *end = tail + WAVE_SAMPLES - (d % WAVE_SAMPLES);
+        if(std::any_of(tail, end, [](int16_t s) { return s != 0; })) {
+            std::fill(tail, end, 0);
+            touched[d / WAVE_SAMPLES] = true;
+        }
+    }
+    for(size_t b = 0; b < kept; b++) {
+        if(touched[b]) {
+            waves[b]->touch();
+        }
+    }
+
+    // pull each voice's data and play ranges (and any unused loops) in to
+    // what it kept, then move it along with its range
+    for(size_t i = 0; i < voices.size(); i++) {
+        if(keep[i].lo == SIZE_MAX) {
+            continue;
+        }
+        Voice &v = *voices[i]->voice();
+        const Voice before = v;
+        const auto
+            lo = static_cast<int32_t>(keep[i].lo),
+            hi = static_cast<int32_t>(keep[i].hi);
+        v.data_start = std::max(v.data_start, lo);
+        v.data_end = std::clamp(v.data_end, v.data_start, hi);
+        v.play_start = std::clamp(v.play_start, lo, hi);
+        v.play_end = std::clamp(v.play_end, lo, hi);
+        for(auto &loop_start: v.loop_start) {
+            int32_t a =
+                std::clamp(loop_start & LOOP_START_ADDRESS_MASK, lo, hi);
+            loop_start = (loop_start & ~LOOP_START_ADDRESS_MASK) | a;
+        }
+        for(auto &loop_end: v.loop_end) {
+            int32_t a = std::clamp(loop_end & LOOP_END_ADDRESS_MASK, lo, hi);
+            loop_end = (loop_end & ~LOOP_END_ADDRESS_MASK) | a;
+        }
+        const Range &r = range_of(keep[i].lo);
+        rebase_voice(v,
+            static_cast<int32_t>(r.target) - static_cast<int32_t>(r.lo));
+        if(memcmp(&before, &v, sizeof(Voice))) {
+            voices[i]->touch();
+        }
+    }
+
+    // drop the waves which are no longer needed (from the end, so the first
+    // wave, which may head the list, always stays)
+    for(size_t b = kept; b < waves.size(); b++) {
+        waves[b]->remove();
+    }
+    if(removed) {
+        *removed = waves.size() - kept;
+    }
+    return RESULT_OK;
+}
+
+
+//------------------------------------------------------------------------------
+// Voice rendering
+
+// How the voice parameters (mostly 0-127 or 0-255) map onto time, frequency
+// and level. The FZ-1's own curves aren't documented, so these are chosen to
+// give sensible ranges.
+static constexpr double
+    ENVELOPE_SLOWEST = 10.0, // seconds for a full range section at rate 0
+    ENVELOPE_OCTAVES = 13.0, // of speed, between rate 0 and rate 127
+    LOOP_SHORTEST = 0.016, // seconds of looping at loop_time 1
+    LOOP_LONGEST = 16.0, // seconds of looping at loop_time 1022
+    LFO_SLOWEST = 0.05, // Hz at lfo_rate 0
+    LFO_OCTAVES = 10.0, // between lfo_rate 0 and lfo_rate 127
+    LFO_PITCH_DEPTH = 2.0, // semitones either way at lfo_pitch 127
+    LFO_DELAY_STEP = 0.002, // seconds per step of lfo_delay
+    LFO_ATTACK_STEP = 0.016, // seconds per step of lfo_attack
+    CUTOFF_LOWEST = 20.0, // Hz, with the filter fully closed
+    CUTOFF_OCTAVES = 10.0, // between fully closed and fully open
+    CUTOFF_HIGHEST = 0.45, // as a fraction of the output rate
+    Q_LOWEST = 0.7071, // (no resonance)
+    Q_HIGHEST = 12.0;
+
+// a signed 0-127 amount, as a fraction
+static double amount(int8_t a) {
+    return a / 127.0;
+}
+
+// Start an envelope from a voice's rates and levels, with its speed scaled
+// (by key and velocity follow)
+static void start_envelope(DSP::Envelope &envelope, const int8_t *rates,
+    const uint8_t *levels, int8_t sustain, int8_t end, double speed,
+    uint32_t rate) {
+
+    float steps[DSP::Envelope::SECTIONS], targets[DSP::Envelope::SECTIONS];
+    for(size_t i = 0; i < DSP::Envelope::SECTIONS; i++) {
+        // (the MSB gives the direction, which the target implies anyway)
+        double seconds = ENVELOPE_SLOWEST *
+            exp2(-(rates[i] & 0x7f) * ENVELOPE_OCTAVES / 127);
+        steps[i] = static_cast<float>(speed / (seconds * rate));
+        targets[i] = levels[i] / 255.f;
+    }
+    envelope.start(steps, targets,
+        std::clamp<int8_t>(sustain, 0, 7), std::clamp<int8_t>(end, 0, 7));
+}
+
+VoiceRenderer::VoiceRenderer(
+    const Voice &voice, Span<int16_t> samples, uint32_t rate):
+    voice_(voice), samples_(samples), rate_(rate ? rate : RENDER_RATE) {}
+
+void VoiceRenderer::note_on(uint8_t note, uint8_t velocity) {
+    const Voice &v = voice_;
+    const double
+        key = static_cast<double>(note) - v.midi_origin,
+        vel = std::clamp<uint8_t>(velocity, 1, 127) / 127.0;
+    // positive amounts are at full effect at velocity 127, negative at 1
+    auto sensitivity = [&](int8_t a) {
+        double s = fabs(amount(a));
+        return 1 - s + s * ((a >= 0) ? vel : (1 - vel));
+    };
+    auto speed = [&](int8_t key_follow, int8_t velocity_follow) {
+        return exp2((amount(key_follow) * key / 12) +
+            (amount(velocity_follow) * (vel - .5) * 4));
+    };
+
+    int32_t in_rate = sample_rate_hz(SampleRate(v.frequency));
+    step_ = (in_rate ? in_rate : RENDER_RATE) / static_cast<double>(rate_) *
+        exp2((key + (v.pitch_correction / 256.0)) / 12);
+    position_ = std::max(v.play_start, 0);
+    play_end_ = v.play_end;
+
+    // the loops played, in order: empty ones (like unused loops, which sit at
+    // play_end) are skipped
+    loops_.clear();
+    size_t last = std::min<size_t>(std::max<int8_t>(v.loop_end_point, 0), 7);
+    for(size_t i = 0; i <= last; i++) {
+        Loop loop;
+        loop.start = (v.loop_start[i] & LOOP_START_ADDRESS_MASK) +
+            (static_cast<uint32_t>(v.loop_start[i]) >> 24) / 256.0;
+        loop.end = v.loop_end[i] & LOOP_END_ADDRESS_MASK;
+        if((loop.end <= loop.start) || (loop.end > play_end_)) {
+            continue;
+        }
+        loop.length = (loop.end + 1) - loop.start;
+        loop.xfade = std::min<int16_t>(v.loop_xfade_time[i], 1023) / 1023.0 *
+            loop.length / 2;
+        uint16_t t = v.loop_time[i];
+        loop.sustain = (t == 1023) ||
+            (static_cast<int8_t>(i) == v.loop_sustain_point);
+        loop.time = (t >= 1023) ? INFINITY : (t == 0) ? 0.0 :
+            LOOP_SHORTEST * pow(LOOP_LONGEST / LOOP_SHORTEST, (t - 1) / 1021.0);
+        loops_.push_back(loop);
+    }
+    loop_ = 0;
+    looping_ = false;
+    loop_elapsed_ = 0;
+
+    gain_ = static_cast<float>(sensitivity(v.velocity_amplitude_key_follow) *
+        exp2(amount(v.amplitude_key_follow) * key / 12));
+    last_gain_ = 0;
+    start_envelope(dca_, v.dca_rate, v.dca_end_level, v.dca_sustain,
+        v.dca_end, speed(v.amplitude_rate_key_follow,
+            v.velocity_amplitude_rate_key_follow), rate_);
+    start_envelope(dcf_, v.dcf_rate, v.dcf_end_level, v.dcf_sustain,
+        v.dcf_end, speed(v.filter_rate_key_follow,
+            v.velocity_filter_rate_key_follow), rate_);
+    depth_ = static_cast<float>(sensitivity(v.velocity_filter_key_follow));
+    cutoff_ = static_cast<float>(
+        (amount(v.filter_key_follow) * key / 60) - amount(v.filter));
+    resonance_ = static_cast<float>(((v.filter_q & 0x78) / 120.0) +
+        (amount(v.velocity_filter_q_key_follow) * (vel - .5)));
+    filter_.reset();
+
+    // (a free running LFO starts at an arbitrary phase)
+    lfo_phase_ = (v.lfo_name & 0x80) ? 0.0 : fmod(note * 0.618034, 1.0);
+    lfo_step_ = LFO_SLOWEST *
+        exp2((v.lfo_rate & 0x7f) * LFO_OCTAVES / 127) / rate_;
+    lfo_delay_ = static_cast<size_t>(v.lfo_delay * LFO_DELAY_STEP * rate_);
+    lfo_attack_ = static_cast<size_t>(v.lfo_attack * LFO_ATTACK_STEP * rate_);
+    lfo_elapsed_ = 0;
+    lfo_random_ = 1u + note;
+    lfo_hold_ = 0;
+
+    active_ = true;
+    released_ = false;
+}
+
+void VoiceRenderer::note_off() {
+    released_ = true;
+    dca_.release();
+    dcf_.release();
+}
+
+float VoiceRenderer::lfo(size_t count) {
+    float depth = 0.f;
+    if(lfo_elapsed_ >= lfo_delay_) {
+        depth = lfo_attack_ ? std::min(1.f,
+            static_cast<float>(lfo_elapsed_ - lfo_delay_) / lfo_attack_) : 1.f;
+    }
+    const float p = static_cast<float>(lfo_phase_);
+    float value;
+    switch(voice_.lfo_name & 0x7f) {
+        case 1: value = (2 * p) - 1; break; // saw up
+        case 2: value = 1 - (2 * p); break; // saw down
+        case 3: value = (p < .5f) ? ((4 * p) - 1) : (3 - (4 * p)); break;
+        case 4: value = (p < .5f) ? 1.f : -1.f; break; // rectangle
+        case 5: value = lfo_hold_; break; // random
+        default: value = sinf(p * 2 * static_cast<float>(DSP::PI)); break;
+    }
+    lfo_elapsed_ += count;
+    lfo_phase_ += lfo_step_ * count;
+    if(lfo_phase_ >= 1.0) {
+        lfo_phase_ -= floor(lfo_phase_);
+        lfo_random_ = (lfo_random_ * 1664525u) + 1013904223u;
+        lfo_hold_ = ((lfo_random_ >> 8) / 8388608.f) - 1.f;
+    }
+    return value * depth;
+}
+
+// Whether the current loop is finished with: the sustain loop plays until the
+// note is released, and the others for their loop time
+bool VoiceRenderer::loop_exits() const {
+    const Loop &loop = loops_[loop_];
+    return loop.sustain ? released_ : (loop_elapsed_ >= loop.time);
+}
+
+float VoiceRenderer::sample(int64_t address) const {
+    return ((address >= 0) &&
+        (static_cast<size_t>(address) < samples_.size())) ?
+            samples_[address] * (1.f / 32768) : 0.f;
+}
+
+size_t VoiceRenderer::render(float *out, size_t count) {
+    const Voice &v = voice_;
+    size_t rendered = 0;
+    while(active_ && (rendered < count)) {
+        // the envelopes' levels at the end of each block of a run of blocks
+        // (the last of which may be short), and the block in which the DCA
+        // envelope finishes (if it does)
+        const size_t
+            run = std::min(count - rendered, BLOCK * CONTROL_BLOCKS),
+            blocks = (run + BLOCK - 1) / BLOCK,
+            whole = run / BLOCK;
+        float dca[CONTROL_BLOCKS], dcf[CONTROL_BLOCKS];
+        size_t finish = dca_.render(dca, whole, BLOCK);
+        dcf_.render(dcf, whole, BLOCK);
+        if(whole < blocks) {
+            dca[whole] = dca_.advance(run % BLOCK);
+            dcf[whole] = dcf_.advance(run % BLOCK);
+            if((finish == whole) && !dca_.finished()) {
+                finish = blocks;
+            }
+        }
+
+        for(size_t block = 0; active_ && (block < blocks); block++) {
+            const size_t n = std::min(BLOCK, count - rendered);
+
+            // control values for the block
+            const float l = lfo(n);
+            const double step = step_ *
+                exp2(l * amount(v.lfo_pitch) * LFO_PITCH_DEPTH / 12);
+            const bool ending = (block == finish);
+            // (fading out over the block in which the DCA envelope ends)
+            const float
+                tremolo = static_cast<float>(amount(v.lfo_amplitude)) *
+                    (1 - l) / 2,
+                gain = ending ? 0.f : dca[block] * gain_ * (1 - tremolo);
+            const float
+                cutoff = (dcf[block] * depth_) + cutoff_ +
+                    (l * static_cast<float>(amount(v.lfo_filter)) / 2),
+                resonance = resonance_ +
+                    (l * static_cast<float>(amount(v.lfo_filter_q)) / 2);
+            const double
+                hz = std::min(CUTOFF_LOWEST *
+                    exp2(std::clamp(cutoff, 0.f, 1.f) * CUTOFF_OCTAVES),
+                    CUTOFF_HIGHEST * rate_),
+                q = Q_LOWEST * pow(Q_HIGHEST / Q_LOWEST,
+                    std::clamp(resonance, 0.f, 1.f));
+            bool exits = (loop_ < loops_.size()) && loop_exits();
+
+            // fetch each output's two neighbouring samples and its fraction,
+            // following the loops (and blending in the cross fade)
+            float a[BLOCK], b[BLOCK], f[BLOCK];
+            size_t m = 0;
+            for(; m < n; m++) {
+                while((loop_ < loops_.size()) &&
+                    (position_ >= loops_[loop_].end + 1)) {
+                    if(exits) {
+                        loop_++;
+                        looping_ = false;
+                        loop_elapsed_ = 0;
+                        exits = (loop_ < loops_.size()) && loop_exits();
+                    } else {
+                        position_ -= loops_[loop_].length;
+                        looping_ = true;
+                    }
+                }
+                if(position_ > play_end_) {
+                    break;
+                }
+                const auto i = static_cast<int64_t>(position_);
+                int64_t j = i + 1;
+                a[m] = sample(i);
+                f[m] = static_cast<float>(position_ - i);
+                if(loop_ < loops_.size()) {
+                    const Loop &loop = loops_[loop_];
+                    if(!exits) {
+                        if(i == loop.end) {
+                            j = static_cast<int64_t>(loop.start);
+                        }
+                        double into = position_ - ((loop.end + 1) - loop.xfade);
+                        if((loop.xfade > 0) && (into > 0)) {
+                            // (blending with the samples a loop earlier)
+                            auto w = static_cast<float>(into / loop.xfade);
+                            auto k = static_cast<int64_t>(
+                                position_ - loop.length);
+                            float bj = sample(j);
+                            a[m] += (sample(k) - a[m]) * w;
+                            b[m] = bj + ((sample(k + 1) - bj) * w);
+                            position_ += step;
+                            continue;
+                        }
+                    }
+                }
+                b[m] = sample(j);
+                position_ += step;
+            }
+            if(looping_) {
+                loop_elapsed_ += static_cast<double>(n) / rate_;
+            }
+
+            // the per-sample work: interpolate, filter and ramp the gain
+            float x[BLOCK];
+            for(size_t i = 0; i < m; i++) {
+                x[i] = a[i] + ((b[i] - a[i]) * f[i]);
+            }
+            filter_.process(x, m, static_cast<float>(hz),
+                static_cast<float>(q), rate_);
+            const float ramp = (gain - last_gain_) / n;
+            for(size_t i = 0; i < m; i++) {
+                out[rendered + i] += x[i] * (last_gain_ + (ramp * (i + 1)));
+            }
+            last_gain_ = gain;
+            rendered += m;
+            if(ending || (m < n)) {
+                active_ = false;
+            }
+        }
+    }
+    return rendered;
+}
+
+Result render_voice(const Voice &voice, Span<int16_t> samples,
+    const RenderNote &note, uint32_t rate, std::vector<float> &out) {
+
+    out.clear();
+    if(!sample_rate_hz(SampleRate(voice.frequency))) {
+        return RESULT_WAVE_BAD_SAMPLERATE;
+    }
+    rate = rate ? rate : RENDER_RATE;
+    VoiceRenderer renderer(voice, samples, rate);
+    renderer.note_on(note.note, note.velocity);
+    const size_t
+        hold = static_cast<size_t>(std::max(note.hold, 0.0) * rate),
+        tail = static_cast<size_t>(std::max(note.tail, 0.0) * rate);
+    out.resize(hold + tail);
+    size_t count = renderer.render(out.data(), hold);
+    if(count == hold) {
+        renderer.note_off();
+        count += renderer.render(out.data() + hold, tail);
+    }
+    out.resize(count);
+    return RESULT_OK;
+}
+
+
+//------------------------------------------------------------------------------
+// Loader
+
+Result Loader::flag_check(uint8_t flags) {
+    if(flags & FILE_OPEN_ERROR) {
+        return RESULT_FILE_OPEN_ERROR;
+    }
+    if(flags & FILE_READ_ERROR) {
+        return RESULT_FILE_READ_ERROR;
+    }
+    if(flags & XML_PARSE_ERROR) {
+        return RESULT_XML_PARSE_ERROR;
+    }
+    return RESULT_OK;
+}
+
+
+//------------------------------------------------------------------------------
+// BlockLoader
+
+BlockLoader::BlockLoader(std::string_view filename) {
+    FILE *file = fopen(filename.data(), "rb");
+    if(!file) {
+        flags_ |= FILE_OPEN_ERROR;
+        return;
+    }
+    FileCloser close_file(file);
+
+    fseek(file, 0, SEEK_END);
+    size_ = ftell(file);
+    if(size_) {
+        rewind(file);
+        storage_ = std::make_unique<uint8_t[]>(size_);
+        size_t r = fread(storage_.get(), size_, 1, file);
+        if(r == 1) {
+            return;
+        }
+    }
+    flags_ |= FILE_READ_ERROR;
+    storage_ = nullptr;
+    size_ = 0;
+}
+
+BlockLoader::BlockLoader(std::unique_ptr<uint8_t[]>&& storage, size_t size):
+    storage_(std::move(storage)),
+    size_(size) {}
+
+BlockLoader::BlockLoader(const void *storage, size_t size):
+    storage_(std::make_unique<uint8_t[]>(size)),
+    size_(size) {
+    memcpy(storage_.get(), storage, size);
+}
+
+Result BlockLoader::load(MemoryBlocks &mb) {
+    mb.reset();
+    if(auto r = flag_check(flags_); !result_success(r)) {
+        return r;
+    }
+    if(!size_) {
+        return RESULT_NO_BLOCKS;
+    }
+    if(size_ % 1024) {
+        return RESULT_BAD_FILE_SIZE;
+    }
+    const auto &h = header_(storage_.get());
+    if(h.indicator != FzFileHeader::INDICATOR) {
+        return RESULT_BAD_HEADER;
+    }
+    if(h.version != 1) {
+        return RESULT_BAD_FILE_VERSION;
+    }
+    int16_t blocks = size_ / 1024;
+    if(blocks != h.block_count) {
+        return RESULT_BAD_BLOCK_COUNT;
+    }
+    return mb.load(std::move(storage_), blocks);
+}
+
+
+//------------------------------------------------------------------------------
+// XmlLoader
+
+XmlLoader::XmlLoader(std::string_view filename) {
+    FILE *file = fopen(filename.data(), "rb");
+    if(!file) {
+        flags_ |= FILE_OPEN_ERROR;
+        return;
+    }
+    FileCloser close_file(file);
+
+    fseek(file, 0, SEEK_END);
+    size_t size = ftell(file);
+    std::unique_ptr<char[]> storage;
+    if(size) {
+        rewind(file);
+        storage = std::make_unique<char[]>(size);
+        size_t r = fread(storage.get(), size, 1, file);
+        if(r != 1) {
+            flags_ |= FILE_READ_ERROR;
+            return;
+        }
+    }
+    xml_ = std::make_unique<XmlDocument>();
+    auto e = xml_->Parse(storage.get(), size);
+    if(e != tinyxml2::XML_SUCCESS) {
+        flags_ |= XML_PARSE_ERROR;
+    }
+}
+
+XmlLoader::XmlLoader(std::unique_ptr<XmlDocument> &&xml):
     xml_(std::move(xml)) {}
 
 XmlLoader::XmlLoader(const XmlDocument &xml):
@@ -1082,10 +3124,196 @@ Result XmlLoader::load(MemoryObjectPtr &objects, FzFileType *file_type) {
         } else if(WAVE_TAGNAME == element->Name()) {
             current = MemoryWave::create(*element, current);
         } else {
-            return RESULT_XML_UNKNOWN_ELEMENT;
+            return RESULT_XML_UNKNOWN_ELEMENT;
+        }
+        if(!first) { first = current; }
+        element = element->NextSiblingElement();
+    }
+    objects = first;
+    return RESULT_OK;
+}
+
+
+//------------------------------------------------------------------------------
+// WavLoader
+
+// Voice settings for a newly imported sample, as suggested by the notes on
+// Voice (see FZ-1.h): play the whole sample once, with a full-level envelope
+static void default_voice(Voice &v, int32_t samples, SampleRate rate) {
+    v.data_start = v.play_start = 0;
+    v.data_end = samples - 1;
+    v.play_end = std::max(v.data_end - 2, 0);
+    v.loop = 0x01d7;
+    v.loop_sustain_point = 8;
+    for(size_t i = 0; i < std::size(v.loop_start); i++) {
+        v.loop_start[i] = v.loop_end[i] = v.play_end;
+        v.loop_time[i] = 64;
+    }
+    v.dca_end = v.dcf_end = 7;
+    for(size_t i = 0; i < std::size(v.dca_rate); i++) {
+        v.dca_rate[i] = static_cast<int8_t>(0xc0);
+        v.dcf_rate[i] = static_cast<int8_t>(0x90);
+    }
+    v.dca_rate[0] = v.dcf_rate[0] = 0x7f;
+    v.dca_end_level[0] = v.dcf_end_level[0] = 0xff;
+    v.lfo_name = 0x80;
+    v.lfo_rate = 0x40;
+    v.velocity_amplitude_key_follow = 0x30;
+    v.midi_hi = 0x60;
+    v.midi_lo = 0x24;
+    v.midi_origin = 0x48;
+    v.frequency = rate;
+}
+
+// The file's name, without directories or extension, as a voice name
+static void voice_name_from_filename(Voice &v, std::string_view filename) {
+    size_t slash = filename.find_last_of("/\\");
+    if(slash != std::string_view::npos) {
+        filename.remove_prefix(slash + 1);
+    }
+    filename = filename.substr(0, filename.find_last_of('.'));
+    const size_t length = std::min(filename.size(), sizeof(v.name) - 2);
+    memset(v.name, 0, sizeof(v.name));
+    for(size_t i = 0; i < length; i++) {
+        unsigned char c = static_cast<unsigned char>(filename[i]);
+        v.name[i] = isprint(c) ? static_cast<char>(toupper(c)) : ' ';
+    }
+}
+
+WavLoader::WavLoader(std::string_view filename,
+    SampleRate rate, DSP::ResampleQuality quality):
+    filename_(filename), rate_(rate), quality_(quality) {}
+
+Result WavLoader::load(MemoryObjectPtr &objects) {
+    objects.reset();
+    TinyWav tw = {};
+    if(tinywav_open_read(&tw, filename_.c_str(), TW_INTERLEAVED)) {
+        return RESULT_WAVE_OPEN_ERROR;
+    }
+    struct Closer {
+        ~Closer() { tinywav_close_read(&tw_); }
+        TinyWav &tw_;
+    } closer{ tw };
+    if(memcmp(tw.h.Subchunk2ID, "data", 4)) {
+        return RESULT_WAVE_READ_ERROR; // (no data chunk)
+    }
+
+    const bool
+        pcm16 = (tw.h.AudioFormat == 1) && (tw.h.BitsPerSample == 16),
+        float32 = (tw.h.AudioFormat == 3) && (tw.h.BitsPerSample == 32);
+    const size_t channels = tw.h.NumChannels;
+    if((!pcm16 && !float32) || !channels) {
+        return RESULT_WAVE_UNSUPPORTED_FORMAT;
+    }
+    // data at an FZ-1 rate is read as it is, anything else is resampled
+    SampleRate rate = rate_;
+    switch(tw.h.SampleRate) {
+        case 36000: rate = SR_36kHz; break;
+        case 18000: rate = SR_18kHz; break;
+        case 9000: rate = SR_9kHz; break;
+        default: break;
+    }
+    if(!sample_rate_hz(rate)) {
+        return RESULT_WAVE_BAD_SAMPLERATE;
+    }
+    if(!tw.h.SampleRate) {
+        return RESULT_WAVE_UNSUPPORTED_SAMPLERATE;
+    }
+    std::unique_ptr<DSP::Resampler> resampler;
+    if(tw.h.SampleRate != static_cast<uint32_t>(sample_rate_hz(rate))) {
+        resampler = std::make_unique<DSP::Resampler>(
+            tw.h.SampleRate, sample_rate_hz(rate), quality_);
+    }
+    const size_t
+        frame_size = channels * (pcm16 ? sizeof(int16_t) : sizeof(float)),
+        frames = tw.h.Subchunk2Size / frame_size,
+        samples = resampler ? resampler->output_length(frames) : frames,
+        wave_samples = std::size(Wave{}.samples);
+    if(!samples) {
+        return RESULT_NO_BLOCKS;
+    }
+    if(samples > EXPANDED_WAVE_MEMORY_BLOCKS * wave_samples) {
+        return RESULT_WAVE_TOO_LONG;
+    }
+
+    MemoryObjectPtr first = MemoryVoice::emplace([&](Voice &v) {
+        default_voice(v, static_cast<int32_t>(samples), rate);
+        voice_name_from_filename(v, filename_);
+    });
+    MemoryObjectPtr current = first;
+    auto emit = [&](const float *in, size_t count) {
+        current = MemoryWave::emplace([&](Wave &w) {
+            DSP::float_to_int16(in, w.samples, count);
+            std::fill(std::begin(w.samples) + count, std::end(w.samples), 0);
+        }, current);
+    };
+    // resampled output which doesn't fill a Wave yet stays in pending
+    std::vector<float> pending;
+    auto emit_pending = [&](bool all) {
+        size_t i = 0;
+        for(; (i + wave_samples <= pending.size()) ||
+            (all && (i < pending.size())); i += wave_samples) {
+            emit(&pending[i], std::min(wave_samples, pending.size() - i));
+        }
+        pending.erase(pending.begin(),
+            pending.begin() + std::min(i, pending.size()));
+    };
+
+    // one block of file data at a time: frames are mixed down straight into
+    // the new Wave (16-bit data at an FZ-1 rate), or into a float block
+    std::vector<uint8_t> buffer(wave_samples * frame_size);
+    float mixed[std::size(Wave{}.samples)];
+    for(size_t done = 0; done < frames; done += wave_samples) {
+        const size_t count = std::min(frames - done, wave_samples);
+        if(fread(buffer.data(), frame_size, count, tw.f) != count) {
+            return RESULT_WAVE_READ_ERROR;
+        }
+        if(pcm16 && !resampler) {
+            current = MemoryWave::emplace([&](Wave &w) {
+                const int16_t *in = reinterpret_cast<int16_t*>(buffer.data());
+                for(size_t i = 0; i < count; i++, in += channels) {
+                    int32_t sum = 0;
+                    for(size_t c = 0; c < channels; c++) {
+                        sum += in[c];
+                    }
+                    w.samples[i] = static_cast<int16_t>(
+                        sum / static_cast<int32_t>(channels));
+                }
+                std::fill(
+                    std::begin(w.samples) + count, std::end(w.samples), 0);
+            }, current);
+            continue;
+        }
+        if(pcm16) {
+            const int16_t *in = reinterpret_cast<int16_t*>(buffer.data());
+            const float scale = 1.f / (32768.f * channels);
+            for(size_t i = 0; i < count; i++, in += channels) {
+                int32_t sum = 0;
+                for(size_t c = 0; c < channels; c++) {
+                    sum += in[c];
+                }
+                mixed[i] = sum * scale;
+            }
+        } else {
+            const float *in = reinterpret_cast<float*>(buffer.data());
+            for(size_t i = 0; i < count; i++, in += channels) {
+                float sum = 0;
+                for(size_t c = 0; c < channels; c++) {
+                    sum += in[c];
+                }
+                mixed[i] = sum / channels;
+            }
+        }
+        if(resampler) {
+            resampler->process(mixed, count, pending);
+            emit_pending(false);
+        } else {
+            emit(mixed, count);
         }
-        if(!first) { first = current; }
-        element = element->NextSiblingElement();
+    }
+    if(resampler) {
+        resampler->flush(pending);
+        emit_pending(true);
     }
     objects = first;
     return RESULT_OK;
@@ -1145,6 +3373,124 @@ Result BlockDumper::file_dump(const MemoryBlocks &blocks, size_t *write_size) {
 }
 
 
+Result BlockDumper::update(const MemoryBlocks &blocks, size_t *write_size) {
+    if(destination_) {
+        return memory_update(blocks, write_size);
+    } else if(!filename_.empty()) {
+        return file_update(blocks, write_size);
+    }
+    return RESULT_UNINITIALIZED_DUMPER;
+}
+
+// Calls f(first, count) for each run of consecutive dirty blocks, stopping
+// early (and returning false) if f() returns false
+template<typename F>
+static bool for_each_dirty_run(const MemoryBlocks &blocks, F &&f) {
+    size_t n = blocks.count();
+    for(size_t i = 0; i < n; i++) {
+        if(blocks.is_dirty(i)) {
+            size_t first = i;
+            while((i + 1 < n) && blocks.is_dirty(i + 1)) {
+                i++;
+            }
+            if(!f(first, i + 1 - first)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+Result BlockDumper::memory_update(const MemoryBlocks &blocks, size_t *write_size) {
+    assert(destination_);
+    if(write_size) {
+        *write_size = 0;
+    }
+    if(size_ != blocks.count() * 1024) {
+        return RESULT_MISMATCHED_DUMP_SIZE;
+    }
+    size_t written = 0;
+    for_each_dirty_run(blocks, [&](size_t first, size_t count) {
+        memcpy(static_cast<uint8_t*>(destination_) + first * 1024,
+            blocks.block(first), count * 1024);
+        written += count * 1024;
+        return true;
+    });
+    if(write_size) {
+        *write_size = written;
+    }
+    return RESULT_OK;
+}
+
+Result BlockDumper::file_update(const MemoryBlocks &blocks, size_t *write_size) {
+    assert(!filename_.empty());
+    if(write_size) {
+        *write_size = 0;
+    }
+    size_t
+        expected_size = blocks.count() * 1024,
+        written = 0;
+#ifdef _WIN32
+    FILE *file = fopen(filename_.data(), "r+b");
+    if(!file) {
+        return RESULT_FILE_OPEN_ERROR;
+    }
+    FileCloser close_file(file);
+
+    fseek(file, 0, SEEK_END);
+    if(static_cast<size_t>(ftell(file)) != expected_size) {
+        return RESULT_MISMATCHED_DUMP_SIZE;
+    }
+    bool ok = for_each_dirty_run(blocks, [&](size_t first, size_t count) {
+        if( fseek(file, first * 1024, SEEK_SET) ||
+            (fwrite(blocks.block(first), count * 1024, 1, file) != 1) ) {
+            return false;
+        }
+        written += count * 1024;
+        return true;
+    });
+#else
+    int fd = open(filename_.data(), O_WRONLY);
+    if(fd < 0) {
+        return RESULT_FILE_OPEN_ERROR;
+    }
+    struct stat st;
+    if(fstat(fd, &st) || (static_cast<size_t>(st.st_size) != expected_size)) {
+        close(fd);
+        return RESULT_MISMATCHED_DUMP_SIZE;
+    }
+    bool ok = for_each_dirty_run(blocks, [&](size_t first, size_t count) {
+        const auto *data =
+            reinterpret_cast<const uint8_t*>(blocks.block(first));
+        size_t
+            offset = first * 1024,
+            size = count * 1024;
+        while(size) {
+            ssize_t w = pwrite(fd, data, size, offset);
+            if((w < 0) && (errno == EINTR)) {
+                continue;
+            }
+            if(w <= 0) {
+                return false;
+            }
+            data += w;
+            offset += w;
+            size -= w;
+            written += w;
+        }
+        return true;
+    });
+    if(close(fd)) {
+        ok = false;
+    }
+#endif
+    if(write_size) {
+        *write_size = written;
+    }
+    return ok ? RESULT_OK : RESULT_FILE_WRITE_ERROR;
+}
+
+
 //------------------------------------------------------------------------------
 // XmlDumper
 
@@ -1212,12 +3558,700 @@ void XmlDumper::print(const MemoryObjectPtr objects, XmlPrinter &p) {
     p.OpenElement(FZ_ML_ROOT_NAME.c_str());
     p.PushAttribute("version", FZ_ML_VERSION.c_str());
     p.PushAttribute("file_type", file_type_);
-    auto o = objects;
-    while(o) {
-        o->print(p);
-        o = o->next();
-    }
+    visit(objects, [&p](auto &o) { o.print(p); });
     p.CloseElement();
 }
 
+//------------------------------------------------------------------------------
+// BatchExporter
+
+// Run f(i) for i in [0, count) on up to threads threads, stopping early if any
+// call fails, and returning the first failure
+template<typename F>
+static Result parallel_for(size_t count, size_t threads, F &&f) {
+    std::atomic<size_t> next{ 0 };
+    std::atomic<bool> failed{ false };
+    Result first_failure = RESULT_OK;
+    std::mutex failure_mutex;
+    auto worker = [&] {
+        for(size_t i; !failed && ((i = next++) < count);) {
+            auto result = f(i);
+            if(!result_success(result)) {
+                std::lock_guard<std::mutex> lock(failure_mutex);
+                if(!failed) {
+                    first_failure = result;
+                    failed = true;
+                }
+            }
+        }
+    };
+    std::vector<std::thread> pool;
+    threads = std::min(threads, count);
+    for(size_t t = 1; t < threads; t++) {
+        pool.emplace_back(worker);
+    }
+    worker();
+    for(auto &t: pool) {
+        t.join();
+    }
+    return first_failure;
+}
+
+// A set of threads kept alive over many short parallel runs (where starting
+// and joining threads for each run, as parallel_for() does, would cost more
+// than the work itself). run(count, f) calls f(i) for i in [0, count) on the
+// workers and the calling thread, and returns once every call has finished.
+struct WorkerPool {
+    WorkerPool(size_t threads) {
+        for(size_t t = 1; t < threads; t++) {
+            workers_.emplace_back([this] { work(); });
+        }
+    }
+
+    ~WorkerPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        start_.notify_all();
+        for(auto &t: workers_) {
+            t.join();
+        }
+    }
+
+    template<typename F> void run(size_t count, F &&f) {
+        if(workers_.empty() || (count < 2)) {
+            for(size_t i = 0; i < count; i++) {
+                f(i);
+            }
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            job_ = std::ref(f);
+            count_ = count;
+            next_ = 0;
+            busy_ = workers_.size();
+            generation_++;
+        }
+        start_.notify_all();
+        drain();
+        std::unique_lock<std::mutex> lock(mutex_);
+        done_.wait(lock, [this] { return !busy_; });
+        job_ = nullptr;
+    }
+
+private:
+    void drain() {
+        for(size_t i; (i = next_++) < count_;) {
+            job_(i);
+        }
+    }
+
+    void work() {
+        uint64_t seen = 0;
+        for(;;) {
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                start_.wait(lock,
+                    [&] { return stopping_ || (generation_ != seen); });
+                if(stopping_) {
+                    return;
+                }
+                seen = generation_;
+            }
+            drain();
+            bool last;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                last = !--busy_;
+            }
+            if(last) {
+                done_.notify_one();
+            }
+        }
+    }
+
+    std::vector<std::thread> workers_;
+    std::mutex mutex_;
+    std::condition_variable start_, done_;
+    std::function<void(size_t)> job_;
+    std::atomic<size_t> next_{ 0 };
+    size_t count_ = 0;
+    size_t busy_ = 0; // workers still on the current run
+    uint64_t generation_ = 0; // bumped for each run
+    bool stopping_ = false;
+};
+
+void BatchExporter::add(std::string_view filename, std::string_view base) {
+    sources_.push_back({ std::string{ filename }, std::string{ base }, {} });
+}
+
+void BatchExporter::add(
+    std::shared_ptr<const MemoryBlocks> blocks, std::string_view base) {
+    sources_.push_back({ {}, std::string{ base }, std::move(blocks) });
+}
+
+size_t BatchExporter::thread_count() const {
+    if(options_.threads) {
+        return options_.threads;
+    }
+    return std::max<unsigned>(std::thread::hardware_concurrency(), 1);
+}
+
+Result BatchExporter::run(std::vector<std::string> *filenames) {
+    if(filenames) {
+        filenames->clear();
+    }
+    const size_t threads = thread_count();
+
+    // load everything that isn't already loaded
+    auto result = parallel_for(sources_.size(), threads, [this](size_t i) {
+        Source &source = sources_[i];
+        if(source.blocks) {
+            return RESULT_OK;
+        }
+        auto blocks = std::make_shared<MemoryBlocks>();
+        auto result = BlockLoader(source.filename).load(*blocks);
+        if(result_success(result)) {
+            source.blocks = std::move(blocks);
+        }
+        return result;
+    });
+    if(!result_success(result)) {
+        return result;
+    }
+
+    // then one job per (dump, voice)
+    struct Job {
+        const Source *source;
+        size_t voice;
+    };
+    std::vector<Job> jobs;
+    for(const Source &source: sources_) {
+        for(size_t n = 0; n < source.blocks->voices().size(); n++) {
+            jobs.push_back({ &source, n });
+        }
+    }
+    std::vector<std::string> written(jobs.size());
+    WriteGate gate(options_.max_writers);
+    const WavOptions wav(options_.format, options_.rate, options_.quality);
+    result = parallel_for(jobs.size(), threads, [&](size_t i) {
+        const Job &job = jobs[i];
+        return job.source->blocks->dump_voice_wav(job.voice,
+            job.source->base, wav, &written[i], &gate);
+    });
+    if(filenames) {
+        for(auto &filename: written) {
+            if(!filename.empty()) {
+                filenames->push_back(std::move(filename));
+            }
+        }
+    }
+    return result;
+}
+
+
+//------------------------------------------------------------------------------
+// MIDI files
+
+// A cursor over (big endian) MIDI file data, which stops reading (and clears
+// ok) rather than run past the end
+struct MidiReader {
+    const uint8_t *p, *end;
+    bool ok = true;
+
+    bool has(size_t n) {
+        if(static_cast<size_t>(end - p) < n) {
+            ok = false;
+        }
+        return ok;
+    }
+    void skip(size_t n) {
+        if(has(n)) {
+            p += n;
+        }
+    }
+    // read an n byte (big endian) number
+    uint32_t read(size_t n) {
+        uint32_t value = 0;
+        if(has(n)) {
+            for(size_t i = 0; i < n; i++) {
+                value = (value << 8) | *p++;
+            }
+        }
+        return value;
+    }
+    // read a variable length quantity (of up to 4 bytes)
+    uint32_t varlen() {
+        uint32_t value = 0;
+        for(size_t i = 0; ok && (i < 4); i++) {
+            uint32_t byte = read(1);
+            value = (value << 7) | (byte & 0x7f);
+            if(!(byte & 0x80)) {
+                return value;
+            }
+        }
+        ok = false;
+        return 0;
+    }
+};
+
+// A note, with its times in ticks
+struct MidiTickNote {
+    uint64_t start, end;
+    uint8_t channel, note, velocity;
+};
+
+// A tempo change (in microseconds per quarter note)
+struct MidiTempo {
+    uint64_t tick;
+    uint32_t tempo;
+};
+
+static bool parse_midi_track(MidiReader &r,
+    std::vector<MidiTickNote> &notes, std::vector<MidiTempo> &tempos) {
+
+    uint64_t tick = 0;
+    uint8_t status = 0;
+    // the notes still sounding (as indices into notes), oldest first
+    std::vector<size_t> sounding;
+    while(r.ok && (r.p < r.end)) {
+        tick += r.varlen();
+        uint8_t byte = r.read(1);
+        if(byte == 0xff) {
+            // meta event: only the tempo and the end of the track matter
+            uint8_t type = r.read(1);
+            uint32_t length = r.varlen();
+            status = 0;
+            if((type == 0x51) && (length == 3)) {
+                tempos.push_back({ tick, r.read(3) });
+                continue;
+            }
+            r.skip(length);
+            if(type == 0x2f) {
+                break;
+            }
+            continue;
+        }
+        if((byte == 0xf0) || (byte == 0xf7)) {
+            // system exclusive
+            r.skip(r.varlen());
+            status = 0;
+            continue;
+        }
+        uint8_t data1 = byte;
+        if(byte & 0x80) {
+            status = byte;
+            data1 = r.read(1);
+        } else if(!status) {
+            return false; // (running status, with no status to run on)
+        }
+        if(status >= 0xf0) {
+            return false;
+        }
+        const uint8_t
+            kind = status & 0xf0,
+            channel = status & 0x0f,
+            note = data1 & 0x7f,
+            data2 = ((kind == 0xc0) || (kind == 0xd0)) ? 0 : (r.read(1) & 0x7f);
+        if((kind == 0x90) && data2) {
+            sounding.push_back(notes.size());
+            notes.push_back({ tick, tick, channel, note, data2 });
+        } else if((kind == 0x80) || (kind == 0x90)) {
+            // (a note on with velocity 0 is a note off)
+            auto it = std::find_if(sounding.begin(), sounding.end(),
+                [&](size_t i) {
+                    return (notes[i].channel == channel) &&
+                        (notes[i].note == note);
+                });
+            if(it != sounding.end()) {
+                notes[*it].end = tick;
+                sounding.erase(it);
+            }
+        }
+    }
+    for(size_t i: sounding) {
+        notes[i].end = tick;
+    }
+    return r.ok;
+}
+
+Result parse_midi(
+    const uint8_t *data, size_t size, std::vector<MidiNote> &notes) {
+
+    notes.clear();
+    MidiReader r{ data, data + size };
+    if(!r.has(8) || memcmp(r.p, "MThd", 4)) {
+        return RESULT_MIDI_BAD_FILE;
+    }
+    r.skip(4);
+    const uint32_t header_size = r.read(4);
+    if((header_size < 6) || !r.has(header_size)) {
+        return RESULT_MIDI_BAD_FILE;
+    }
+    const uint8_t *header_end = r.p + header_size;
+    const uint32_t
+        format = r.read(2),
+        tracks = r.read(2),
+        division = r.read(2);
+    r.p = header_end;
+    if((format > 1) || !tracks || !(division & 0x7fff)) {
+        return RESULT_MIDI_BAD_FILE;
+    }
+
+    std::vector<MidiTickNote> ticked;
+    std::vector<MidiTempo> tempos;
+    for(uint32_t track = 0; track < tracks;) {
+        if(!r.has(8)) {
+            return RESULT_MIDI_BAD_FILE;
+        }
+        const bool is_track = !memcmp(r.p, "MTrk", 4);
+        r.skip(4);
+        const uint32_t length = r.read(4);
+        if(!r.has(length)) {
+            return RESULT_MIDI_BAD_FILE;
+        }
+        MidiReader chunk{ r.p, r.p + length };
+        r.skip(length);
+        // (chunks of other types are skipped)
+        if(is_track) {
+            if(!parse_midi_track(chunk, ticked, tempos)) {
+                return RESULT_MIDI_BAD_FILE;
+            }
+            track++;
+        }
+    }
+
+    // ticks to seconds: SMPTE divisions have a fixed number of ticks per
+    // second, and otherwise each tempo change starts a new run of ticks
+    double smpte = 0;
+    if(division & 0x8000) {
+        int fps = -static_cast<int8_t>(division >> 8);
+        smpte = ((fps == 29) ? 29.97 : fps) * (division & 0xff);
+    }
+    std::stable_sort(tempos.begin(), tempos.end(),
+        [](const MidiTempo &a, const MidiTempo &b) { return a.tick < b.tick; });
+    // the time at which each tempo change happens
+    std::vector<double> changes(tempos.size());
+    double time = 0;
+    uint64_t tick = 0;
+    uint32_t tempo = 500000; // (120bpm)
+    for(size_t i = 0; i < tempos.size(); i++) {
+        time += static_cast<double>(tempos[i].tick - tick) * tempo;
+        changes[i] = time;
+        tick = tempos[i].tick;
+        tempo = tempos[i].tempo;
+    }
+    auto seconds = [&](uint64_t t) {
+        if(smpte) {
+            return t / smpte;
+        }
+        auto it = std::upper_bound(tempos.begin(), tempos.end(), t,
+            [](uint64_t t, const MidiTempo &m) { return t < m.tick; });
+        if(it == tempos.begin()) {
+            return t * 500000e-6 / division;
+        }
+        size_t i = (it - tempos.begin()) - 1;
+        return (changes[i] + (static_cast<double>(t - tempos[i].tick) *
+            tempos[i].tempo)) * 1e-6 / division;
+    };
+
+    std::stable_sort(ticked.begin(), ticked.end(),
+        [](const MidiTickNote &a, const MidiTickNote &b) {
+            return a.start < b.start;
+        });
+    notes.reserve(ticked.size());
+    for(auto &n: ticked) {
+        notes.push_back(
+            { seconds(n.start), seconds(n.end),
+                n.channel, n.note, n.velocity });
+    }
+    return RESULT_OK;
+}
+
+Result load_midi_file(std::string_view filename, std::vector<MidiNote> &notes) {
+    notes.clear();
+    FILE *file = fopen(filename.data(), "rb");
+    if(!file) {
+        return RESULT_FILE_OPEN_ERROR;
+    }
+    FileCloser close_file(file);
+
+    fseek(file, 0, SEEK_END);
+    size_t size = ftell(file);
+    std::vector<uint8_t> data(size);
+    if(size) {
+        rewind(file);
+        if(fread(data.data(), size, 1, file) != 1) {
+            return RESULT_FILE_READ_ERROR;
+        }
+    }
+    return parse_midi(data.data(), data.size(), notes);
+}
+
+
+//------------------------------------------------------------------------------
+// Bank key maps
+
+BankKeyMap::BankKeyMap(const Bank &bank) {
+    const size_t areas = std::min<size_t>(bank.voice_count, Bank::MAXV);
+    for(size_t a = 0; a < areas; a++) {
+        const uint64_t bit = uint64_t(1) << a;
+        const size_t
+            key_hi = std::min<size_t>(bank.midi_hi[a], 127),
+            velocity_hi = std::min<size_t>(bank.velocity_hi[a], 127);
+        if(bank.midi_channel[a] < std::size(keys_)) {
+            auto &keys = keys_[bank.midi_channel[a]];
+            for(size_t k = bank.midi_lo[a]; k <= key_hi; k++) {
+                keys[k] |= bit;
+            }
+        }
+        for(size_t v = bank.velocity_lo[a]; v <= velocity_hi; v++) {
+            velocities_[v] |= bit;
+        }
+    }
+}
+
+// (an area's channel, key and velocity ranges are independent, so two areas
+// share an event if they share a (channel, key) and share a velocity)
+uint64_t BankKeyMap::overlaps(size_t a) const {
+    if(a >= Bank::MAXV) {
+        return 0;
+    }
+    const uint64_t bit = uint64_t(1) << a;
+    uint64_t keys = 0, velocities = 0;
+    for(auto &channel: keys_) {
+        for(uint64_t k: channel) {
+            if(k & bit) {
+                keys |= k;
+            }
+        }
+    }
+    for(uint64_t v: velocities_) {
+        if(v & bit) {
+            velocities |= v;
+        }
+    }
+    return keys & velocities & ~bit;
+}
+
+uint64_t BankKeyMap::reachable() const {
+    uint64_t keys = 0, velocities = 0;
+    for(auto &channel: keys_) {
+        for(uint64_t k: channel) {
+            keys |= k;
+        }
+    }
+    for(uint64_t v: velocities_) {
+        velocities |= v;
+    }
+    return keys & velocities;
+}
+
+
+//------------------------------------------------------------------------------
+// Bank rendering
+
+size_t bank_channels(BankOutputs outputs) {
+    return (outputs == BANK_INDIVIDUAL) ? 9 : 2;
+}
+
+// One bank area sounding for one note, with its times in frames
+struct BankVoice {
+    const Voice *voice = nullptr;
+    const MidiNote *note = nullptr;
+    size_t
+        start = 0,
+        release = 0,
+        stop = 0; // (at most tail frames after release)
+    size_t end = 0; // the frame after the last one rendered
+    float gains[9] = {}; // per output channel
+    std::unique_ptr<VoiceRenderer> renderer;
+    bool finished = false;
+};
+
+// The number of set bits, and the index of the lowest one (bits != 0)
+static size_t bit_count(uint64_t bits) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_popcountll(bits);
+#else
+    size_t n = 0;
+    for(; bits; bits &= bits - 1) {
+        n++;
+    }
+    return n;
+#endif
+}
+
+static size_t lowest_bit(uint64_t bits) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctzll(bits);
+#else
+    size_t n = 0;
+    for(; !(bits & 1); bits >>= 1) {
+        n++;
+    }
+    return n;
+#endif
+}
+
+// The gain of area a of bank on each output channel
+static void bank_gains(
+    const Bank &bank, size_t a, BankOutputs outputs, float *gains) {
+
+    // (volume is 1-127, but some dumps hold 0, which is taken as unset)
+    const uint8_t level = bank.area_volume[a] ? bank.area_volume[a] : 127;
+    const float volume = std::min<uint8_t>(level, 127) / 127.f;
+    const uint8_t mask = bank.output_mask[a];
+    if(outputs == BANK_INDIVIDUAL) {
+        gains[0] = volume;
+        for(size_t k = 0; k < 8; k++) {
+            gains[1 + k] = (mask & (1 << k)) ? volume : 0.f;
+        }
+        return;
+    }
+    // equal power panning, from output 1 on the left to output 8 on the right
+    if(!mask) {
+        gains[0] = gains[1] = volume * sqrtf(.5f);
+        return;
+    }
+    const float share = volume / bit_count(mask);
+    for(size_t k = 0; k < 8; k++) {
+        if(mask & (1 << k)) {
+            float angle = k / 7.f * static_cast<float>(DSP::PI) / 2;
+            gains[0] += share * cosf(angle);
+            gains[1] += share * sinf(angle);
+        }
+    }
+}
+
+Result render_bank(const MemoryBlocks &blocks, size_t n,
+    const std::vector<MidiNote> &notes, const BankRenderOptions &options,
+    std::vector<float> &out) {
+
+    out.clear();
+    const Bank *bank = blocks.bank(n);
+    if(!bank) {
+        return RESULT_MISSING_BANK;
+    }
+    const uint32_t rate = options.rate ? options.rate : RENDER_RATE;
+    const size_t channels = bank_channels(options.outputs);
+    auto frames = [rate](double seconds) {
+        return static_cast<size_t>(std::max(seconds, 0.0) * rate);
+    };
+    const size_t tail = frames(options.tail);
+
+    // every (note, area) pair, in order of starting frame
+    std::vector<BankVoice> voices;
+    size_t length = 0;
+    const BankKeyMap map(*bank);
+    for(const MidiNote &note: notes) {
+        for(uint64_t areas = map.areas(note.channel, note.note, note.velocity);
+            areas; areas &= areas - 1) {
+            const size_t a = lowest_bit(areas);
+            const Voice *voice = blocks.voice(bank->voice_index[a]);
+            if(!voice) {
+                return RESULT_MISSING_VOICE;
+            }
+            if(!sample_rate_hz(SampleRate(voice->frequency))) {
+                return RESULT_WAVE_BAD_SAMPLERATE;
+            }
+            BankVoice v;
+            v.voice = voice;
+            v.note = &note;
+            v.start = frames(note.start);
+            v.release = std::max(frames(note.end), v.start);
+            v.stop = v.release + tail;
+            bank_gains(*bank, a, options.outputs, v.gains);
+            length = std::max(length, v.stop);
+            voices.push_back(std::move(v));
+        }
+    }
+    std::stable_sort(voices.begin(), voices.end(),
+        [](const BankVoice &a, const BankVoice &b) {
+            return a.start < b.start;
+        });
+
+    const size_t threads = options.threads ? options.threads :
+        std::max<unsigned>(std::thread::hardware_concurrency(), 1);
+    const Span<int16_t> samples = blocks.samples();
+    out.assign(length * channels, 0.f);
+    std::vector<BankVoice*> sounding;
+    std::vector<float> scratch;
+    // (one set of threads for the whole render, not one per segment)
+    WorkerPool pool(std::min(threads, voices.size()));
+    size_t next = 0, end = 0;
+    for(size_t s = 0; s < length; s += BANK_RENDER_SEGMENT) {
+        const size_t segment = std::min(BANK_RENDER_SEGMENT, length - s);
+        while((next < voices.size()) && (voices[next].start < s + segment)) {
+            sounding.push_back(&voices[next++]);
+        }
+
+        // render each sounding voice into its own part of the scratch buffer
+        scratch.assign(sounding.size() * segment, 0.f);
+        pool.run(sounding.size(), [&](size_t i) {
+            BankVoice &v = *sounding[i];
+            float *buffer = scratch.data() + (i * segment);
+            if(!v.renderer) {
+                v.renderer = std::make_unique<VoiceRenderer>(
+                    *v.voice, samples, rate);
+                v.renderer->note_on(v.note->note, v.note->velocity);
+            }
+            size_t at = std::max(v.start, s);
+            const size_t until = std::min(v.stop, s + segment);
+            if((v.release >= at) && (v.release < until)) {
+                at += v.renderer->render(buffer + (at - s), v.release - at);
+                v.renderer->note_off();
+            }
+            if(at < until) {
+                at += v.renderer->render(buffer + (at - s), until - at);
+            }
+            v.end = at;
+            v.finished = !v.renderer->active() || (at >= v.stop);
+        });
+
+        // and mix them, in order
+        for(size_t i = 0; i < sounding.size(); i++) {
+            BankVoice &v = *sounding[i];
+            const float *buffer = scratch.data() + (i * segment);
+            float *mix = out.data() + (s * channels);
+            for(size_t c = 0; c < channels; c++) {
+                const float gain = v.gains[c];
+                if(gain == 0.f) {
+                    continue;
+                }
+                for(size_t f = 0; f < segment; f++) {
+                    mix[(f * channels) + c] += buffer[f] * gain;
+                }
+            }
+            end = std::max(end, v.end);
+        }
+        sounding.erase(std::remove_if(sounding.begin(), sounding.end(),
+            [](BankVoice *v) {
+                if(v->finished) {
+                    v->renderer.reset();
+                }
+                return v->finished;
+            }), sounding.end());
+    }
+    out.resize(end * channels);
+    return RESULT_OK;
+}
+
+Result render_bank_wav(const MemoryBlocks &blocks, size_t n,
+    const std::vector<MidiNote> &notes, std::string_view filename,
+    const BankRenderOptions &options, WavFormat format) {
+
+    std::vector<float> out;
+    auto result = render_bank(blocks, n, notes, options, out);
+    if(!result_success(result)) {
+        return result;
+    }
+    const size_t channels = bank_channels(options.outputs);
+    return write_wav_frames(filename, out.data(), out.size() / channels,
+        static_cast<uint16_t>(channels),
+        options.rate ? options.rate : RENDER_RATE, format);
+}
+
 } // Casio::FZ_1::API
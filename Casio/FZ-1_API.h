@@ -2,9 +2,13 @@
 #define CASIO_FZ_1_API
 
 #include "Casio/FZ-1.h"
+#include "Casio/FZ-1_DSP.h"
 #include <memory>
 #include <string>
 #include <string_view>
+#include <type_traits>
+#include <variant>
+#include <vector>
 
 namespace tinyxml2 {
 class XMLDocument;
@@ -15,10 +19,13 @@ class XMLPrinter;
 namespace Casio::FZ_1::API {
 
 using MemoryObjectPtr = std::shared_ptr<struct MemoryObject>;
+using MemorySnapshotPtr = std::shared_ptr<const struct MemorySnapshot>;
 using XmlDocument = tinyxml2::XMLDocument;
 using XmlElement = tinyxml2::XMLElement;
 using XmlPrinter = tinyxml2::XMLPrinter;
 
+struct WriteGate; // (used internally, to limit concurrent file writes)
+
 //------------------------------------------------------------------------------
 // Result codes
 
@@ -48,10 +55,16 @@ using XmlPrinter = tinyxml2::XMLPrinter;
         "Cannot write to file.") \
     _(RESULT_MEMORY_TOO_SMALL, \
         "Memory buffer is too small to hold data being dumped.") \
+    _(RESULT_MERGE_TOO_LARGE, \
+        "Merged data would exceed the bank/voice/block limits of a dump.") \
+    _(RESULT_MIDI_BAD_FILE, \
+        "MIDI file is not a valid (format 0 or 1) Standard MIDI File.") \
     _(RESULT_MISMATCHED_BANK_BLOCK, \
         "Actual bank block count does not match the expected.") \
     _(RESULT_MISMATCHED_BLOCK_COUNT, \
         "Actual block count does not match the expected.") \
+    _(RESULT_MISMATCHED_DUMP_SIZE, \
+        "Existing dump size does not match the blocks being updated.") \
     _(RESULT_MISMATCHED_VOICE_BLOCK, \
         "Actual voice block count does not match the expected.") \
     _(RESULT_MISMATCHED_WAVE_BLOCK, \
@@ -66,12 +79,22 @@ using XmlPrinter = tinyxml2::XMLPrinter;
         "No blocks are present where some are expected.") \
     _(RESULT_UNINITIALIZED_DUMPER, \
         "Dumper does not have enough information to specify an operation.") \
+    _(RESULT_WAVE_BAD_FORMAT, \
+        "Bad wave format: use WAV_PCM16 or WAV_FLOAT32.") \
     _(RESULT_WAVE_BAD_OFFSET, \
         "Wave offset is past the end of the wave data of all wave blocks.") \
     _(RESULT_WAVE_BAD_SAMPLERATE, \
         "Bad samplerate specifier: use 0 (36kHz), 1 (18kHz) or 2 (9kHz).") \
     _(RESULT_WAVE_OPEN_ERROR, \
         "Cannot open wave file.") \
+    _(RESULT_WAVE_READ_ERROR, \
+        "Cannot read from wave file.") \
+    _(RESULT_WAVE_TOO_LONG, \
+        "Wave data is too long to fit into (expanded) wave memory.") \
+    _(RESULT_WAVE_UNSUPPORTED_FORMAT, \
+        "Wave file data must be 16-bit PCM or 32-bit float.") \
+    _(RESULT_WAVE_UNSUPPORTED_SAMPLERATE, \
+        "Wave file has a sample rate of 0.") \
     _(RESULT_WAVE_WRITE_ERROR, \
         "Cannot write to wave file.") \
     _(RESULT_XML_EMPTY, \
@@ -134,6 +157,241 @@ enum SampleRate: uint8_t {
 };
 
 
+//------------------------------------------------------------------------------
+// WavFormat
+
+// Sample format for .wav output: 16-bit PCM holds FZ-1 samples exactly (and
+// is written without conversion), 32-bit float is scaled to [-1, 1).
+enum WavFormat: uint8_t {
+    WAV_PCM16,
+    WAV_FLOAT32,
+};
+
+// How .wav output is written: the sample format, and the sample rate. A rate
+// of 0 keeps the FZ-1 rate of the data (36kHz, 18kHz or 9kHz); any other rate
+// (e.g. 44100) resamples the data to it, using the quality given.
+struct WavOptions {
+    WavOptions(WavFormat format = WAV_PCM16, uint32_t rate = 0,
+        DSP::ResampleQuality quality = DSP::RESAMPLE_GOOD):
+        format(format), rate(rate), quality(quality) {}
+
+    WavFormat format;
+    uint32_t rate;
+    DSP::ResampleQuality quality;
+};
+
+
+//------------------------------------------------------------------------------
+// Voice sample addresses
+
+// Loop starts keep their fine settings in the upper 8 bits, and loop ends keep
+// the skip/trace flag in the MSB: these masks select the address part.
+constexpr int32_t LOOP_START_ADDRESS_MASK = 0x00ffffff;
+constexpr int32_t LOOP_END_ADDRESS_MASK = 0x7fffffff;
+
+// Move all of a voice's sample addresses (data, play and loop points) by
+// delta samples, e.g. when its wave data is relocated within a dump.
+void rebase_voice(Voice &v, int32_t delta);
+
+
+// The .wav filename used for voice n (counting from 0) by
+// MemoryBlocks::dump_voice_wavs(): base, the voice number and the voice's name
+// (with any characters that aren't safe in filenames replaced), e.g.
+// "base_01_PIANO.wav".
+std::string voice_wav_filename(std::string_view base, size_t n, const Voice &v);
+
+
+//------------------------------------------------------------------------------
+// Span
+
+// A non-owning view over size() objects of type T, spaced Stride bytes apart.
+// The default stride gives a plain contiguous array (e.g. Waves, which fill
+// their blocks exactly); a larger stride skips over padding (e.g. Voices, which
+// are spaced 256 bytes apart inside VoiceBlocks).
+template<typename T, size_t Stride = sizeof(T)>
+struct Span {
+    static_assert(Stride >= sizeof(T), "Span stride is smaller than T");
+
+    using Byte = std::conditional_t<std::is_const_v<T>, const uint8_t, uint8_t>;
+
+    struct Iterator {
+        T &operator*() const { return *reinterpret_cast<T*>(p_); }
+        T *operator->() const { return reinterpret_cast<T*>(p_); }
+        Iterator &operator++() { p_ += Stride; return *this; }
+        bool operator==(const Iterator &that) const { return p_ == that.p_; }
+        bool operator!=(const Iterator &that) const { return p_ != that.p_; }
+
+        Byte *p_;
+    };
+
+    Span() = default;
+    Span(T *first, size_t size):
+        data_(reinterpret_cast<Byte*>(first)), size_(size) {}
+
+    T &operator[](size_t n) const {
+        return *reinterpret_cast<T*>(data_ + (n * Stride));
+    }
+
+    T *data() const { return reinterpret_cast<T*>(data_); }
+    size_t size() const { return size_; }
+    bool empty() const { return !size_; }
+
+    Iterator begin() const { return Iterator{ data_ }; }
+    Iterator end() const { return Iterator{ data_ + (size_ * Stride) }; }
+
+private:
+    Byte *data_ = nullptr;
+    size_t size_ = 0;
+};
+
+
+//------------------------------------------------------------------------------
+// Loop search
+
+// Parameters for find_loops(). Each candidate loop ends just before a rising
+// zero crossing. Candidates are scored by the normalized cross-correlation of
+// the window samples leading up to the loop end with those leading up to the
+// loop start, less a penalty for any jump in level or slope across the joint
+// (so the best starts are also at a matching rising zero crossing).
+// The search is coarse-to-fine: every start is tried against a spread of ends
+// on a decimated copy of the samples, and the best pairs are then refined at
+// full resolution.
+struct LoopSearchOptions {
+    size_t candidates = 1; // loops wanted (the best first), up to 8
+    size_t min_length = 1024; // shortest loop, in samples
+    size_t window = 256; // samples compared at each joint
+    size_t decimation = 16; // step of the coarse search
+    size_t ends = 64; // loop ends tried by the coarse search
+};
+
+struct LoopCandidate {
+    int32_t start = 0; // first sample of the loop
+    int32_t end = 0; // last sample of the loop
+    float score = 0; // up to 1 (a perfect match)
+    int16_t xfade_time = 0; // suggested cross fade (0-1023)
+};
+
+// Search samples[first, last] (sample addresses, within samples) for loops,
+// returning the best (distinct) candidates in order, with addresses
+// relative to samples. Finding none is not an error.
+Result find_loops(Span<int16_t> samples, size_t first, size_t last,
+    const LoopSearchOptions &options, std::vector<LoopCandidate> &loops);
+
+// Write loops into a voice's loop slots (up to all 8, the first as the
+// sustain loop): loop_end_point becomes the last of them, and unused slots
+// are set to play_end. Loop start fine settings and loop end skip/trace flags
+// are left as they were.
+void apply_loops(Voice &v, const std::vector<LoopCandidate> &loops);
+
+
+//------------------------------------------------------------------------------
+// Sample analysis
+
+// Samples within [-16, 16] (about -66dBFS) are counted as silence by default
+constexpr int16_t SILENCE_THRESHOLD = 16;
+
+// The levels of a run of samples. Levels are fractions of full scale (so
+// 1.0 is 0dBFS).
+struct SampleAnalysis {
+    size_t count = 0; // samples analysed
+    float peak = 0; // largest magnitude
+    float rms = 0; // root mean square level
+    float dc_offset = 0; // mean sample value
+    size_t clipped = 0; // samples at full scale (-32768 or 32767)
+    size_t leading_silence = 0; // samples before the first non-silent one
+    size_t trailing_silence = 0; // samples after the last non-silent one
+};
+
+// Analyse samples in a single pass (see DSP::sample_stats())
+SampleAnalysis analyze_samples(
+    Span<int16_t> samples, int16_t silence = SILENCE_THRESHOLD);
+
+
+//------------------------------------------------------------------------------
+// Voice rendering
+
+// The FZ-1's output rate, which rendering uses by default
+constexpr uint32_t RENDER_RATE = 36000;
+
+// A note for render_voice() to play
+struct RenderNote {
+    uint8_t note = 60; // MIDI note number
+    uint8_t velocity = 100; // 1-127
+    double hold = 1.0; // seconds until the key is released
+    double tail = 2.0; // most seconds to render after release
+};
+
+// Plays one note of a voice from its wave data (the whole run of samples
+// that its addresses refer to), approximating the FZ-1's playback: pitch
+// (from midi_origin, with pitch_correction as a fine tune), the loops up to
+// loop_end_point with their loop_time, sustain loop and cross fade, the DCA
+// and DCF envelopes (levels, rates, sustain and end sections), the resonant
+// filter, the LFO, and key and velocity follow.
+// Rendering works in blocks of BLOCK samples: envelopes, the LFO and the
+// filter's cutoff and Q are updated once per block, with the amplitude and
+// the filter's coefficients ramped linearly across it, so the per-sample work
+// is a tight loop over arrays. The envelopes' levels for up to CONTROL_BLOCKS
+// blocks are generated at a time (see DSP::Envelope::render()).
+struct VoiceRenderer {
+    static constexpr size_t BLOCK = 32, CONTROL_BLOCKS = 64;
+
+    VoiceRenderer(const Voice &voice, Span<int16_t> samples,
+        uint32_t rate = RENDER_RATE);
+
+    void note_on(uint8_t note, uint8_t velocity);
+    void note_off();
+
+    // False once the note has ended (or before note_on())
+    bool active() const { return active_; }
+
+    // Render up to count samples, adding them to out, and return the number
+    // rendered (fewer than count once the note ends)
+    size_t render(float *out, size_t count);
+
+private:
+    struct Loop {
+        double start; // (with the fine setting)
+        int64_t end;
+        double length;
+        double xfade; // samples before end that the cross fade covers
+        double time; // seconds to loop for (infinite for ever)
+        bool sustain; // loop until the key is released
+    };
+
+    float lfo(size_t count);
+    bool loop_exits() const;
+    float sample(int64_t address) const;
+
+    Voice voice_;
+    Span<int16_t> samples_;
+    uint32_t rate_ = 0;
+    bool active_ = false, released_ = false;
+
+    std::vector<Loop> loops_;
+    size_t loop_ = 0; // the current loop (loops_.size() once past them all)
+    bool looping_ = false; // (once the current loop has looped)
+    double loop_elapsed_ = 0; // seconds since the current loop first looped
+    int64_t play_end_ = 0;
+    double position_ = 0, step_ = 0;
+
+    DSP::Envelope dca_, dcf_;
+    float gain_ = 0, last_gain_ = 0;
+    float depth_ = 0; // of the DCF envelope, after velocity follow
+    float cutoff_ = 0, resonance_ = 0; // (as fractions of their ranges)
+    DSP::LowPassFilter filter_;
+
+    double lfo_phase_ = 0, lfo_step_ = 0;
+    size_t lfo_delay_ = 0, lfo_attack_ = 0, lfo_elapsed_ = 0;
+    float lfo_hold_ = 0;
+    uint32_t lfo_random_ = 1;
+};
+
+// Render a note of a voice (as VoiceRenderer) into out, until the note ends
+// or note.tail seconds after its release
+Result render_voice(const Voice &voice, Span<int16_t> samples,
+    const RenderNote &note, uint32_t rate, std::vector<float> &out);
+
+
 //------------------------------------------------------------------------------
 // MemoryBlocks
 
@@ -166,6 +424,61 @@ struct MemoryBlocks {
     Voice *voice(size_t n) const;
     Wave *wave(size_t n) const;
 
+    // Bulk access to all banks/voices/waves, for linear iteration without
+    // per-item header lookups or type checks. Empty if there are none.
+    Span<Bank, sizeof(BankBlock)> banks() const;
+    Span<Voice, sizeof(VoicePad_)> voices() const;
+    Span<Wave> waves() const;
+
+    // All wave data as a single run of samples, indexed by absolute sample
+    // address (the address space of Voice::data_start, play_end, etc.), and
+    // a subrange of it (empty if [offset, offset + count) is out of range).
+    Span<int16_t> samples() const;
+    Span<int16_t> samples(size_t offset, size_t count) const;
+
+    // Dump count samples from absolute sample address offset to a .wav file.
+    // If fewer than count samples remain, the output is truncated.
+    Result dump_wav(std::string_view filename, SampleRate freq,
+        size_t offset, size_t count, const WavOptions &options = {}) const;
+
+    // The sample data of voice n: data_start to data_end (inclusive), clipped
+    // to the available wave data. Empty if there is no such voice.
+    Span<int16_t> voice_samples(size_t n) const;
+
+    // Analyse voice n's sample data (as given by voice_samples()), or that
+    // of every voice, in order. A missing voice has an empty analysis.
+    SampleAnalysis analyze_voice(
+        size_t n, int16_t silence = SILENCE_THRESHOLD) const;
+    std::vector<SampleAnalysis> analyze_voices(
+        int16_t silence = SILENCE_THRESHOLD) const;
+
+    // Dump every voice's sample data to its own .wav file, at the voice's
+    // own rate, named by voice_wav_filename(). Each file carries 'smpl' and
+    // 'cue ' chunks with the voice's loops and MIDI origin note. Voices with
+    // no sample data are skipped. If filenames is supplied, it receives the
+    // files written.
+    Result dump_voice_wavs(std::string_view base,
+        const WavOptions &options = {},
+        std::vector<std::string> *filenames = nullptr) const;
+
+    // Dump a single voice, as dump_voice_wavs() does. filename (if supplied)
+    // receives the file written, or is left empty if the voice was skipped.
+    Result dump_voice_wav(size_t n, std::string_view base,
+        const WavOptions &options = {}, std::string *filename = nullptr) const;
+
+    // Render a note of voice n (see render_voice()) to a mono .wav file, at
+    // options.rate (or RENDER_RATE if that is 0)
+    Result render_voice_wav(size_t n, std::string_view filename,
+        const RenderNote &note, const WavOptions &options = {}) const;
+
+    // The range of blocks holding each type of data, as found by parse().
+    // The effect (if any) lives in block 0, alongside the file header.
+    struct Section {
+        size_t start = 0;
+        size_t length = 0;
+    };
+    Section section(BlockType type) const;
+
     size_t count() const { return count_; }
     FzFileType file_type() const { return file_type_; }
 
@@ -177,20 +490,68 @@ struct MemoryBlocks {
 
     void reset();
 
+    // Dirty tracking: a block is dirty if it has been (re)written by
+    // MemoryObject::pack() or MemoryObject::repack() since it was loaded or
+    // since the last call to clean(). BlockDumper::update() only writes these.
+    bool is_dirty(size_t n) const;
+    size_t dirty_count() const;
+    void clean();
+
+    // Content hashes: a 64-bit hash (XXH64) of each block, and a digest of the
+    // whole dump (a hash of the block hashes, in order). These are computed
+    // by parse() and kept up to date by pack(), repack(), merge() and
+    // compact(). Call rehash() after changing block data by any other means.
+    uint64_t block_hash(size_t n) const;
+    uint64_t digest() const;
+    void rehash();
+
     // unpack block array into a list of MemoryObjects
     Result unpack(MemoryObjectPtr& mo);
 
+    // Splice the banks, voices and waves of several dumps (in order) into a
+    // single image, without unpacking them. Voice sample addresses are rebased
+    // onto the merged wave data and bank voice_index tables are remapped onto
+    // the merged voices. For TYPE_FULL output, the first effect found in the
+    // inputs is kept. out may also be one of the inputs. If the result would
+    // hold more than 64 voices (Bank::MAXV), more than 255 banks or more
+    // blocks than the header can count, RESULT_MERGE_TOO_LARGE is returned.
+    static Result merge(const std::vector<const MemoryBlocks*> &in,
+        MemoryBlocks &out, FzFileType type = TYPE_FULL);
+
+    // Drop wave blocks which are not referenced by any voice (by its data,
+    // play or loop addresses), slide the remaining wave data down and
+    // relocate the voices' addresses to match. If removed is supplied, it
+    // receives the number of blocks dropped. As with pack(), all blocks are
+    // considered dirty afterwards if anything was removed.
+    Result compact(size_t *removed = nullptr);
+
+    // Search voice n's play range for loops (see find_loops()) and write any
+    // found into the voice with apply_loops(). If loops is supplied, it
+    // receives the candidates found.
+    Result find_voice_loops(size_t n, const LoopSearchOptions &options = {},
+        std::vector<LoopCandidate> *loops = nullptr);
+
 private:
     void *block_data(size_t n) const;
     Result load(std::unique_ptr<uint8_t[]> &&storage, size_t count);
     Result parse();
+    void touch(size_t n);
+    void touch_all();
+    Result dump_voice_wav(size_t n, std::string_view base,
+        const WavOptions &options, std::string *filename,
+        WriteGate *gate) const;
 
     std::unique_ptr<uint8_t[]> storage_;
     std::unique_ptr<BlockType[]> block_types_;
+    std::unique_ptr<bool[]> dirty_;
+    std::unique_ptr<uint64_t[]> hashes_;
+    Section sections_[BT_NONE];
+    size_t voice_count_ = 0;
     void *data_ = nullptr;
     size_t count_ = 0;
     FzFileType file_type_ = TYPE_UNKNOWN;
 
+    friend struct BatchExporter;
     friend struct BlockLoader;
     friend struct BlockDumper;
     friend struct MemoryObject;
@@ -216,40 +577,80 @@ struct MemoryObject: std::enable_shared_from_this<MemoryObject> {
     static auto create(const U &u, MemoryObjectPtr prev);
 
     virtual ~MemoryObject() = default;
-    virtual BlockType type() { return BT_NONE; }
+    BlockType type() const { return type_; }
     size_t index() { return index_; }
 
     MemoryObjectPtr prev() { return prev_.lock(); }
-    MemoryObjectPtr next() { return next_; }
+    // (by reference, so walking a list with next().get() copies no pointers)
+    const MemoryObjectPtr &next() { return next_; }
 
     MemoryObjectPtr insert_after(MemoryObjectPtr obj);
     MemoryObjectPtr insert_before(MemoryObjectPtr obj);
 
+    // Unlink this object from its list, returning the object which followed it
+    MemoryObjectPtr remove();
+
     // Only one of these will return non-null for any given object
     virtual Bank *bank() { return nullptr; }
     virtual Effect *effect() { return nullptr; }
     virtual Voice *voice() { return nullptr; }
     virtual Wave *wave() { return nullptr; }
 
+    // Dirty tracking: objects are dirty when created and clean once they have
+    // been unpacked, packed or repacked. Call touch() after changing an object's
+    // data (via bank(), voice() etc.) so that repack() will write it back.
+    bool is_dirty() const { return dirty_; }
+    void touch() { dirty_ = true; }
+
     // Pack memory object list back into a contiguous array of blocks
     static Result pack(
         MemoryObjectPtr in, MemoryBlocks &out, FzFileType type = TYPE_FULL);
 
+    // Write only the dirty objects of a list back into an existing block array
+    // which has the same layout (i.e. the list was unpacked from it, or last
+    // packed into it, and no objects have been added or removed since).
+    // Objects which have been moved within the list (by remove() and
+    // insert_after() etc.) are written too, as if they were dirty. Only the
+    // affected blocks are rewritten (and marked dirty in out).
+    // If the layouts differ (different counts, or an object which would land
+    // in a block of another type), nothing is written and
+    // RESULT_MISMATCHED_BLOCK_COUNT is returned: use pack() instead.
+    static Result repack(MemoryObjectPtr in, MemoryBlocks &out);
+
 protected:
     // This restricts access of derived class constructors (which must be public
     // so that std::make_shared<T>() can access them).
     struct Lock {};
 
-    MemoryObject(MemoryObjectPtr prev): prev_(prev) {}
+    MemoryObject(BlockType type, MemoryObjectPtr prev):
+        type_(type), prev_(prev) {}
     virtual bool pack(Block *block, size_t index) { return false; }
+
+    // Attach a fully constructed object to the end of prev (if non-null): used
+    // by the create() and emplace() factories of derived classes.
+    static void link(const MemoryObjectPtr &prev, const MemoryObjectPtr &obj) {
+        if(prev) {
+            prev->link(obj);
+        }
+    }
     virtual void print(XmlPrinter &printer) {}
 
     size_t index_ = 0;
+    const BlockType type_ = BT_NONE;
+    bool dirty_ = true;
+    // Where the object was last unpacked from or packed to (block * 4 +
+    // index), so that repack() can tell when it has been moved
+    size_t placed_ = SIZE_MAX;
 
 private:
+    // Calls f(object, block, index) for each object in the list with the index
+    // of the block it packs into (and its index inside that block), returning
+    // the total number of blocks
+    template<typename F> static size_t place(const MemoryObjectPtr &in, F &&f);
+
     void link(const MemoryObjectPtr &next) {
         next_ = next;
-        if(next_->type() == type()) {
+        if(next_->type_ == type_) {
             next_->index_ = index_ + 1;
         }
     }
@@ -257,54 +658,75 @@ private:
     std::weak_ptr<MemoryObject> prev_;
     MemoryObjectPtr next_;
 
+    friend struct MemoryBlocks;
     friend class XmlDumper;
     friend class XmlLoader;
+    template<typename F> friend void visit(const MemoryObjectPtr &first, F &&f);
 };
 
 
 //------------------------------------------------------------------------------
 // MemoryBank
 
-struct MemoryBank: MemoryObject {
+struct MemoryBank final: MemoryObject {
     template<typename U>
     static std::shared_ptr<MemoryBank> create(
         const U &u, MemoryObjectPtr prev = nullptr);
 
+    // Construct the Bank in place: fill(Bank &) is called exactly once on the
+    // (default) Bank owned by the new object, before it is linked.
+    template<typename F>
+    static std::shared_ptr<MemoryBank> emplace(
+        F &&fill, MemoryObjectPtr prev = nullptr);
+
     MemoryBank(Lock, const Bank &bank, MemoryObjectPtr prev):
-        MemoryObject(prev), bank_(bank) {}
+        MemoryObject(BT_BANK, prev), bank_(bank) {}
+    MemoryBank(Lock, MemoryObjectPtr prev): MemoryObject(BT_BANK, prev) {}
     MemoryBank(Lock, const XmlElement &element, MemoryObjectPtr prev);
 
-    BlockType type() override { return BT_BANK; }
     Bank *bank() override { return &bank_; }
 
 protected:
     bool pack(Block *block, size_t index) override;
     void print(XmlPrinter &printer) override;
 
+    friend struct MemoryObject;
+    friend class XmlDumper;
+
 private:
     Bank bank_;
 };
 
+template<typename F>
+std::shared_ptr<MemoryBank> MemoryBank::emplace(F &&fill, MemoryObjectPtr prev) {
+    auto result = std::make_shared<MemoryBank>(Lock{}, prev);
+    fill(result->bank_);
+    MemoryObject::link(prev, result);
+    return result;
+}
+
 
 //------------------------------------------------------------------------------
 // MemoryEffect
 
-struct MemoryEffect: MemoryObject {
+struct MemoryEffect final: MemoryObject {
     template<typename U>
     static std::shared_ptr<MemoryEffect> create(
         const U &u, MemoryObjectPtr prev = nullptr);
 
     MemoryEffect(Lock, const Effect &effect, MemoryObjectPtr prev):
-        MemoryObject(prev), effect_(effect) {}
+        MemoryObject(BT_EFFECT, prev), effect_(effect) {}
     MemoryEffect(Lock, const XmlElement &element, MemoryObjectPtr prev);
 
-    BlockType type() override { return BT_EFFECT; }
     Effect *effect() override { return &effect_; }
 
 protected:
     bool pack(Block *block, size_t index) override;
     void print(XmlPrinter &printer) override;
 
+    friend struct MemoryObject;
+    friend class XmlDumper;
+
 private:
     Effect effect_;
 };
@@ -313,40 +735,69 @@ private:
 //------------------------------------------------------------------------------
 // MemoryVoice
 
-struct MemoryVoice: MemoryObject {
+struct MemoryVoice final: MemoryObject {
     template<typename U>
     static std::shared_ptr<MemoryVoice> create(
         const U &u, MemoryObjectPtr prev = nullptr);
 
+    // Construct the Voice in place: fill(Voice &) is called exactly once on the
+    // (default) Voice owned by the new object, before it is linked.
+    template<typename F>
+    static std::shared_ptr<MemoryVoice> emplace(
+        F &&fill, MemoryObjectPtr prev = nullptr);
+
     MemoryVoice(Lock, const Voice &voice, MemoryObjectPtr prev):
-        MemoryObject(prev), voice_(voice) {}
+        MemoryObject(BT_VOICE, prev), voice_(voice) {}
+    MemoryVoice(Lock, MemoryObjectPtr prev): MemoryObject(BT_VOICE, prev) {}
     MemoryVoice(Lock, const XmlElement &element, MemoryObjectPtr prev);
 
-    BlockType type() override { return BT_VOICE; }
     Voice *voice() override { return &voice_; }
 
 protected:
     bool pack(Block *block, size_t index) override;
     void print(XmlPrinter &printer) override;
 
+    friend struct MemoryObject;
+    friend class XmlDumper;
+
 private:
     Voice voice_;
 };
 
+template<typename F>
+std::shared_ptr<MemoryVoice> MemoryVoice::emplace(F &&fill, MemoryObjectPtr prev) {
+    auto result = std::make_shared<MemoryVoice>(Lock{}, prev);
+    fill(result->voice_);
+    MemoryObject::link(prev, result);
+    return result;
+}
+
 
 //------------------------------------------------------------------------------
 // MemoryWave
 
-struct MemoryWave: MemoryObject {
+struct MemoryWave final: MemoryObject {
     template<typename U>
     static std::shared_ptr<MemoryWave> create(
         const U &u, MemoryObjectPtr prev = nullptr);
 
+    // Copy (up to 512) samples straight from a decode buffer into the new Wave,
+    // zero-filling any remainder.
+    static std::shared_ptr<MemoryWave> create(
+        const int16_t *samples, size_t count, MemoryObjectPtr prev = nullptr);
+
+    // Construct the Wave in place: fill(Wave &) is called exactly once on the
+    // (uninitialized) Wave owned by the new object, before it is linked.
+    template<typename F>
+    static std::shared_ptr<MemoryWave> emplace(
+        F &&fill, MemoryObjectPtr prev = nullptr);
+
     MemoryWave(Lock, const Wave &wave, MemoryObjectPtr prev):
-        MemoryObject(prev), wave_(wave) {}
+        MemoryObject(BT_WAVE, prev), wave_(wave) {}
+    MemoryWave(Lock, MemoryObjectPtr prev): MemoryObject(BT_WAVE, prev) {}
+    MemoryWave(Lock, const int16_t *samples, size_t count, MemoryObjectPtr prev);
     MemoryWave(Lock, const XmlElement &element, MemoryObjectPtr prev);
 
-    BlockType type() override { return BT_WAVE; }
     Wave *wave() override { return &wave_; }
 
     // ** Interim API: subject to change! **
@@ -355,17 +806,235 @@ struct MemoryWave: MemoryObject {
     // If the offset and/or count is longer than the current block and more
     // WaveBlocks are available, these will be concatenated as needed.
     // freq = [0, 1, 2] as per definition in Voice::frequency
-    Result dump_wav(
-        std::string_view filename, SampleRate freq, size_t offset, size_t count);
+    Result dump_wav(std::string_view filename, SampleRate freq,
+        size_t offset, size_t count, const WavOptions &options = {});
 
 protected:
     bool pack(Block *block, size_t index) override;
     void print(XmlPrinter &printer) override;
 
+    friend struct MemoryObject;
+    friend class XmlDumper;
+
 private:
     Wave wave_;
 };
 
+template<typename F>
+std::shared_ptr<MemoryWave> MemoryWave::emplace(F &&fill, MemoryObjectPtr prev) {
+    auto result = std::make_shared<MemoryWave>(Lock{}, prev);
+    fill(result->wave_);
+    MemoryObject::link(prev, result);
+    return result;
+}
+
+
+//------------------------------------------------------------------------------
+// Typed traversal
+
+// Builds a single visitor out of a set of handlers (usually lambdas), e.g.
+//    visit(first, overloaded{
+//        [&](MemoryVoice &v) { ... },
+//        [&](MemoryWave &w) { ... },
+//    });
+template<typename... Fs> struct overloaded: Fs... { using Fs::operator()...; };
+template<typename... Fs> overloaded(Fs...) -> overloaded<Fs...>;
+
+// Calls f(MemoryBank &), f(MemoryEffect &), f(MemoryVoice &) or f(MemoryWave &)
+// for each object in the list starting at first. Objects with no matching
+// handler are skipped. The object type is switched on once per run of objects
+// of the same type, and the handler is then called directly on the concrete
+// (final) class, so handlers and accessors can be inlined.
+// The handler may modify object contents, but not the list structure.
+template<typename F>
+void visit(const MemoryObjectPtr &first, F &&f) {
+    auto run = [&f](auto *typed, MemoryObject *o) {
+        using T = std::remove_pointer_t<decltype(typed)>;
+        const BlockType type = o->type_;
+        do {
+            if constexpr(std::is_invocable_v<F&, T&>) {
+                f(static_cast<T&>(*o));
+            }
+            o = o->next_.get();
+        } while(o && o->type_ == type);
+        return o;
+    };
+    MemoryObject *o = first.get();
+    while(o) {
+        switch(o->type_) {
+            case BT_BANK: o = run(static_cast<MemoryBank*>(nullptr), o); break;
+            case BT_EFFECT: o = run(static_cast<MemoryEffect*>(nullptr), o); break;
+            case BT_VOICE: o = run(static_cast<MemoryVoice*>(nullptr), o); break;
+            case BT_WAVE: o = run(static_cast<MemoryWave*>(nullptr), o); break;
+            default: [[fallthrough]];
+            case BT_NONE: o = o->next_.get(); break;
+        }
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// MemorySnapshot
+
+// An immutable version of a MemoryObject list, which can be shared between any
+// number of threads without locking. Edits never modify a snapshot: they return
+// a new version which shares every unchanged object (and all but one chunk of
+// the object index) with the one it was derived from.
+// Objects are addressed by their position in the list, in the same order as
+// the MemoryObject list they were captured from.
+struct MemorySnapshot {
+    using Payload = std::variant<Bank, Effect, Voice, Wave>; // BlockType order
+
+    static MemorySnapshotPtr capture(const MemoryObjectPtr &first);
+    static MemorySnapshotPtr empty();
+
+    // Build a new (mutable) MemoryObject list from this version, e.g. for
+    // MemoryObject::pack() or XmlDumper
+    MemoryObjectPtr unpack() const;
+
+    size_t count() const { return count_; }
+    bool is_empty() const { return !count_; }
+    BlockType type(size_t n) const;
+
+    // As with MemoryObject, only the accessor matching type(n) returns non-null
+    const Bank *bank(size_t n) const;
+    const Effect *effect(size_t n) const;
+    const Voice *voice(size_t n) const;
+    const Wave *wave(size_t n) const;
+
+    // Edits: each returns a new version (or null if n is out of range)
+    MemorySnapshotPtr replace(size_t n, Payload payload) const;
+    MemorySnapshotPtr insert(size_t n, Payload payload) const;
+    MemorySnapshotPtr erase(size_t n) const;
+
+private:
+    // Restricts construction to the factory functions (see MemoryObject::Lock)
+    struct Lock {};
+
+    using Item = std::shared_ptr<const Payload>;
+    using Chunk = std::vector<Item>;
+    using ChunkPtr = std::shared_ptr<const Chunk>;
+    static constexpr size_t CHUNK_SIZE = 32;
+
+public:
+    MemorySnapshot(Lock, std::vector<ChunkPtr> &&chunks);
+
+private:
+    const Payload *payload(size_t n) const;
+    size_t chunk_of(size_t n) const;
+    template<typename F> MemorySnapshotPtr edit(size_t n, F &&change) const;
+
+    std::vector<ChunkPtr> chunks_;
+    std::vector<size_t> offsets_; // index of the first object in each chunk
+    size_t count_ = 0;
+};
+
+
+//------------------------------------------------------------------------------
+// SnapshotPublisher
+
+// Holds the current version of a shared MemorySnapshot. Readers take their own
+// reference to a consistent version with load() (which they may keep using for
+// as long as they like), and a writer publishes each new version with an atomic
+// pointer swap.
+// The swap uses the std::atomic_load()/atomic_store() overloads for shared_ptr,
+// which are not lock-free: libstdc++ guards them with a small pool of mutexes,
+// picked by address. So load() and publish() may briefly block each other, but
+// only for the length of a reference count update, never for a whole edit.
+struct SnapshotPublisher {
+    SnapshotPublisher(MemorySnapshotPtr initial = MemorySnapshot::empty()):
+        current_(std::move(initial)) {}
+
+    MemorySnapshotPtr load() const;
+    void publish(MemorySnapshotPtr snapshot);
+
+    // Publish desired only if expected is still the current version (i.e. no
+    // other writer got there first), otherwise expected is updated to the
+    // current version so the edit can be retried.
+    bool publish(MemorySnapshotPtr &expected, MemorySnapshotPtr desired);
+
+private:
+    MemorySnapshotPtr current_;
+};
+
+
+//------------------------------------------------------------------------------
+// Memory budget planning
+
+// Wave memory sizes of the FZ-1, in blocks: standard (1MB) and expanded (2MB)
+constexpr size_t WAVE_MEMORY_BLOCKS = 1024;
+constexpr size_t EXPANDED_WAVE_MEMORY_BLOCKS = 2048;
+
+// The wave memory used by a voice in a MemoryObject list: the number of wave
+// blocks spanned by its data, play and loop ranges at its current rate.
+struct VoiceFootprint {
+    size_t voice = 0; // index of the voice in the list (0 = first voice)
+    SampleRate rate = SR_36kHz; // from Voice::frequency
+    size_t samples = 0;
+    size_t blocks = 0;
+};
+
+// Parameters for plan_budget(). Downsampling a voice halves (or quarters) its
+// footprint, and multiplies its score by the corresponding weight.
+struct BudgetOptions {
+    size_t budget = WAVE_MEMORY_BLOCKS;
+    double downsample_weight[3] = { 1.0, 0.5, 0.25 }; // by 0, 1 or 2 steps
+};
+
+// What plan_budget() chose for one voice
+struct BudgetChoice {
+    size_t voice = 0;
+    bool included = false;
+    SampleRate rate = SR_36kHz; // the rate to use, if included
+    size_t blocks = 0; // footprint at that rate (0 if not included)
+    double score = 0;
+};
+
+struct BudgetPlan {
+    std::vector<VoiceFootprint> footprints;
+    std::vector<BudgetChoice> choices; // one per voice, in list order
+    size_t blocks = 0;
+    double score = 0;
+};
+
+// Report the wave footprint of every voice in a list
+Result voice_footprints(
+    const MemoryObjectPtr &first, std::vector<VoiceFootprint> &footprints);
+
+// Choose which voices to include, and which to downsample (as far as 9kHz),
+// to maximise the total score within options.budget blocks. A voice's score is
+// its priority (1 if priorities has no entry for it) times the weight for
+// the number of downsampling steps. Voices which share wave data are counted
+// separately, so the plan errs on the side of using less memory.
+Result plan_budget(const MemoryObjectPtr &first,
+    const std::vector<double> &priorities, const BudgetOptions &options,
+    BudgetPlan &plan);
+
+
+//------------------------------------------------------------------------------
+// Silence trimming
+
+// Parameters for trim_waves()
+struct TrimOptions {
+    int16_t silence = SILENCE_THRESHOLD; // (as analyze_samples())
+    bool normalize = false;
+    float peak = 1.f; // the peak level to normalise to (1 = full scale)
+};
+
+// Trim silent samples (within [-silence, silence]) from the start and end of
+// each voice's data in a MemoryObject list, in place. Play ranges (and empty
+// loops, which only mark a position) are pulled in to match, but no other
+// loop is ever cut short, and a voice which is entirely silent keeps a single
+// sample. Wave data which no voice uses is dropped (as
+// MemoryBlocks::compact() does), the rest is moved down to close the gaps,
+// and every voice's addresses (including loops) are adjusted to suit. Any
+// wave objects left over at the end are removed from the list, and removed
+// receives their number.
+// With options.normalize, each voice's data is also scaled so that its peak
+// reaches options.peak. (Voices which share wave data are scaled together.)
+Result trim_waves(const MemoryObjectPtr &first, const TrimOptions &options = {},
+    size_t *removed = nullptr);
+
 
 //------------------------------------------------------------------------------
 // Loader
@@ -419,6 +1088,30 @@ private:
 };
 
 
+//------------------------------------------------------------------------------
+// WavLoader
+
+// Imports a .wav file (16-bit PCM or 32-bit float) as a new voice: load()
+// creates a MemoryVoice, followed by as many MemoryWave objects as its samples
+// need. Files with more than one channel are mixed down to mono. Files at
+// 36kHz, 18kHz or 9kHz keep their rate, and files at any other rate are
+// resampled to rate (with the quality given). The file is read one wave
+// block at a time, straight into the new MemoryWaves, so only a block's worth
+// of it (plus the resampler's history) is ever held in a buffer.
+// The voice is named after the file, and its sample addresses start at 0.
+struct WavLoader: Loader {
+    WavLoader(std::string_view filename, SampleRate rate = SR_36kHz,
+        DSP::ResampleQuality quality = DSP::RESAMPLE_GOOD);
+
+    Result load(MemoryObjectPtr &objects);
+
+private:
+    std::string filename_;
+    SampleRate rate_;
+    DSP::ResampleQuality quality_;
+};
+
+
 //------------------------------------------------------------------------------
 // Dumper
 
@@ -443,9 +1136,21 @@ struct BlockDumper: Dumper {
 
     Result dump(const MemoryBlocks &blocks, size_t *write_size = nullptr);
 
+    // Rewrite only the dirty blocks of an existing dump in place: the
+    // destination must already hold exactly blocks.count() blocks (usually it
+    // was loaded from, or last dumped from, the same MemoryBlocks). Each run of
+    // consecutive dirty blocks is written with a single pwrite().
+    // write_size reports the number of bytes actually written.
+    // The dirty flags are left set (so that several dumps can be brought up
+    // to date from the same blocks): call blocks.clean() once they all have
+    // been, or each later update() will rewrite these blocks again.
+    Result update(const MemoryBlocks &blocks, size_t *write_size = nullptr);
+
 private:
     Result memory_dump(const MemoryBlocks &blocks, size_t *write_size);
     Result file_dump(const MemoryBlocks &blocks, size_t *write_size);
+    Result memory_update(const MemoryBlocks &blocks, size_t *write_size);
+    Result file_update(const MemoryBlocks &blocks, size_t *write_size);
 };
 
 template<size_t N>BlockDumper::BlockDumper(uint8_t (&storage)[N]):
@@ -477,6 +1182,141 @@ template<size_t N>XmlDumper::XmlDumper(uint8_t (&storage)[N], FzFileType file_ty
     XmlDumper(storage, N, file_type) {}
 
 
+//------------------------------------------------------------------------------
+// BatchExporter
+
+// Exports every voice of a set of binary dumps to .wav files (as per
+// MemoryBlocks::dump_voice_wavs()), using a pool of worker threads. Dumps are
+// loaded in parallel, and then each (dump, voice) pair is a separate job,
+// reading from the one shared copy of its dump. Conversion can run on every
+// thread, but at most max_writers files are written at any time.
+struct BatchExporter {
+    struct Options {
+        size_t threads = 0; // 0 = one per hardware thread
+        size_t max_writers = 4;
+        WavFormat format = WAV_PCM16;
+        uint32_t rate = 0; // (as WavOptions)
+        DSP::ResampleQuality quality = DSP::RESAMPLE_GOOD;
+    };
+
+    BatchExporter() = default;
+    BatchExporter(const Options &options): options_(options) {}
+
+    // Queue a dump to be loaded from a file, or one which is already loaded.
+    // Output files are named from base (see voice_wav_filename()).
+    void add(std::string_view filename, std::string_view base);
+    void add(std::shared_ptr<const MemoryBlocks> blocks, std::string_view base);
+
+    // Run all queued work. Stops at the first failure, and returns its result.
+    // If filenames is supplied, it receives the files written (in dump, then
+    // voice order).
+    Result run(std::vector<std::string> *filenames = nullptr);
+
+    size_t thread_count() const;
+
+private:
+    struct Source {
+        std::string filename;
+        std::string base;
+        std::shared_ptr<const MemoryBlocks> blocks;
+    };
+
+    Options options_;
+    std::vector<Source> sources_;
+};
+
+
+//------------------------------------------------------------------------------
+// MIDI files
+
+// A note from a MIDI file, with its times in seconds
+struct MidiNote {
+    double start = 0;
+    double end = 0; // (when the key is released)
+    uint8_t channel = 0; // 0-15
+    uint8_t note = 0;
+    uint8_t velocity = 0; // 1-127
+};
+
+// Read the notes of a (format 0 or 1) Standard MIDI File, in order of their
+// start times, following its tempo changes. A note on with no matching note
+// off is released at the end of its track.
+Result parse_midi(
+    const uint8_t *data, size_t size, std::vector<MidiNote> &notes);
+Result load_midi_file(std::string_view filename, std::vector<MidiNote> &notes);
+
+
+//------------------------------------------------------------------------------
+// Bank key maps
+
+// The areas of a bank which respond to each (channel, note, velocity) event,
+// compiled from its midi_channel, midi_lo/hi and velocity_lo/hi arrays: a set
+// of areas per channel and note, and another per velocity, so a lookup is
+// just their intersection. Area sets are bitmasks, with bit a for area a
+// (only areas below voice_count are included).
+struct BankKeyMap {
+    BankKeyMap() = default;
+    explicit BankKeyMap(const Bank &bank);
+
+    uint64_t areas(uint8_t channel, uint8_t note, uint8_t velocity) const {
+        return keys_[channel & 0x0f][note & 0x7f] &
+            velocities_[velocity & 0x7f];
+    }
+
+    // The areas which share at least one event with area a (not including a)
+    uint64_t overlaps(size_t a) const;
+
+    // The areas which can respond to some event (e.g. not those with an empty
+    // key or velocity range, or an invalid channel)
+    uint64_t reachable() const;
+
+private:
+    uint64_t keys_[16][128] = {};
+    uint64_t velocities_[128] = {};
+};
+
+
+//------------------------------------------------------------------------------
+// Bank rendering
+
+enum BankOutputs {
+    // a stereo mix, with the individual outputs (1-8) spread from left to
+    // right, and areas not routed to any output in the centre
+    BANK_STEREO,
+    // 9 channels: the (mono) mix, then each of the 8 individual outputs
+    BANK_INDIVIDUAL,
+};
+
+struct BankRenderOptions {
+    uint32_t rate = RENDER_RATE;
+    BankOutputs outputs = BANK_STEREO;
+    double tail = 2.0; // most seconds to render after each note's release
+    size_t threads = 0; // 0 = one per hardware thread
+};
+
+// The number of (interleaved) channels rendered for outputs
+size_t bank_channels(BankOutputs outputs);
+
+// Frames rendered at a time by render_bank()
+constexpr size_t BANK_RENDER_SEGMENT = 16384;
+
+// Play notes through bank n of blocks: each note sounds every area whose
+// channel, key range and velocity range it falls in, using the area's voice
+// (voice_index) at its area_volume, routed by its output_mask. out receives
+// interleaved frames of bank_channels(options.outputs) samples, up to the
+// end of the last note to finish.
+// The voices are rendered a segment (BANK_RENDER_SEGMENT frames) at a time:
+// within a segment, the sounding voices are spread over the worker threads,
+// and then mixed in a fixed order (so the result doesn't depend on the number
+// of threads).
+Result render_bank(const MemoryBlocks &blocks, size_t n,
+    const std::vector<MidiNote> &notes, const BankRenderOptions &options,
+    std::vector<float> &out);
+Result render_bank_wav(const MemoryBlocks &blocks, size_t n,
+    const std::vector<MidiNote> &notes, std::string_view filename,
+    const BankRenderOptions &options = {}, WavFormat format = WAV_PCM16);
+
+
 } //Casio::FZ_1::API
 
 #endif //CASIO_FZ_1_API
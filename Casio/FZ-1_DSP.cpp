@@ -0,0 +1,731 @@
+#include "Casio/FZ-1_DSP.h"
+#include <math.h>
+#include <algorithm>
+
+#if (defined(__GNUC__) || defined(__clang__)) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define FZ_DSP_X86 1
+#include <immintrin.h>
+#else
+#define FZ_DSP_X86 0
+#endif
+
+namespace Casio::FZ_1::DSP {
+
+static constexpr float INT16_SCALE = 1.f / 32768.f;
+
+
+//------------------------------------------------------------------------------
+// Sample conversion kernels
+
+void int16_to_float_scalar(const int16_t *in, float *out, size_t count) {
+    for(size_t i = 0; i < count; i++) {
+        out[i] = in[i] * INT16_SCALE;
+    }
+}
+
+// (count is a multiple of 8 for all the dot product kernels)
+static float dot_scalar(const float *a, const float *b, size_t count) {
+    float sum = 0.f;
+    for(size_t i = 0; i < count; i++) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+static void gain_scalar(int16_t *samples, size_t count, float gain) {
+    for(size_t i = 0; i < count; i++) {
+        float f = std::clamp(samples[i] * gain, -32768.f, 32767.f);
+        samples[i] = static_cast<int16_t>(lrintf(f));
+    }
+}
+
+// Statistics gathered by the sample_stats() kernels, as they go
+struct StatsAccumulator {
+    int16_t min = INT16_MAX, max = INT16_MIN;
+    int64_t sum = 0;
+    uint64_t sum_squares = 0;
+    size_t clipped = 0;
+    size_t first = SIZE_MAX, last = 0; // the first and last non-silent samples
+};
+
+// (samples [i, count) of in)
+static void stats_scalar(const int16_t *in, size_t i, size_t count,
+    int16_t silence, StatsAccumulator &a) {
+    for(; i < count; i++) {
+        const int16_t s = in[i];
+        a.min = std::min(a.min, s);
+        a.max = std::max(a.max, s);
+        a.sum += s;
+        a.sum_squares += static_cast<uint64_t>(int32_t{s} * s);
+        a.clipped += (s == INT16_MIN) || (s == INT16_MAX);
+        if((s > silence) || (s < -silence)) {
+            a.first = std::min(a.first, i);
+            a.last = i;
+        }
+    }
+}
+
+// Narrow down the first and last non-silent samples from the start of the
+// runs of width samples that they were found in
+static void stats_refine(const int16_t *in, size_t width, int16_t silence,
+    StatsAccumulator &a) {
+    if(a.first == SIZE_MAX) {
+        return;
+    }
+    auto loud = [&](size_t i) {
+        return (in[i] > silence) || (in[i] < -silence);
+    };
+    while(!loud(a.first)) {
+        a.first++;
+    }
+    a.last += width - 1;
+    while(!loud(a.last)) {
+        a.last--;
+    }
+}
+
+#if FZ_DSP_X86
+
+// 8 samples per iteration: sign-extend to 32 bits by unpacking into the high
+// halves and shifting back down, then convert and scale
+__attribute__((target("sse2")))
+static void int16_to_float_sse2(const int16_t *in, float *out, size_t count) {
+    const __m128 scale = _mm_set1_ps(INT16_SCALE);
+    size_t i = 0;
+    for(; (i + 8) <= count; i += 8) {
+        __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+        __m128i
+            lo = _mm_srai_epi32(_mm_unpacklo_epi16(s, s), 16),
+            hi = _mm_srai_epi32(_mm_unpackhi_epi16(s, s), 16);
+        _mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(lo), scale));
+        _mm_storeu_ps(out + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), scale));
+    }
+    int16_to_float_scalar(in + i, out + i, count - i);
+}
+
+// 16 samples per iteration
+__attribute__((target("avx2")))
+static void int16_to_float_avx2(const int16_t *in, float *out, size_t count) {
+    const __m256 scale = _mm256_set1_ps(INT16_SCALE);
+    size_t i = 0;
+    for(; (i + 16) <= count; i += 16) {
+        __m128i
+            s0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i)),
+            s1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i + 8));
+        __m256i
+            lo = _mm256_cvtepi16_epi32(s0),
+            hi = _mm256_cvtepi16_epi32(s1);
+        _mm256_storeu_ps(out + i, _mm256_mul_ps(_mm256_cvtepi32_ps(lo), scale));
+        _mm256_storeu_ps(
+            out + i + 8, _mm256_mul_ps(_mm256_cvtepi32_ps(hi), scale));
+    }
+    int16_to_float_sse2(in + i, out + i, count - i);
+}
+
+__attribute__((target("sse2")))
+static float dot_sse2(const float *a, const float *b, size_t count) {
+    __m128 s0 = _mm_setzero_ps(), s1 = _mm_setzero_ps();
+    for(size_t i = 0; i < count; i += 8) {
+        s0 = _mm_add_ps(s0,
+            _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+        s1 = _mm_add_ps(s1,
+            _mm_mul_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4)));
+    }
+    __m128 s = _mm_add_ps(s0, s1);
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+    return _mm_cvtss_f32(s);
+}
+
+__attribute__((target("avx2")))
+static float dot_avx2(const float *a, const float *b, size_t count) {
+    __m256 s = _mm256_setzero_ps();
+    for(size_t i = 0; i < count; i += 8) {
+        s = _mm256_add_ps(s,
+            _mm256_mul_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i)));
+    }
+    __m128 h = _mm_add_ps(
+        _mm256_castps256_ps128(s), _mm256_extractf128_ps(s, 1));
+    h = _mm_add_ps(h, _mm_movehl_ps(h, h));
+    h = _mm_add_ss(h, _mm_shuffle_ps(h, h, 1));
+    return _mm_cvtss_f32(h);
+}
+
+// 8 samples per iteration (clamped before conversion, as out of range values
+// would all convert to INT32_MIN)
+__attribute__((target("sse2")))
+static void gain_sse2(int16_t *samples, size_t count, float gain) {
+    const __m128
+        g = _mm_set1_ps(gain),
+        top = _mm_set1_ps(32767.f),
+        bottom = _mm_set1_ps(-32768.f);
+    size_t i = 0;
+    for(; (i + 8) <= count; i += 8) {
+        __m128i *p = reinterpret_cast<__m128i*>(samples + i);
+        __m128i s = _mm_loadu_si128(p);
+        __m128
+            lo = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(s, s), 16)),
+            hi = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(s, s), 16));
+        lo = _mm_max_ps(_mm_min_ps(_mm_mul_ps(lo, g), top), bottom);
+        hi = _mm_max_ps(_mm_min_ps(_mm_mul_ps(hi, g), top), bottom);
+        _mm_storeu_si128(p,
+            _mm_packs_epi32(_mm_cvtps_epi32(lo), _mm_cvtps_epi32(hi)));
+    }
+    gain_scalar(samples + i, count - i, gain);
+}
+
+// 16 samples per iteration
+__attribute__((target("avx2")))
+static void gain_avx2(int16_t *samples, size_t count, float gain) {
+    const __m256
+        g = _mm256_set1_ps(gain),
+        top = _mm256_set1_ps(32767.f),
+        bottom = _mm256_set1_ps(-32768.f);
+    size_t i = 0;
+    for(; (i + 16) <= count; i += 16) {
+        __m256i *p = reinterpret_cast<__m256i*>(samples + i);
+        __m256i s = _mm256_loadu_si256(p);
+        __m256
+            lo = _mm256_cvtepi32_ps(
+                _mm256_cvtepi16_epi32(_mm256_castsi256_si128(s))),
+            hi = _mm256_cvtepi32_ps(
+                _mm256_cvtepi16_epi32(_mm256_extracti128_si256(s, 1)));
+        lo = _mm256_max_ps(_mm256_min_ps(_mm256_mul_ps(lo, g), top), bottom);
+        hi = _mm256_max_ps(_mm256_min_ps(_mm256_mul_ps(hi, g), top), bottom);
+        // (packing works within 128-bit lanes, so the middle quarters swap)
+        __m256i packed = _mm256_packs_epi32(
+            _mm256_cvtps_epi32(lo), _mm256_cvtps_epi32(hi));
+        _mm256_storeu_si256(p, _mm256_permute4x64_epi64(packed, 0xd8));
+    }
+    gain_sse2(samples + i, count - i, gain);
+}
+
+// Per-lane sums and clip counts are 32 and 16 bits wide, so they are added
+// into the totals every STATS_BATCH iterations, before they can overflow.
+static constexpr size_t STATS_BATCH = 4096;
+
+// 8 samples per iteration
+__attribute__((target("sse2")))
+static void stats_sse2(const int16_t *in, size_t count, int16_t silence,
+    StatsAccumulator &a) {
+    const __m128i
+        zero = _mm_setzero_si128(),
+        ones = _mm_set1_epi16(1),
+        top = _mm_set1_epi16(INT16_MAX),
+        bottom = _mm_set1_epi16(INT16_MIN),
+        above = _mm_set1_epi16(silence),
+        below = _mm_set1_epi16(static_cast<int16_t>(-silence));
+    __m128i lo = top, hi = bottom, squares = zero;
+    const size_t bulk = count & ~size_t{7};
+    size_t i = 0;
+    while(i < bulk) {
+        const size_t end = std::min(bulk, i + (STATS_BATCH * 8));
+        __m128i sums = zero, clips = zero;
+        for(; i < end; i += 8) {
+            __m128i s =
+                _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+            lo = _mm_min_epi16(lo, s);
+            hi = _mm_max_epi16(hi, s);
+            sums = _mm_add_epi32(sums, _mm_madd_epi16(s, ones));
+            // (pairs of squares sum to at most 2^31, so are unsigned)
+            __m128i sq = _mm_madd_epi16(s, s);
+            squares = _mm_add_epi64(squares, _mm_unpacklo_epi32(sq, zero));
+            squares = _mm_add_epi64(squares, _mm_unpackhi_epi32(sq, zero));
+            clips = _mm_sub_epi16(clips, _mm_or_si128(
+                _mm_cmpeq_epi16(s, top), _mm_cmpeq_epi16(s, bottom)));
+            __m128i loud = _mm_or_si128(
+                _mm_cmpgt_epi16(s, above), _mm_cmpgt_epi16(below, s));
+            if(_mm_movemask_epi8(loud)) {
+                a.first = std::min(a.first, i);
+                a.last = i;
+            }
+        }
+        alignas(16) int32_t lanes[8];
+        _mm_store_si128(reinterpret_cast<__m128i*>(lanes), sums);
+        _mm_store_si128(
+            reinterpret_cast<__m128i*>(lanes + 4), _mm_madd_epi16(clips, ones));
+        for(size_t j = 0; j < 4; j++) {
+            a.sum += lanes[j];
+            a.clipped += lanes[j + 4];
+        }
+    }
+    alignas(16) int16_t mins[8], maxs[8];
+    alignas(16) uint64_t totals[2];
+    _mm_store_si128(reinterpret_cast<__m128i*>(mins), lo);
+    _mm_store_si128(reinterpret_cast<__m128i*>(maxs), hi);
+    _mm_store_si128(reinterpret_cast<__m128i*>(totals), squares);
+    for(size_t j = 0; j < 8; j++) {
+        a.min = std::min(a.min, mins[j]);
+        a.max = std::max(a.max, maxs[j]);
+    }
+    a.sum_squares += totals[0] + totals[1];
+    stats_refine(in, 8, silence, a);
+    stats_scalar(in, bulk, count, silence, a);
+}
+
+// 16 samples per iteration
+__attribute__((target("avx2")))
+static void stats_avx2(const int16_t *in, size_t count, int16_t silence,
+    StatsAccumulator &a) {
+    const __m256i
+        zero = _mm256_setzero_si256(),
+        ones = _mm256_set1_epi16(1),
+        top = _mm256_set1_epi16(INT16_MAX),
+        bottom = _mm256_set1_epi16(INT16_MIN),
+        above = _mm256_set1_epi16(silence),
+        below = _mm256_set1_epi16(static_cast<int16_t>(-silence));
+    __m256i lo = top, hi = bottom, squares = zero;
+    const size_t bulk = count & ~size_t{15};
+    size_t i = 0;
+    while(i < bulk) {
+        const size_t end = std::min(bulk, i + (STATS_BATCH * 16));
+        __m256i sums = zero, clips = zero;
+        for(; i < end; i += 16) {
+            __m256i s = _mm256_loadu_si256(
+                reinterpret_cast<const __m256i*>(in + i));
+            lo = _mm256_min_epi16(lo, s);
+            hi = _mm256_max_epi16(hi, s);
+            sums = _mm256_add_epi32(sums, _mm256_madd_epi16(s, ones));
+            __m256i sq = _mm256_madd_epi16(s, s);
+            squares = _mm256_add_epi64(squares,
+                _mm256_cvtepu32_epi64(_mm256_castsi256_si128(sq)));
+            squares = _mm256_add_epi64(squares,
+                _mm256_cvtepu32_epi64(_mm256_extracti128_si256(sq, 1)));
+            clips = _mm256_sub_epi16(clips, _mm256_or_si256(
+                _mm256_cmpeq_epi16(s, top), _mm256_cmpeq_epi16(s, bottom)));
+            __m256i loud = _mm256_or_si256(
+                _mm256_cmpgt_epi16(s, above), _mm256_cmpgt_epi16(below, s));
+            if(!_mm256_testz_si256(loud, loud)) {
+                a.first = std::min(a.first, i);
+                a.last = i;
+            }
+        }
+        alignas(32) int32_t lanes[16];
+        _mm256_store_si256(reinterpret_cast<__m256i*>(lanes), sums);
+        _mm256_store_si256(reinterpret_cast<__m256i*>(lanes + 8),
+            _mm256_madd_epi16(clips, ones));
+        for(size_t j = 0; j < 8; j++) {
+            a.sum += lanes[j];
+            a.clipped += lanes[j + 8];
+        }
+    }
+    alignas(32) int16_t mins[16], maxs[16];
+    alignas(32) uint64_t totals[4];
+    _mm256_store_si256(reinterpret_cast<__m256i*>(mins), lo);
+    _mm256_store_si256(reinterpret_cast<__m256i*>(maxs), hi);
+    _mm256_store_si256(reinterpret_cast<__m256i*>(totals), squares);
+    for(size_t j = 0; j < 16; j++) {
+        a.min = std::min(a.min, mins[j]);
+        a.max = std::max(a.max, maxs[j]);
+    }
+    a.sum_squares += totals[0] + totals[1] + totals[2] + totals[3];
+    stats_refine(in, 16, silence, a);
+    stats_scalar(in, bulk, count, silence, a);
+}
+
+#endif //FZ_DSP_X86
+
+
+//------------------------------------------------------------------------------
+// Dispatch
+
+using ConvertFn = void (*)(const int16_t*, float*, size_t);
+using DotFn = float (*)(const float*, const float*, size_t);
+using StatsFn = void (*)(const int16_t*, size_t, int16_t, StatsAccumulator&);
+using GainFn = void (*)(int16_t*, size_t, float);
+
+// (the scalar statistics kernel, in the form of the others)
+static void stats_all_scalar(const int16_t *in, size_t count, int16_t silence,
+    StatsAccumulator &a) {
+    stats_scalar(in, 0, count, silence, a);
+}
+
+struct Kernel {
+    ConvertFn fn;
+    DotFn dot;
+    StatsFn stats;
+    GainFn gain;
+    const char *name;
+};
+
+static Kernel select_kernel() {
+#if FZ_DSP_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")) {
+        return { int16_to_float_avx2, dot_avx2, stats_avx2, gain_avx2, "avx2" };
+    }
+    if(__builtin_cpu_supports("sse2")) {
+        return { int16_to_float_sse2, dot_sse2, stats_sse2, gain_sse2, "sse2" };
+    }
+#endif
+    return { int16_to_float_scalar, dot_scalar, stats_all_scalar, gain_scalar,
+        "scalar" };
+}
+
+// (a function-local static, so initialisation is thread-safe)
+static const Kernel &kernel() {
+    static const Kernel k = select_kernel();
+    return k;
+}
+
+void int16_to_float(const int16_t *in, float *out, size_t count) {
+    kernel().fn(in, out, count);
+}
+
+const char *int16_to_float_kernel() {
+    return kernel().name;
+}
+
+float dot(const float *a, const float *b, size_t count) {
+    const size_t bulk = count & ~size_t{7};
+    return kernel().dot(a, b, bulk) +
+        dot_scalar(a + bulk, b + bulk, count - bulk);
+}
+
+void apply_gain(int16_t *samples, size_t count, float gain) {
+    kernel().gain(samples, count, gain);
+}
+
+static void stats_finish(const StatsAccumulator &a, size_t count,
+    SampleStats &stats) {
+    stats = {};
+    stats.count = count;
+    if(count) {
+        stats.min = a.min;
+        stats.max = a.max;
+    }
+    stats.sum = a.sum;
+    stats.sum_squares = a.sum_squares;
+    stats.clipped = a.clipped;
+    if(a.first == SIZE_MAX) {
+        stats.leading_silence = stats.trailing_silence = count;
+    } else {
+        stats.leading_silence = a.first;
+        stats.trailing_silence = count - 1 - a.last;
+    }
+}
+
+void sample_stats(
+    const int16_t *in, size_t count, int16_t silence, SampleStats &stats) {
+    StatsAccumulator a;
+    kernel().stats(in, count, std::max<int16_t>(silence, 0), a);
+    stats_finish(a, count, stats);
+}
+
+void sample_stats_scalar(
+    const int16_t *in, size_t count, int16_t silence, SampleStats &stats) {
+    StatsAccumulator a;
+    stats_scalar(in, 0, count, std::max<int16_t>(silence, 0), a);
+    stats_finish(a, count, stats);
+}
+
+void float_to_int16(const float *in, int16_t *out, size_t count) {
+    for(size_t i = 0; i < count; i++) {
+        float f = in[i] * 32768.f;
+        if(!(f > -32768.f)) { // (NaN included)
+            f = isnan(f) ? 0.f : -32768.f;
+        } else if(f > 32767.f) {
+            f = 32767.f;
+        }
+        out[i] = static_cast<int16_t>(lrintf(f));
+    }
+}
+
+
+
+//------------------------------------------------------------------------------
+// Resampler
+
+namespace {
+
+struct QualityPreset {
+    size_t taps; // per phase, when not downsampling
+    double rolloff; // passband edge, as a fraction of the lower Nyquist rate
+    double beta; // Kaiser window parameter
+};
+
+const QualityPreset QUALITY_PRESETS[] = {
+    { 8, 0.80, 5.0 }, // RESAMPLE_FAST
+    { 16, 0.90, 7.0 }, // RESAMPLE_GOOD
+    { 32, 0.95, 9.0 }, // RESAMPLE_BEST
+};
+
+// zeroth order modified Bessel function of the first kind (for the window)
+double bessel_i0(double x) {
+    double sum = 1.0, term = 1.0;
+    for(int k = 1; k < 32; k++) {
+        term *= (x / (2 * k)) * (x / (2 * k));
+        sum += term;
+    }
+    return sum;
+}
+
+uint32_t gcd(uint32_t a, uint32_t b) {
+    while(b) {
+        uint32_t t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+} // (anonymous)
+
+Resampler::Resampler(uint32_t in_rate, uint32_t out_rate,
+    ResampleQuality quality) {
+
+    if(!in_rate || !out_rate) {
+        return;
+    }
+    const uint32_t g = gcd(in_rate, out_rate);
+    up_ = out_rate / g;
+    down_ = in_rate / g;
+
+    if(up_ == down_) {
+        // the same rate in and out: just copy (via a single unit tap)
+        taps_ = 8;
+        coefficients_.assign(taps_, 0.f);
+        coefficients_[taps_ - 1 - taps_ / 2] = 1.f;
+        reset();
+        return;
+    }
+    const QualityPreset &preset = QUALITY_PRESETS[
+        (quality <= RESAMPLE_BEST) ? quality : RESAMPLE_GOOD];
+    // when downsampling, the filter has to span proportionally more input
+    const double ratio = std::max(1.0, double(down_) / up_);
+    taps_ = static_cast<size_t>(ceil(preset.taps * ratio / 8)) * 8;
+
+    // a windowed sinc prototype at the upsampled rate (up_ * in_rate), split
+    // into up_ phases of taps_ coefficients each, stored in reverse so that
+    // each output is a dot product with taps_ consecutive inputs
+    const size_t length = up_ * taps_;
+    const double
+        centre = length / 2.0,
+        cutoff = preset.rolloff * std::min(1.0, double(up_) / down_) / up_,
+        norm = bessel_i0(preset.beta);
+    coefficients_.resize(length);
+    for(size_t p = 0; p < up_; p++) {
+        for(size_t j = 0; j < taps_; j++) {
+            const double
+                m = static_cast<double>(p + j * up_) - centre,
+                x = PI * cutoff * m,
+                sinc = (m == 0) ? 1.0 : sin(x) / x,
+                r = m / centre,
+                window = bessel_i0(
+                    preset.beta * sqrt(std::max(0.0, 1.0 - r * r))) / norm;
+            coefficients_[p * taps_ + (taps_ - 1 - j)] =
+                static_cast<float>(cutoff * up_ * sinc * window);
+        }
+    }
+    reset();
+}
+
+void Resampler::reset() {
+    // the inputs before the first are zero
+    history_.assign(taps_, 0.f);
+    base_ = -static_cast<int64_t>(taps_);
+    consumed_ = produced_ = 0;
+}
+
+size_t Resampler::output_length(size_t count) const {
+    return up_ ? (uint64_t(count) * up_ + down_ - 1) / down_ : 0;
+}
+
+void Resampler::process(const float *in, size_t count, std::vector<float> &out) {
+    if(!up_) {
+        return;
+    }
+    history_.insert(history_.end(), in, in + count);
+    consumed_ += count;
+    run(out, output_length(consumed_));
+}
+
+void Resampler::flush(std::vector<float> &out) {
+    if(!up_) {
+        return;
+    }
+    // enough zeros to complete every output covered by the input so far
+    history_.insert(history_.end(), taps_ / 2 + 1, 0.f);
+    run(out, output_length(consumed_));
+    reset();
+}
+
+void Resampler::run(std::vector<float> &out, uint64_t limit) {
+    const DotFn dot = kernel().dot;
+    const int64_t end = base_ + static_cast<int64_t>(history_.size());
+    const int64_t half = static_cast<int64_t>(taps_ / 2);
+    for(; produced_ < limit; produced_++) {
+        // output k is centred on input k * down_ / up_
+        const uint64_t q = produced_ * down_;
+        const int64_t newest = static_cast<int64_t>(q / up_) + half;
+        if(newest >= end) {
+            break;
+        }
+        const size_t phase = q % up_;
+        const float *x =
+            &history_[newest - static_cast<int64_t>(taps_) + 1 - base_];
+        out.push_back(dot(&coefficients_[phase * taps_], x, taps_));
+    }
+    // drop the inputs which no further output needs
+    const int64_t oldest = static_cast<int64_t>((produced_ * down_) / up_) +
+        half - static_cast<int64_t>(taps_) + 1;
+    if(oldest > base_) {
+        const size_t drop = std::min<size_t>(oldest - base_, history_.size());
+        history_.erase(history_.begin(), history_.begin() + drop);
+        base_ += drop;
+    }
+}
+
+const char *resample_kernel() {
+    return kernel().name;
+}
+
+//------------------------------------------------------------------------------
+// Envelope
+
+void Envelope::start(const float *steps, const float *targets,
+    size_t sustain, size_t end) {
+
+    std::copy(steps, steps + SECTIONS, steps_);
+    std::copy(targets, targets + SECTIONS, targets_);
+    sustain_ = std::min(sustain, SECTIONS - 1);
+    end_ = std::min(end, SECTIONS - 1);
+    section_ = 0;
+    level_ = 0;
+    released_ = finished_ = false;
+}
+
+void Envelope::release() {
+    released_ = true;
+    if(!finished_ && (section_ <= sustain_)) {
+        // (straight on to the section after the sustain, if there is one)
+        if(sustain_ < end_) {
+            section_ = sustain_ + 1;
+        } else {
+            finished_ = true;
+        }
+    }
+}
+
+bool Envelope::holding() const {
+    return finished_ || (steps_[section_] <= 0) ||
+        ((section_ == sustain_) && !released_ &&
+            (level_ == targets_[section_]));
+}
+
+float Envelope::advance(size_t count) {
+    while(count && !finished_) {
+        const float t = targets_[section_], s = steps_[section_];
+        if(level_ != t) {
+            if(s <= 0) {
+                break;
+            }
+            // (snapping to the target when all but there, so a level built
+            // up by repeated steps doesn't take an extra sample to arrive)
+            auto needed = static_cast<size_t>(
+                std::max(ceilf((fabsf(t - level_) / s) - 1e-4f), 0.f));
+            if(needed > count) {
+                level_ += (t > level_) ? (s * count) : -(s * count);
+                break;
+            }
+            level_ = t;
+            count -= needed;
+        }
+        if((section_ == sustain_) && !released_) {
+            break;
+        }
+        if(section_ >= end_) {
+            finished_ = true;
+            break;
+        }
+        section_++;
+    }
+    return level_;
+}
+
+size_t Envelope::render(float *out, size_t count, size_t interval) {
+    size_t running = finished_ ? 0 : count;
+    for(size_t i = 0; i < count;) {
+        if(holding()) {
+            std::fill(out + i, out + count, level_);
+            break;
+        }
+        // the levels before the interval in which this section reaches its
+        // target lie on a line
+        const float
+            t = targets_[section_],
+            d = ((t > level_) ? steps_[section_] : -steps_[section_]) *
+                interval,
+            base = level_;
+        const size_t run = static_cast<size_t>(std::clamp(
+            ceilf((t - base) / d) - 1, 0.f, static_cast<float>(count - i)));
+        for(size_t j = 0; j < run; j++) {
+            out[i + j] = base + (d * (j + 1));
+        }
+        i += run;
+        if(run) {
+            level_ = out[i - 1];
+        }
+        // and the interval which reaches it may move on through sections
+        if(i < count) {
+            out[i] = advance(interval);
+            if(finished_ && (running == count)) {
+                running = i;
+            }
+            i++;
+        }
+    }
+    return running;
+}
+
+
+//------------------------------------------------------------------------------
+// LowPassFilter
+
+void LowPassFilter::reset() {
+    state_[0] = state_[1] = 0;
+    started_ = false;
+}
+
+void LowPassFilter::process(
+    float *x, size_t count, float cutoff, float q, uint32_t rate) {
+
+    if(!count) {
+        return;
+    }
+    const float
+        g = tanf(static_cast<float>(PI) *
+            std::min(cutoff / rate, .49f)),
+        k = 1 / std::max(q, .5f),
+        a1 = 1 / (1 + (g * (g + k))),
+        target[3] = { a1, g * a1, g * g * a1 };
+    if(!started_) {
+        std::copy(target, target + 3, a_);
+        started_ = true;
+    }
+    // (the coefficients' ramps are off the recurrence's critical path)
+    const float
+        d1 = (target[0] - a_[0]) / count,
+        d2 = (target[1] - a_[1]) / count,
+        d3 = (target[2] - a_[2]) / count;
+    float c1 = a_[0], c2 = a_[1], c3 = a_[2];
+    float s1 = state_[0], s2 = state_[1];
+    for(size_t i = 0; i < count; i++) {
+        c1 += d1;
+        c2 += d2;
+        c3 += d3;
+        const float
+            v3 = x[i] - s2,
+            v1 = (c1 * s1) + (c2 * v3),
+            v2 = s2 + (c2 * s1) + (c3 * v3);
+        s1 = (2 * v1) - s1;
+        s2 = (2 * v2) - s2;
+        x[i] = v2;
+    }
+    std::copy(target, target + 3, a_);
+    state_[0] = s1;
+    state_[1] = s2;
+}
+
+} // Casio::FZ_1::DSP
@@ -0,0 +1,185 @@
+#ifndef CASIO_FZ_1_DSP
+#define CASIO_FZ_1_DSP
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+namespace Casio::FZ_1::DSP {
+
+// (M_PI isn't standard C++, and MSVC only defines it on request)
+constexpr double PI = 3.14159265358979323846;
+
+//------------------------------------------------------------------------------
+// Sample conversion
+
+// Convert count 16-bit samples to floats in [-1, 1) (i.e. divided by 32768).
+// The fastest kernel available on the running CPU is chosen on first use
+// (AVX2 or SSE2 on x86, otherwise a plain loop).
+void int16_to_float(const int16_t *in, float *out, size_t count);
+
+// The plain loop, for reference (and benchmarking)
+void int16_to_float_scalar(const int16_t *in, float *out, size_t count);
+
+// The name of the kernel that int16_to_float() uses ("avx2", "sse2" or
+// "scalar")
+const char *int16_to_float_kernel();
+
+// Convert count floats back to 16-bit samples (multiplied by 32768, rounded to
+// nearest and clamped to [-32768, 32767]): the inverse of int16_to_float().
+void float_to_int16(const float *in, int16_t *out, size_t count);
+
+
+//------------------------------------------------------------------------------
+// Vector arithmetic
+
+// The dot product of two runs of count floats (using the same kernels as
+// int16_to_float(), for all but the last count % 8 of them)
+float dot(const float *a, const float *b, size_t count);
+
+// Multiply count 16-bit samples by gain, in place (rounded to nearest and
+// clamped, as float_to_int16())
+void apply_gain(int16_t *samples, size_t count, float gain);
+
+
+//------------------------------------------------------------------------------
+// Sample statistics
+
+struct SampleStats {
+    size_t count = 0;
+    int16_t min = 0, max = 0; // (both 0 if there are no samples)
+    int64_t sum = 0;
+    uint64_t sum_squares = 0;
+    size_t clipped = 0; // samples at full scale (-32768 or 32767)
+    size_t leading_silence = 0; // samples before the first non-silent one
+    size_t trailing_silence = 0; // samples after the last non-silent one
+};
+
+// Gather the statistics of count 16-bit samples in a single pass, where
+// samples in [-silence, silence] are silent. (All silence is counted as
+// leading and trailing.) Uses the same choice of kernels as
+// int16_to_float().
+void sample_stats(
+    const int16_t *in, size_t count, int16_t silence, SampleStats &stats);
+
+// The plain loop, for reference (and benchmarking)
+void sample_stats_scalar(
+    const int16_t *in, size_t count, int16_t silence, SampleStats &stats);
+
+
+//------------------------------------------------------------------------------
+// Resampling
+
+enum ResampleQuality: uint8_t {
+    RESAMPLE_FAST, // 8 taps per phase, for previews
+    RESAMPLE_GOOD, // 16 taps per phase (the default)
+    RESAMPLE_BEST, // 32 taps per phase
+};
+
+// A polyphase resampler for a fixed pair of rates (e.g. 44100Hz -> 36000Hz),
+// converting by the exact rational ratio between them. Input can be fed in
+// chunks of any size: each output is produced as soon as the input it needs
+// has arrived, and flush() completes the output at the end. When
+// downsampling, the filter is lengthened in proportion to the ratio, so the
+// cutoff stays below the output's Nyquist rate. The filter's dot products
+// use the same kernels as int16_to_float().
+struct Resampler {
+    Resampler(uint32_t in_rate, uint32_t out_rate,
+        ResampleQuality quality = RESAMPLE_GOOD);
+
+    // The total number of outputs for count inputs, once flushed
+    size_t output_length(size_t count) const;
+
+    // Append the outputs which count more inputs make available to out
+    void process(const float *in, size_t count, std::vector<float> &out);
+
+    // Append the remaining outputs to out, and reset() for a new stream
+    void flush(std::vector<float> &out);
+
+    void reset();
+
+    size_t taps() const { return taps_; }
+    size_t phases() const { return up_; }
+
+private:
+    void run(std::vector<float> &out, uint64_t limit);
+
+    uint32_t up_ = 0, down_ = 0;
+    size_t taps_ = 0;
+    std::vector<float> coefficients_; // up_ phases of taps_ (reversed)
+    std::vector<float> history_; // inputs from base_ onwards
+    int64_t base_ = 0;
+    uint64_t consumed_ = 0, produced_ = 0;
+};
+
+// The name of the kernel that Resampler uses (as int16_to_float_kernel())
+const char *resample_kernel();
+
+//------------------------------------------------------------------------------
+// Envelopes
+
+// A rate/level envelope of up to 8 sections (as the FZ-1's DCA and DCF
+// envelopes), with levels in [0, 1]. Each section moves the level towards its
+// target by a fixed step per sample. The level holds at the end of the
+// sustain section until release(), and the envelope finishes at the end of
+// the end section.
+struct Envelope {
+    static constexpr size_t SECTIONS = 8;
+
+    // steps are each section's level change per sample (a section with a
+    // step of 0 never reaches its target)
+    void start(const float *steps, const float *targets,
+        size_t sustain, size_t end);
+
+    // Move on from the sustain section (or finish, if it's the end section)
+    void release();
+
+    // Advance count samples, and return the level reached
+    float advance(size_t count);
+
+    // Fill out with the levels after each of the next count intervals of
+    // interval samples: a whole run of control blocks at once (or a level per
+    // sample, with an interval of 1). Returns the number of levels before the
+    // one at which the envelope finished (count, if it didn't).
+    size_t render(float *out, size_t count, size_t interval = 1);
+
+    float level() const { return level_; }
+    bool finished() const { return finished_; }
+
+private:
+    // whether the level stays put (finished, or held at the sustain level)
+    bool holding() const;
+
+    float steps_[SECTIONS] = {};
+    float targets_[SECTIONS] = {};
+    size_t sustain_ = 0, end_ = 0, section_ = 0;
+    float level_ = 0;
+    bool released_ = false, finished_ = false;
+};
+
+
+//------------------------------------------------------------------------------
+// Filtering
+
+// A resonant low pass filter (a state variable filter, in its topology
+// preserving transform form) run a block at a time. Each block gives the
+// cutoff and Q to reach by its end, and the coefficients move linearly from
+// the previous block's across it, so a control signal that only changes once
+// per block doesn't step. (The first block after reset() starts at its own
+// coefficients.)
+struct LowPassFilter {
+    void reset();
+
+    // Filter count samples in place, at rate Hz: cutoff is in Hz (and is held
+    // below rate / 2), and q is at least 0.5 (0.7071 has no resonant peak)
+    void process(float *x, size_t count, float cutoff, float q, uint32_t rate);
+
+private:
+    float a_[3] = {}; // the previous block's coefficients
+    float state_[2] = {};
+    bool started_ = false;
+};
+
+} // Casio::FZ_1::DSP
+
+#endif //CASIO_FZ_1_DSP
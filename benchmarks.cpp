@@ -0,0 +1,661 @@
+#include "Casio/FZ-1.h"
+#include "Casio/FZ-1_API.h"
+#include "Casio/FZ-1_DSP.h"
+#include <math.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace Casio::FZ_1;
+
+
+//------------------------------------------------------------------------------
+// Interim microbenchmark infrastructure:
+//  - use the B_() macro to define benchmarks, and the RUN() macro to run them.
+//  - benchmarks are defined inside the Benchmarks::Benchmarks() constructor
+//  - inside individual benchmarks, use the TIME() macro to time a statement
+//    over a number of repetitions, and report the average time per item (or
+//    RATE() to report items per second instead).
+//  - SINK() keeps a computed value alive so it can't be optimized away.
+
+struct Benchmarks {
+    using Clock = std::chrono::steady_clock;
+
+    constexpr static size_t BENCHMARK_COUNT = 32;
+    std::function<void()> benchmarks_[BENCHMARK_COUNT];
+    size_t count_ = 0;
+    volatile uint64_t sink_ = 0;
+
+#define B_(name_, ...) \
+    benchmarks_[count_++] = [this] { \
+        printf("Benchmark %s:\n", #name_); \
+        do { __VA_ARGS__ } while(false); \
+        putchar('\n'); \
+    }
+
+// Run X_ (reps_) times and report the mean time per repetition and per item
+// (where each repetition processes items_ items)
+#define TIME(label_, reps_, items_, ...) { \
+        auto start_ = Clock::now(); \
+        for(size_t rep_ = 0; rep_ < (reps_); rep_++) { __VA_ARGS__; } \
+        std::chrono::duration<double> d_ = Clock::now() - start_; \
+        double per_rep_ = d_.count() / (reps_); \
+        printf("  %-32s %10.3f ms %10.2f ns/item\n", label_, \
+            per_rep_ * 1e3, per_rep_ * 1e9 / (items_)); \
+    }
+
+// As TIME(), but report items (of the given unit) per second
+#define RATE(label_, reps_, items_, unit_, ...) { \
+        auto start_ = Clock::now(); \
+        for(size_t rep_ = 0; rep_ < (reps_); rep_++) { __VA_ARGS__; } \
+        std::chrono::duration<double> d_ = Clock::now() - start_; \
+        double per_rep_ = d_.count() / (reps_); \
+        printf("  %-32s %10.3f ms %10.0f %s/s\n", label_, \
+            per_rep_ * 1e3, (items_) / per_rep_, unit_); \
+    }
+
+#define SINK(X_) sink_ = sink_ + static_cast<uint64_t>(X_)
+
+#define RUN() \
+    Benchmarks b_; \
+    for(size_t i = 0; i < b_.count_; i++) { \
+        b_.benchmarks_[i](); \
+    }
+
+    Benchmarks() {
+//------------------------------------------------------------------------------
+// Actual benchmarks
+
+B_(list_traversal, {
+    // lists with long same-type runs, as produced by unpack() or XmlLoader: a
+    // small one which stays cache resident, and a large one which doesn't
+    for(size_t scale: { 1, 64 }) {
+        const size_t
+            banks = scale,
+            voices = 16 * scale,
+            waves = 1024 * scale,
+            count = banks + voices + waves,
+            reps = 12800 / scale;
+        API::MemoryObjectPtr first, current;
+        for(size_t i = 0; i < banks; i++) {
+            current = API::MemoryBank::create(Bank{}, current);
+            if(!first) { first = current; }
+        }
+        for(size_t i = 0; i < voices; i++) {
+            current = API::MemoryVoice::create(Voice{}, current);
+        }
+        for(size_t i = 0; i < waves; i++) {
+            current = API::MemoryWave::emplace([i](Wave &w) {
+                w.samples[0] = static_cast<int16_t>(i);
+            }, current);
+        }
+        printf("  %zu objects:\n", count);
+
+        TIME("virtual calls", reps, count, {
+            uint64_t sum = 0;
+            // (raw pointers, as visit() uses, so only the dispatch differs)
+            for(API::MemoryObject *o = first.get(); o; o = o->next().get()) {
+                if(auto *b = o->bank()) {
+                    sum += b->voice_count;
+                } else if(auto *v = o->voice()) {
+                    sum += v->data_end;
+                } else if(auto *w = o->wave()) {
+                    sum += w->samples[0];
+                }
+            }
+            SINK(sum);
+        });
+
+        TIME("visit()", reps, count, {
+            uint64_t sum = 0;
+            API::visit(first, API::overloaded{
+                [&](API::MemoryBank &b) { sum += b.bank()->voice_count; },
+                [&](API::MemoryVoice &v) { sum += v.voice()->data_end; },
+                [&](API::MemoryWave &w) { sum += w.wave()->samples[0]; },
+            });
+            SINK(sum);
+        });
+    }
+});
+
+B_(wave_access, {
+    // summing one sample from each wave block of a large dump
+    const size_t waves = 4096, reps = 2000;
+    // (the file header lives in block 0, so that must not be a wave block)
+    API::MemoryObjectPtr first = API::MemoryVoice::create(Voice{}, nullptr);
+    API::MemoryObjectPtr current = first;
+    for(size_t i = 0; i < waves; i++) {
+        current = API::MemoryWave::emplace([i](Wave &w) {
+            w.samples[0] = static_cast<int16_t>(i);
+        }, current);
+    }
+    API::MemoryBlocks mb;
+    if(!API::result_success(API::MemoryObject::pack(first, mb, TYPE_VOICE))) {
+        printf("  pack failed!\n");
+        break;
+    }
+
+    TIME("wave(n)", reps, waves, {
+        uint64_t sum = 0;
+        for(size_t n = 0; n < waves; n++) {
+            sum += mb.wave(n)->samples[0];
+        }
+        SINK(sum);
+    });
+
+    TIME("waves()", reps, waves, {
+        uint64_t sum = 0;
+        for(const Wave &w: mb.waves()) {
+            sum += w.samples[0];
+        }
+        SINK(sum);
+    });
+});
+
+B_(budget_planner, {
+    // a full bank's worth of voices, of 10-100 blocks each, into 1MB and 2MB
+    const size_t voices = 64, reps = 100;
+    API::MemoryObjectPtr first, current;
+    int32_t address = 0;
+    for(size_t i = 0; i < voices; i++) {
+        int32_t samples = static_cast<int32_t>(10 + ((i * 37) % 91)) * 512;
+        current = API::MemoryVoice::emplace([&](Voice &v) {
+            v.data_start = v.play_start = address;
+            v.data_end = v.play_end = address + samples - 1;
+            v.frequency = static_cast<uint8_t>(i % 3);
+        }, current);
+        if(!first) { first = current; }
+        address += samples;
+    }
+    std::vector<double> priorities;
+    for(size_t i = 0; i < voices; i++) {
+        priorities.push_back(1.0 + (i % 7));
+    }
+    for(size_t budget: {
+        API::WAVE_MEMORY_BLOCKS, API::EXPANDED_WAVE_MEMORY_BLOCKS }) {
+        API::BudgetOptions options;
+        options.budget = budget;
+        char label[32];
+        snprintf(label, sizeof(label), "plan_budget(%zu blocks)", budget);
+        TIME(label, reps, voices, {
+            API::BudgetPlan plan;
+            API::plan_budget(first, priorities, options, plan);
+            SINK(plan.blocks);
+        });
+    }
+});
+
+B_(block_hashes, {
+    // hashing a full 2MB expanded memory dump
+    const size_t waves = 2047, reps = 200;
+    API::MemoryObjectPtr first = API::MemoryVoice::create(Voice{}, nullptr);
+    API::MemoryObjectPtr current = first;
+    for(size_t i = 0; i < waves; i++) {
+        current = API::MemoryWave::emplace([i](Wave &w) {
+            for(size_t j = 0; j < std::size(w.samples); j++) {
+                w.samples[j] = static_cast<int16_t>(i * j);
+            }
+        }, current);
+    }
+    API::MemoryBlocks mb;
+    if(!API::result_success(API::MemoryObject::pack(first, mb, TYPE_VOICE))) {
+        printf("  pack failed!\n");
+        break;
+    }
+    TIME("rehash() (per block)", reps, mb.count(), {
+        mb.rehash();
+        SINK(mb.block_hash(1));
+    });
+    TIME("digest() (per block)", reps, mb.count(), {
+        SINK(mb.digest());
+    });
+});
+
+B_(trim_waves, {
+    // 64 voices filling the FZ-1's 1MB of wave memory, each with a quarter
+    // of silence at either end, trimmed and normalised
+    const size_t
+        voices = 64,
+        blocks = API::WAVE_MEMORY_BLOCKS / voices,
+        reps = 4;
+    const size_t length = blocks * 512;
+    std::vector<API::MemoryObjectPtr> lists;
+    for(size_t rep = 0; rep < reps; rep++) {
+        API::MemoryObjectPtr first, current;
+        for(size_t i = 0; i < voices; i++) {
+            current = API::MemoryVoice::emplace([&](Voice &v) {
+                v.data_start = v.play_start = static_cast<int32_t>(i * length);
+                v.data_end = v.play_end = v.data_start + length - 1;
+                v.loop_end_point = 0;
+                v.loop_start[0] = v.loop_end[0] = v.play_end;
+            }, current);
+            if(!first) { first = current; }
+        }
+        for(size_t b = 0; b < voices * blocks; b++) {
+            current = API::MemoryWave::emplace([&](Wave &w) {
+                size_t position = b % blocks;
+                bool loud =
+                    (position >= blocks / 4) && (position < blocks * 3 / 4);
+                for(size_t j = 0; j < std::size(w.samples); j++) {
+                    w.samples[j] =
+                        loud ? static_cast<int16_t>((j * 7919) % 8192) : 0;
+                }
+            }, current);
+        }
+        lists.push_back(first);
+    }
+    API::TrimOptions options;
+    options.normalize = true;
+    TIME("trim_waves() (per sample)", reps, voices * length, {
+        size_t removed = 0;
+        API::trim_waves(lists[rep_], options, &removed);
+        SINK(removed);
+    });
+    size_t remaining = 0;
+    API::visit(lists[0], [&](API::MemoryWave &) { remaining++; });
+    printf("  %zu of %zu blocks remain\n", remaining, voices * blocks);
+});
+
+B_(int16_to_float, {
+    // one block, and a full 2MB dump's worth of samples
+    for(size_t count: { 512, 1024 * 1024 }) {
+        const size_t reps = (1 << 26) / count;
+        std::vector<int16_t> in(count);
+        std::vector<float> out(count);
+        for(size_t i = 0; i < count; i++) {
+            in[i] = static_cast<int16_t>(i * 7919);
+        }
+        printf("  %zu samples:\n", count);
+        TIME("scalar", reps, count, {
+            DSP::int16_to_float_scalar(in.data(), out.data(), count);
+            SINK(out[rep_ % count]);
+        });
+        char label[32];
+        snprintf(label, sizeof(label), "dispatched (%s)",
+            DSP::int16_to_float_kernel());
+        TIME(label, reps, count, {
+            DSP::int16_to_float(in.data(), out.data(), count);
+            SINK(out[rep_ % count]);
+        });
+    }
+});
+
+B_(sample_stats, {
+    // a full 2MB dump's worth of samples
+    const size_t count = 1024 * 1024, reps = 64;
+    std::vector<int16_t> in(count);
+    for(size_t i = 0; i < count; i++) {
+        in[i] = static_cast<int16_t>(i * 7919);
+    }
+    DSP::SampleStats stats;
+    TIME("scalar", reps, count, {
+        DSP::sample_stats_scalar(in.data(), count, 16, stats);
+        SINK(stats.sum_squares);
+    });
+    char label[32];
+    snprintf(label, sizeof(label), "dispatched (%s)",
+        DSP::int16_to_float_kernel());
+    TIME(label, reps, count, {
+        DSP::sample_stats(in.data(), count, 16, stats);
+        SINK(stats.sum_squares);
+    });
+});
+
+B_(resampler, {
+    // a full 2MB dump's worth of samples, in 16384-sample chunks
+    const size_t count = 1024 * 1024, chunk = 16384, reps = 4;
+    std::vector<float> in(count), out;
+    for(size_t i = 0; i < count; i++) {
+        in[i] = static_cast<float>(static_cast<int16_t>(i * 7919)) / 32768.f;
+    }
+    printf("  kernel: %s\n", DSP::resample_kernel());
+    const uint32_t rates[][2] = {
+        { 36000, 44100 }, { 36000, 48000 }, { 44100, 36000 }, { 48000, 9000 },
+    };
+    static const char *const QUALITY[] = { "fast", "good", "best" };
+    for(auto &r: rates) {
+        for(auto quality: {
+            DSP::RESAMPLE_FAST, DSP::RESAMPLE_GOOD, DSP::RESAMPLE_BEST }) {
+            DSP::Resampler rs(r[0], r[1], quality);
+            out.reserve(rs.output_length(count));
+            char label[40];
+            snprintf(label, sizeof(label), "%u -> %u (%s)",
+                r[0], r[1], QUALITY[quality]);
+            TIME(label, reps, count, {
+                out.clear();
+                for(size_t i = 0; i < count; i += chunk) {
+                    rs.process(&in[i], chunk, out);
+                }
+                rs.flush(out);
+                SINK(out.size());
+            });
+        }
+    }
+});
+
+B_(loop_search, {
+    // searching a voice filling the FZ-1's 1MB of wave memory, of a slowly
+    // decaying pair of detuned tones
+    const size_t count = API::WAVE_MEMORY_BLOCKS * 512, reps = 5;
+    std::vector<int16_t> samples(count);
+    for(size_t i = 0; i < count; i++) {
+        double t = static_cast<double>(i) / 36000;
+        samples[i] = static_cast<int16_t>(lrint(exp(-t / 20) * 8192 *
+            (sin(t * 2 * DSP::PI * 220) + sin(t * 2 * DSP::PI * 330.5))));
+    }
+    printf("  kernel: %s\n", DSP::resample_kernel());
+    for(size_t candidates: { 1, 8 }) {
+        API::LoopSearchOptions options;
+        options.candidates = candidates;
+        char label[32];
+        snprintf(label, sizeof(label), "find_loops(%zu candidate(s))",
+            candidates);
+        TIME(label, reps, count, {
+            std::vector<API::LoopCandidate> loops;
+            API::find_loops({ samples.data(), count }, 0, count - 1,
+                options, loops);
+            SINK(loops.size());
+        });
+    }
+});
+
+B_(voice_render, {
+    // a held note of a looped voice (with its filter and LFO in use), for 10
+    // seconds of output: at 36kHz, 27.8us per sample is realtime
+    const size_t count = 16 * 512, frames = 10 * API::RENDER_RATE, reps = 5;
+    std::vector<int16_t> samples(count);
+    for(size_t i = 0; i < count; i++) {
+        double t = static_cast<double>(i) / 36000;
+        samples[i] = static_cast<int16_t>(lrint(8192 *
+            (sin(t * 2 * DSP::PI * 220) + sin(t * 2 * DSP::PI * 330.5))));
+    }
+    Voice v;
+    v.data_end = v.play_end = count - 1;
+    v.loop_start[0] = 1000;
+    v.loop_end[0] = count - 1000;
+    v.loop_xfade_time[0] = 256;
+    v.loop_time[0] = 1023;
+    v.filter = 40;
+    v.filter_q = 64;
+    v.dca_end = v.dcf_end = 1;
+    v.dca_rate[0] = v.dcf_rate[0] = 100;
+    v.dca_rate[1] = v.dcf_rate[1] = 90;
+    v.dca_end_level[0] = v.dcf_end_level[0] = 255;
+    v.lfo_rate = 64;
+    v.lfo_pitch = v.lfo_filter = 32;
+    v.midi_origin = 60;
+    std::vector<float> out(frames);
+    TIME("VoiceRenderer::render()", reps, frames, {
+        API::VoiceRenderer renderer(v, { samples.data(), count });
+        renderer.note_on(67, 100);
+        SINK(renderer.render(out.data(), frames));
+    });
+});
+
+B_(voice_kernels, {
+    // the per-voice DSP for one second notes at 36kHz (1125 blocks of 32
+    // samples): envelopes a block at a time (or a level per sample), the
+    // filter with its cutoff moving every block, and the whole renderer
+    const size_t rate = API::RENDER_RATE, block = API::VoiceRenderer::BLOCK,
+        blocks = rate / block, voices = 256;
+    const float
+        steps[8] = { 1e-3f, 2e-5f, 1e-5f, 1e-5f, 1e-5f, 1e-5f, 1e-5f, 1e-5f },
+        targets[8] = { 1, .5f, .4f, .3f, .2f, .1f, .05f, 0 };
+    std::vector<float> levels(rate), x(rate);
+    for(size_t i = 0; i < rate; i++) {
+        x[i] = static_cast<float>(sin(i * 2 * DSP::PI * 220 / rate));
+    }
+    RATE("Envelope::advance() per block", 1, voices, "voices", {
+        for(size_t v = 0; v < voices; v++) {
+            DSP::Envelope e;
+            e.start(steps, targets, 7, 7);
+            for(size_t b = 0; b < blocks; b++) {
+                levels[b] = e.advance(block);
+            }
+            SINK(levels[blocks - 1] > 0);
+        }
+    });
+    RATE("Envelope::render() per block", 1, voices, "voices", {
+        for(size_t v = 0; v < voices; v++) {
+            DSP::Envelope e;
+            e.start(steps, targets, 7, 7);
+            SINK(e.render(levels.data(), blocks, block));
+        }
+    });
+    RATE("Envelope::render() per sample", 1, voices, "voices", {
+        for(size_t v = 0; v < voices; v++) {
+            DSP::Envelope e;
+            e.start(steps, targets, 7, 7);
+            SINK(e.render(levels.data(), rate));
+        }
+    });
+    RATE("LowPassFilter::process()", 1, voices, "voices", {
+        for(size_t v = 0; v < voices; v++) {
+            DSP::LowPassFilter f;
+            std::vector<float> y = x;
+            for(size_t b = 0; b < blocks; b++) {
+                f.process(&y[b * block], block, 200.f + (b * 8), 2, rate);
+            }
+            SINK(y[rate - 1] > 0);
+        }
+    });
+
+    Voice v;
+    std::vector<int16_t> samples(16 * 512);
+    for(size_t i = 0; i < samples.size(); i++) {
+        samples[i] = static_cast<int16_t>(lrint(16384 * x[i]));
+    }
+    v.data_end = v.play_end = static_cast<int32_t>(samples.size() - 1);
+    v.loop_start[0] = 1000;
+    v.loop_end[0] = v.play_end - 1000;
+    v.loop_xfade_time[0] = 256;
+    v.loop_time[0] = 1023;
+    v.filter = 40;
+    v.filter_q = 64;
+    v.dca_end = v.dcf_end = 1;
+    v.dca_rate[0] = v.dcf_rate[0] = 100;
+    v.dca_rate[1] = v.dcf_rate[1] = 90;
+    v.dca_end_level[0] = v.dcf_end_level[0] = 255;
+    v.lfo_rate = 64;
+    v.lfo_filter = 32;
+    v.midi_origin = 60;
+    RATE("VoiceRenderer::render()", 1, voices / 4, "voices", {
+        for(size_t n = 0; n < voices / 4; n++) {
+            API::VoiceRenderer renderer(
+                v, { samples.data(), samples.size() });
+            renderer.note_on(static_cast<uint8_t>(48 + (n % 24)), 100);
+            std::fill(levels.begin(), levels.end(), 0.f);
+            SINK(renderer.render(levels.data(), rate));
+        }
+    });
+});
+
+B_(bank_key_map, {
+    // resolving a million events against a full bank of 64 areas: a scan of
+    // the Bank arrays, and a BankKeyMap lookup (including building it)
+    const size_t count = 1 << 20, reps = 5;
+    Bank b;
+    b.voice_count = Bank::MAXV;
+    for(size_t a = 0; a < Bank::MAXV; a++) {
+        b.midi_channel[a] = static_cast<uint8_t>(a % 4);
+        b.midi_lo[a] = static_cast<uint8_t>((a / 4) * 8);
+        b.midi_hi[a] = static_cast<uint8_t>((a / 4) * 8 + 11);
+        b.velocity_lo[a] = (a & 1) ? 64 : 1;
+        b.velocity_hi[a] = (a & 1) ? 127 : 80;
+    }
+    std::vector<uint32_t> events(count);
+    uint32_t seed = 1;
+    for(auto &e: events) {
+        seed = (seed * 1664525u) + 1013904223u;
+        e = seed >> 8;
+    }
+    TIME("scan", reps, count, {
+        for(uint32_t e: events) {
+            const uint8_t c = e & 3, n = (e >> 2) & 0x7f, v = (e >> 9) & 0x7f;
+            uint64_t areas = 0;
+            for(size_t a = 0; a < b.voice_count; a++) {
+                if((b.midi_channel[a] == c) &&
+                    (b.midi_lo[a] <= n) && (n <= b.midi_hi[a]) &&
+                    (b.velocity_lo[a] <= v) && (v <= b.velocity_hi[a])) {
+                    areas |= uint64_t(1) << a;
+                }
+            }
+            SINK(areas);
+        }
+    });
+    TIME("BankKeyMap::areas()", reps, count, {
+        const API::BankKeyMap map(b);
+        for(uint32_t e: events) {
+            SINK(map.areas(e & 3, (e >> 2) & 0x7f, (e >> 9) & 0x7f));
+        }
+    });
+});
+
+B_(bank_render, {
+    // 30 seconds of 8 part chords (a new one every half second, each held
+    // for two seconds) through a bank of 8 areas, each with its own looped
+    // voice of 16 blocks: at 36kHz, 27.8us per frame is realtime
+    const size_t blocks = 16, areas = 8, reps = 2;
+    API::MemoryObjectPtr first = API::MemoryBank::emplace([](Bank &b) {
+        b.voice_count = areas;
+        for(size_t a = 0; a < areas; a++) {
+            b.midi_hi[a] = 127;
+            b.velocity_lo[a] = 1;
+            b.velocity_hi[a] = 127;
+            b.midi_channel[a] = static_cast<uint8_t>(a);
+            b.output_mask[a] = static_cast<uint8_t>(1 << a);
+            b.area_volume[a] = 127;
+            b.voice_index[a] = static_cast<uint16_t>(a);
+        }
+    }, nullptr);
+    API::MemoryObjectPtr current = first;
+    for(size_t i = 0; i < areas; i++) {
+        const int32_t address = static_cast<int32_t>(i * blocks * 512);
+        current = API::MemoryVoice::emplace([&](Voice &v) {
+            v.data_start = v.play_start = address;
+            v.data_end = v.play_end = address + blocks * 512 - 1;
+            v.loop_start[0] = address + 1000;
+            v.loop_end[0] = v.play_end - 1000;
+            v.loop_xfade_time[0] = 256;
+            v.loop_time[0] = 1023;
+            v.filter = 40;
+            v.dca_end = v.dcf_end = 1;
+            v.dca_rate[0] = v.dcf_rate[0] = 100;
+            v.dca_rate[1] = v.dcf_rate[1] = 90;
+            v.dca_end_level[0] = v.dcf_end_level[0] = 255;
+            v.lfo_rate = 64;
+            v.lfo_pitch = 16;
+            v.midi_origin = 60;
+        }, current);
+    }
+    for(size_t i = 0; i < areas * blocks; i++) {
+        current = API::MemoryWave::emplace([i](Wave &w) {
+            for(size_t j = 0; j < std::size(w.samples); j++) {
+                double t = static_cast<double>((i % blocks) * 512 + j) / 36000;
+                double phase = t * 2 * DSP::PI;
+                w.samples[j] = static_cast<int16_t>(lrint(
+                    8192 * (sin(phase * 220) + sin(phase * 330.5))));
+            }
+        }, current);
+    }
+    API::MemoryBlocks mb;
+    if(!API::result_success(API::MemoryObject::pack(first, mb, TYPE_FULL))) {
+        printf("  pack failed!\n");
+        return;
+    }
+    std::vector<API::MidiNote> notes;
+    for(size_t i = 0; i < 60; i++) {
+        for(uint8_t c = 0; c < areas; c++) {
+            notes.push_back({ i * .5, (i * .5) + 2, c,
+                static_cast<uint8_t>(48 + ((i * 7 + c * 5) % 24)), 100 });
+        }
+    }
+    const size_t frames = 32 * API::RENDER_RATE;
+    // (threads beyond the hardware's only show the cost of the handoffs)
+    printf("  %zu notes, %zu hardware thread(s):\n", notes.size(),
+        API::BatchExporter().thread_count());
+    for(size_t threads: { 1, 2, 4 }) {
+        for(auto outputs: { API::BANK_STEREO, API::BANK_INDIVIDUAL }) {
+            API::BankRenderOptions options;
+            options.outputs = outputs;
+            options.threads = threads;
+            char label[32];
+            snprintf(label, sizeof(label), "%s, %zu thread(s)",
+                outputs == API::BANK_STEREO ? "stereo" : "individual", threads);
+            TIME(label, reps, frames, {
+                std::vector<float> out;
+                API::render_bank(mb, 0, notes, options, out);
+                SINK(out.size());
+            });
+        }
+    }
+});
+
+B_(batch_export, {
+    // exporting 64 voices of 8 blocks each, and 512 short voices of 1 block
+    // each (8 dumps of 64), on one thread and on all of them
+    for(size_t blocks: { 8, 1 }) {
+        const size_t voices = 64, dumps = 8 / blocks, reps = 5;
+        printf("  %zu voices of %zu block(s):\n", voices * dumps, blocks);
+        API::MemoryObjectPtr first, current;
+        for(size_t i = 0; i < voices; i++) {
+            int32_t address = static_cast<int32_t>(i * blocks * 512);
+            current = API::MemoryVoice::emplace([&](Voice &v) {
+                v.data_start = v.play_start = address;
+                v.data_end = v.play_end = address + blocks * 512 - 1;
+            }, current);
+            if(!first) { first = current; }
+        }
+        for(size_t i = 0; i < voices * blocks; i++) {
+            current = API::MemoryWave::emplace([i](Wave &w) {
+                for(size_t j = 0; j < std::size(w.samples); j++) {
+                    w.samples[j] = static_cast<int16_t>(i * j);
+                }
+            }, current);
+        }
+        auto mb = std::make_shared<API::MemoryBlocks>();
+        if(!API::result_success(
+            API::MemoryObject::pack(first, *mb, TYPE_VOICE))) {
+            printf("  pack failed!\n");
+            break;
+        }
+        API::BatchExporter::Options options;
+        for(size_t threads: {
+            size_t(1), API::BatchExporter(options).thread_count() }) {
+            for(auto format: { API::WAV_PCM16, API::WAV_FLOAT32 }) {
+                options.threads = threads;
+                options.format = format;
+                API::BatchExporter exporter(options);
+                for(size_t d = 0; d < dumps; d++) {
+                    exporter.add(mb, "tmp_bench" + std::to_string(d));
+                }
+                std::vector<std::string> filenames;
+                char label[32];
+                snprintf(label, sizeof(label), "%s, %zu thread(s)",
+                    format == API::WAV_PCM16 ? "pcm16" : "float32", threads);
+                TIME(label, reps, voices * dumps, {
+                    SINK(exporter.run(&filenames));
+                });
+                for(auto &filename: filenames) {
+                    remove(filename.c_str());
+                }
+            }
+        }
+    }
+});
+
+//------------------------------------------------------------------------------
+    }// end of Benchmarks::Benchmarks()
+};
+
+
+int main(int, char **) {
+    RUN();
+    return EXIT_SUCCESS;
+}
@@ -1,11 +1,14 @@
 #include "Casio/FZ-1.h"
 #include "Casio/FZ-1_API.h"
 #include <assert.h>
+#include <math.h>
 #include <stdarg.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <initializer_list>
+#include <memory>
 #include <string>
+#include <vector>
 
 using namespace Casio::FZ_1;
 
@@ -110,13 +113,37 @@ struct Args {
 [[noreturn]] void usage() {
     printf("Usage:\n\n"
         "  fzutility <input> [<output>]\n"
-        "    Convert binary files to FZ-ML (or vice versa).\n"
+        "    Convert binary files to FZ-ML (or vice versa), or .wav files to\n"
+        "    binary voice files.\n"
+        "  fzutility -c <input> [<output>]\n"
+        "    Remove wave data not used by any voice from a binary file.\n"
         "  fzutility -i <input>\n"
         "    List objects/blocks contained in input file.\n"
+        "  fzutility -iv <input>\n"
+        "    As -i, along with the levels of each voice's wav data.\n"
+        "  fzutility -l <input> [<output>]\n"
+        "    Find loop points for each voice in a binary file.\n"
+        "  fzutility -m <input> <input> <output>\n"
+        "    Merge two binary files into one (full file by default).\n"
+        "  fzutility -p <input> [<blocks>]\n"
+        "    Plan which voices will fit into wave memory (default 1024 blocks).\n"
+        "  fzutility -r <input> [<note>[/<velocity>]] [<output>]\n"
+        "    Render a note (default 60/100) played by each voice to a .wav file.\n"
+        "  fzutility -rb[i] <input> <midi> [<output>]\n"
+        "    Play a MIDI file through the first bank of a binary or FZ-ML file\n"
+        "    to a stereo .wav file (or one channel per output, with -rbi).\n"
+        "  fzutility -t[n] <input> [<output>]\n"
+        "    Trim silence from each voice's wave data in a binary file (and\n"
+        "    normalise its level, with -tn).\n"
         "  fzutility -v\n"
         "    Display version number.\n"
         "  fzutility -w <input> [<range>] [<output>]\n"
-        "    Extract wav data from binary or FZ-ML files.\n");
+        "    Extract wav data from binary or FZ-ML files (as 16-bit PCM).\n"
+        "  fzutility -wf <input> [<range>] [<output>]\n"
+        "    Extract wav data from binary or FZ-ML files (as 32-bit float).\n"
+        "  fzutility -wv[f] <input> [<output>] [<rate>]\n"
+        "    Extract each voice's wav data to its own file (optionally\n"
+        "    resampled to rate Hz, e.g. 44100).\n");
     exit(EXIT_SUCCESS);
 }
 
@@ -276,6 +303,30 @@ int normal_operation(const Args &args) {
         result = dumper.dump(obj);
         check_result(result);
 
+        printf("Success!\n");
+        return EXIT_SUCCESS;
+
+    } else if(file_extension_matches(ext, { ".wav" })) {
+        printf("Converting wave file to binary voice:\n");
+
+        if(output.empty()) {
+            output = input;
+            file_extension_replace_or_append(output, ".fzv");
+            printf("No filename supplied for output file (using %s).\n",
+                output.c_str());
+        }
+
+        API::MemoryBlocks blocks;
+        API::MemoryObjectPtr obj;
+        API::WavLoader loader(input);
+        API::BlockDumper dumper(output);
+        API::Result result = loader.load(obj);
+        check_result(result);
+        result = API::MemoryObject::pack(obj, blocks, TYPE_VOICE);
+        check_result(result);
+        result = dumper.dump(blocks);
+        check_result(result);
+
         printf("Success!\n");
         return EXIT_SUCCESS;
     }
@@ -304,13 +355,41 @@ API::MemoryObjectPtr load_memory_object_list(const std::string &filename) {
         result = blocks.unpack(obj);
         check_result(result);
         first = obj;
+
+    } else if(file_extension_matches(ext, { ".wav" })) {
+        API::WavLoader loader(filename);
+        API::MemoryObjectPtr obj;
+        auto result = loader.load(obj);
+        check_result(result);
+        first = obj;
     } else {
         fail("Unknown file extension (filename: %s)\n", filename.c_str());
     }
     return first;
 }
 
-int display_info(const Args &args) {
+// Print the levels of each voice's wave data
+void display_levels(API::MemoryObjectPtr first) {
+    API::MemoryBlocks blocks;
+    auto result = API::MemoryObject::pack(first, blocks);
+    check_result(result);
+    auto analyses = blocks.analyze_voices();
+    if(analyses.empty()) {
+        return;
+    }
+    auto db = [](float level) { return 20 * log10f(level); };
+    printf("\nVoice Levels:\n"
+        "  #  Name          Samples  Peak dB   RMS dB  DC Offset  Clipped"
+        "  Leading Trailing\n");
+    for(size_t n = 0; n < analyses.size(); n++) {
+        auto &a = analyses[n];
+        printf("%3zu  %-12.12s %8zu %8.2f %8.2f %+10.5f %8zu %8zu %8zu\n",
+            n + 1, blocks.voice(n)->name, a.count, db(a.peak), db(a.rms),
+            a.dc_offset, a.clipped, a.leading_silence, a.trailing_silence);
+    }
+}
+
+int display_info(const Args &args, bool levels) {
     if(!args.second.empty()) {
         fail("Too many arguments given.\n");
     }
@@ -329,34 +408,39 @@ int display_info(const Args &args) {
     }
     if(API::MemoryObjectPtr first = load_memory_object_list(input)) {
         printf("Object Information:\n");
-        API::MemoryObjectPtr obj = first;
-        while(obj) {
-            count++;
-            if(auto *bank = obj->bank()) {
+        API::visit(first, API::overloaded{
+            [&](API::MemoryBank &b) {
+                count++;
                 bank_count++;
                 block_count++;
                 printf("%3u: \"%s\" (Bank %u)\n",
-                    block_count, bank->name, bank_count);
-            } else if(obj->effect()) {
+                    block_count, b.bank()->name, bank_count);
+            },
+            [&](API::MemoryEffect &) {
+                count++;
                 effect_count++;
                 block_count++;
                 printf("%3u: (Effect %u)\n", block_count, effect_count);
-            } else if(auto *voice = obj->voice()) {
+            },
+            [&](API::MemoryVoice &v) {
+                count++;
                 voice_count++;
                 if((voice_count % 4) == 1) {
                     block_count++;
                     voice_block_count++;
                     printf("%3u: \"%s\" (Voice %u)\n",
-                        block_count, voice->name, voice_count);
+                        block_count, v.voice()->name, voice_count);
                 } else {
-                    printf("     \"%s\" (Voice %u)\n", voice->name, voice_count);
+                    printf("     \"%s\" (Voice %u)\n",
+                        v.voice()->name, voice_count);
                 }
-            } else if(obj->wave()) {
+            },
+            [&](API::MemoryWave &) {
+                count++;
                 wave_count++;
                 block_count++;
-            }
-            obj = obj->next();
-        }
+            },
+        });
         if(wave_count > 0) {
             printf("(+%u Wave blocks)\n", wave_count);
         }
@@ -370,6 +454,9 @@ int display_info(const Args &args) {
             "%5u Object(s) total\n",
             effect_count, bank_count, voice_block_count, voice_count,
             wave_count, block_count, count);
+        if(levels && voice_count) {
+            display_levels(first);
+        }
     }
     return EXIT_SUCCESS;
 }
@@ -379,7 +466,29 @@ int display_version(const Args&) {
     return EXIT_SUCCESS;
 }
 
-int extract_wave(const Args &args) {
+// Resolve a parsed range against the total number of samples available,
+// returning the number of samples to extract
+size_t resolve_wave_range(size_t start, int32_t end, size_t total) {
+    if(end <= 0) {
+        end = total + end;
+        if(end < 0) {
+            fail("Endpoint would be %d "
+                "samples before start of wave!\n", -end);
+        }
+    }
+    size_t positive_end = end;
+    if(start > positive_end) {
+        fail("Start (%u) is after end (%u)!\n", start, positive_end);
+    }
+    if(start && (start == positive_end)) {
+        fail("Start (%u) is equal to end, "
+            "which would produce empty output.\n", start);
+    }
+    printf("Wave data from %u-%u...\n", start, positive_end);
+    return positive_end - start;
+}
+
+int extract_wave(const Args &args, API::WavFormat format) {
     printf("Extracting Wave data...\n");
     std::string
         input = args.first,
@@ -393,6 +502,32 @@ int extract_wave(const Args &args) {
     if(!parse_range(range, start, end)) {
         fail("Couldn't parse range (%s).\n", range.c_str());
     }
+    if(output.empty()) {
+        output = input;
+        file_extension_replace_or_append(output, ".wav");
+    }
+
+    // binary dumps hold their wave data contiguously, so it can be written
+    // straight from the loaded blocks
+    auto ext = file_extension_find(input);
+    if(file_extension_matches(ext, { ".fzb", ".fze", ".fzf", ".fzv" })) {
+        printf("Loading %s...\n", input.c_str());
+        API::MemoryBlocks blocks;
+        API::BlockLoader loader(input);
+        auto result = loader.load(blocks);
+        check_result(result);
+        size_t total = blocks.samples().size();
+        if(!total) {
+            fail("No wave data!\n");
+        }
+        size_t count = resolve_wave_range(start, end, total);
+        printf("Dumping wave data to %s\n", output.c_str());
+        result = blocks.dump_wav(output, API::SR_36kHz, start, count, format);
+        check_result(result);
+
+        printf("Success!\n");
+        return EXIT_SUCCESS;
+    }
 
     if(API::MemoryObjectPtr first = load_memory_object_list(input)) {
         API::MemoryObjectPtr obj = first;
@@ -402,41 +537,17 @@ int extract_wave(const Args &args) {
         if(!obj) {
             fail("No wave data!\n");
         }
-        if(end <= 0) {
-            size_t wave_count = 0;
-            API::MemoryObjectPtr wave = obj;
-            while(wave) {
-                if(wave->wave()) {
-                    wave_count++;
-                }
-                wave = wave->next();
-            }
-            end = (wave_count * 512) + end;
-            if(end < 0) {
-                fail("Endpoint would be %d "
-                    "samples before start of wave!\n", -end);
+        size_t wave_count = 0;
+        for(auto wave = obj; wave; wave = wave->next()) {
+            if(wave->wave()) {
+                wave_count++;
             }
         }
-        size_t positive_end = end;
-        if(start > positive_end) {
-            fail("Start (%u) is after end (%u)!\n", start, positive_end);
-        }
-        if(start && (start == positive_end)) {
-            fail("Start (%u) is equal to end, "
-                "which would produce empty output.\n", start);
-        }
-
-        printf("Wave data from %u-%u...\n", start, positive_end);
-        size_t
-            offset = start,
-            count = end - start;
-        if(output.empty()) {
-            output = input;
-            file_extension_replace_or_append(output, ".wav");
-        }
+        size_t count = resolve_wave_range(start, end, wave_count * 512);
         printf("Dumping wave data to %s\n", output.c_str());
         if(auto* wave = static_cast<API::MemoryWave*>(obj.get())) {
-            auto result = wave->dump_wav(output, API::SR_36kHz, offset, count);
+            auto result = wave->dump_wav(
+                output, API::SR_36kHz, start, count, format);
             check_result(result);
 
             printf("Success!\n");
@@ -446,15 +557,398 @@ int extract_wave(const Args &args) {
     return EXIT_FAILURE;
 }
 
+int compact_file(const Args &args) {
+    if(!args.third.empty()) {
+        fail("Too many arguments given.\n");
+    }
+    std::string
+        input = args.first,
+        output = args.second.empty() ? args.first : args.second;
+    if(input.empty()) {
+        fail("No input filename specified\n");
+    }
+    auto ext = file_extension_find(input);
+    if(!file_extension_matches(ext, { ".fzb", ".fze", ".fzf", ".fzv" })) {
+        fail("Only binary files can be compacted (filename: %s)\n",
+            input.c_str());
+    }
+
+    printf("Loading %s...\n", input.c_str());
+    API::MemoryBlocks blocks;
+    auto result = API::BlockLoader(input).load(blocks);
+    check_result(result);
+    size_t removed = 0;
+    result = blocks.compact(&removed);
+    check_result(result);
+    printf("Removed %zu unused wave block(s)\n", removed);
+
+    printf("Writing %zu blocks to %s\n", blocks.count(), output.c_str());
+    result = API::BlockDumper(output).dump(blocks);
+    check_result(result);
+
+    printf("Success!\n");
+    return EXIT_SUCCESS;
+}
+
+int loop_file(const Args &args) {
+    if(!args.third.empty()) {
+        fail("Too many arguments given.\n");
+    }
+    std::string
+        input = args.first,
+        output = args.second.empty() ? args.first : args.second;
+    if(input.empty()) {
+        fail("No input filename specified\n");
+    }
+    auto ext = file_extension_find(input);
+    if(!file_extension_matches(ext, { ".fzb", ".fze", ".fzf", ".fzv" })) {
+        fail("Only binary files can have loops found (filename: %s)\n",
+            input.c_str());
+    }
+
+    printf("Loading %s...\n", input.c_str());
+    API::MemoryBlocks blocks;
+    auto result = API::BlockLoader(input).load(blocks);
+    check_result(result);
+    API::LoopSearchOptions options;
+    options.candidates = 8;
+    for(size_t n = 0; n < blocks.voices().size(); n++) {
+        std::vector<API::LoopCandidate> loops;
+        result = blocks.find_voice_loops(n, options, &loops);
+        check_result(result);
+        printf("Voice %zu: %zu loop(s)\n", n + 1, loops.size());
+        for(auto &l: loops) {
+            printf("  %d-%d (score %.3f, cross fade %d)\n",
+                l.start, l.end, l.score, l.xfade_time);
+        }
+    }
+
+    printf("Writing %zu blocks to %s\n", blocks.count(), output.c_str());
+    result = API::BlockDumper(output).dump(blocks);
+    check_result(result);
+
+    printf("Success!\n");
+    return EXIT_SUCCESS;
+}
+
+int merge_files(const Args &args) {
+    std::string
+        first = args.first,
+        second = args.second,
+        output = args.third;
+    if(first.empty() || second.empty()) {
+        fail("Two input filenames are required\n");
+    }
+    if(output.empty()) {
+        fail("No output filename specified\n");
+    }
+    for(auto &filename: { first, second }) {
+        auto ext = file_extension_find(filename);
+        if(!file_extension_matches(ext, { ".fzb", ".fze", ".fzf", ".fzv" })) {
+            fail("Only binary files can be merged (filename: %s)\n",
+                filename.c_str());
+        }
+    }
+    FzFileType file_type = extension_to_file_type(file_extension_find(output));
+    if(file_type == TYPE_UNKNOWN) {
+        file_type = TYPE_FULL;
+    }
+
+    printf("Merging %s and %s...\n", first.c_str(), second.c_str());
+    API::MemoryBlocks first_blocks, second_blocks, blocks;
+    auto result = API::BlockLoader(first).load(first_blocks);
+    check_result(result);
+    result = API::BlockLoader(second).load(second_blocks);
+    check_result(result);
+    result = API::MemoryBlocks::merge(
+        { &first_blocks, &second_blocks }, blocks, file_type);
+    check_result(result);
+
+    printf("Writing %zu blocks to %s\n", blocks.count(), output.c_str());
+    result = API::BlockDumper(output).dump(blocks);
+    check_result(result);
+
+    printf("Success!\n");
+    return EXIT_SUCCESS;
+}
+
+int plan_memory(const Args &args) {
+    if(!args.third.empty()) {
+        fail("Too many arguments given.\n");
+    }
+    std::string input = args.first;
+    if(input.empty()) {
+        fail("No input filename specified\n");
+    }
+    API::BudgetOptions options;
+    if(!args.second.empty()) {
+        const std::string &blocks = args.second;
+        if(blocks.find_first_not_of("0123456789") != std::string::npos) {
+            fail("Couldn't parse block count (%s).\n", blocks.c_str());
+        }
+        options.budget = atoi(blocks.c_str());
+    }
+    static const char *const RATES[] = { "36kHz", "18kHz", "9kHz" };
+
+    if(API::MemoryObjectPtr first = load_memory_object_list(input)) {
+        API::BudgetPlan plan;
+        auto result = API::plan_budget(first, {}, options, plan);
+        check_result(result);
+
+        std::vector<const Voice*> voices;
+        API::visit(first, [&](API::MemoryVoice &v) {
+            voices.push_back(v.voice());
+        });
+        size_t total = 0;
+        printf("Voice footprints, and plan for %zu blocks:\n", options.budget);
+        for(auto &f: plan.footprints) {
+            auto &c = plan.choices[f.voice];
+            printf("  %3zu: \"%s\" %5zu block(s) at %-5s -> ",
+                f.voice + 1, voices[f.voice]->name, f.blocks, RATES[f.rate]);
+            if(c.included) {
+                printf("%5zu block(s) at %s\n", c.blocks, RATES[c.rate]);
+            } else {
+                printf("(left out)\n");
+            }
+            total += f.blocks;
+        }
+        printf("\nSummary:\n"
+            "  %6zu Block(s) currently used by voices\n"
+            "  %6zu Block(s) planned\n", total, plan.blocks);
+        return EXIT_SUCCESS;
+    }
+    return EXIT_FAILURE;
+}
+
+int extract_voices(const Args &args, API::WavFormat format) {
+    printf("Extracting Voice wave data...\n");
+    std::string
+        input = args.first,
+        base = args.second;
+    if(input.empty()) {
+        fail("No input filename specified\n");
+    }
+    uint32_t rate = 0;
+    if(!args.third.empty()) {
+        const std::string &r = args.third;
+        if(r.find_first_not_of("0123456789") != std::string::npos) {
+            fail("Couldn't parse sample rate (%s).\n", r.c_str());
+        }
+        rate = static_cast<uint32_t>(atoi(r.c_str()));
+    }
+    if(base.empty()) {
+        base = input;
+        file_extension_replace_or_append(base, "");
+    }
+
+    auto blocks = std::make_shared<API::MemoryBlocks>();
+    auto ext = file_extension_find(input);
+    if(file_extension_matches(ext, { ".fzb", ".fze", ".fzf", ".fzv" })) {
+        printf("Loading %s...\n", input.c_str());
+        auto result = API::BlockLoader(input).load(*blocks);
+        check_result(result);
+    } else if(API::MemoryObjectPtr first = load_memory_object_list(input)) {
+        auto result = API::MemoryObject::pack(first, *blocks);
+        check_result(result);
+    }
+    if(blocks->voices().empty()) {
+        fail("No voices!\n");
+    }
+
+    API::BatchExporter::Options options;
+    options.format = format;
+    options.rate = rate;
+    API::BatchExporter exporter(options);
+    exporter.add(blocks, base);
+    std::vector<std::string> filenames;
+    auto result = exporter.run(&filenames);
+    check_result(result);
+    for(auto &filename: filenames) {
+        printf("  %s\n", filename.c_str());
+    }
+    printf("Wrote %zu file(s)\n", filenames.size());
+
+    printf("Success!\n");
+    return EXIT_SUCCESS;
+}
+
+int render_voices(const Args &args) {
+    printf("Rendering Voices...\n");
+    std::string
+        input = args.first,
+        base = args.third;
+    if(input.empty()) {
+        fail("No input filename specified\n");
+    }
+    API::RenderNote note;
+    if(!args.second.empty()) {
+        const std::string &n = args.second;
+        auto slash = n.find('/');
+        if(n.find_first_not_of("0123456789/") != std::string::npos ||
+            !slash || (slash == n.size() - 1) ||
+            (n.find('/', slash + 1) != std::string::npos)) {
+            fail("Couldn't parse note (%s).\n", n.c_str());
+        }
+        int key = atoi(n.c_str()), velocity = note.velocity;
+        if(slash != std::string::npos) {
+            velocity = atoi(n.c_str() + slash + 1);
+        }
+        if((key > 127) || (velocity < 1) || (velocity > 127)) {
+            fail("Note out of range (%s).\n", n.c_str());
+        }
+        note.note = static_cast<uint8_t>(key);
+        note.velocity = static_cast<uint8_t>(velocity);
+    }
+    if(base.empty()) {
+        base = input;
+        file_extension_replace_or_append(base, "");
+    }
+
+    API::MemoryBlocks blocks;
+    auto ext = file_extension_find(input);
+    if(file_extension_matches(ext, { ".fzb", ".fze", ".fzf", ".fzv" })) {
+        printf("Loading %s...\n", input.c_str());
+        auto result = API::BlockLoader(input).load(blocks);
+        check_result(result);
+    } else if(API::MemoryObjectPtr first = load_memory_object_list(input)) {
+        auto result = API::MemoryObject::pack(first, blocks);
+        check_result(result);
+    }
+    if(blocks.voices().empty()) {
+        fail("No voices!\n");
+    }
+
+    for(size_t n = 0; n < blocks.voices().size(); n++) {
+        std::string filename =
+            API::voice_wav_filename(base, n, *blocks.voice(n));
+        auto result = blocks.render_voice_wav(n, filename, note);
+        check_result(result);
+        printf("  %s\n", filename.c_str());
+    }
+    printf("Wrote %zu file(s)\n", blocks.voices().size());
+
+    printf("Success!\n");
+    return EXIT_SUCCESS;
+}
+
+int render_bank(const Args &args, API::BankOutputs outputs) {
+    std::string
+        input = args.first,
+        midi = args.second,
+        output = args.third;
+    if(input.empty()) {
+        fail("No input filename specified\n");
+    }
+    if(midi.empty()) {
+        fail("No MIDI filename specified\n");
+    }
+    if(output.empty()) {
+        output = midi;
+        file_extension_replace_or_append(output, ".wav");
+    }
+
+    API::MemoryBlocks blocks;
+    auto ext = file_extension_find(input);
+    if(file_extension_matches(ext, { ".fzb", ".fze", ".fzf", ".fzv" })) {
+        printf("Loading %s...\n", input.c_str());
+        auto result = API::BlockLoader(input).load(blocks);
+        check_result(result);
+    } else if(API::MemoryObjectPtr first = load_memory_object_list(input)) {
+        auto result = API::MemoryObject::pack(first, blocks);
+        check_result(result);
+    }
+    if(blocks.banks().empty()) {
+        fail("No banks!\n");
+    }
+    printf("Loading %s...\n", midi.c_str());
+    std::vector<API::MidiNote> notes;
+    auto result = API::load_midi_file(midi, notes);
+    check_result(result);
+
+    API::BankRenderOptions options;
+    options.outputs = outputs;
+    printf("Rendering %zu note(s) to %s\n", notes.size(), output.c_str());
+    result = API::render_bank_wav(blocks, 0, notes, output, options);
+    check_result(result);
+
+    printf("Success!\n");
+    return EXIT_SUCCESS;
+}
+
+int trim_file(const Args &args, bool normalize) {
+    if(!args.third.empty()) {
+        fail("Too many arguments given.\n");
+    }
+    std::string
+        input = args.first,
+        output = args.second.empty() ? args.first : args.second;
+    if(input.empty()) {
+        fail("No input filename specified\n");
+    }
+    auto ext = file_extension_find(input);
+    if(!file_extension_matches(ext, { ".fzb", ".fze", ".fzf", ".fzv" })) {
+        fail("Only binary files can be trimmed (filename: %s)\n",
+            input.c_str());
+    }
+    FzFileType file_type = extension_to_file_type(file_extension_find(output));
+    if(file_type == TYPE_UNKNOWN) {
+        file_type = extension_to_file_type(ext);
+    }
+
+    API::MemoryObjectPtr first = load_memory_object_list(input);
+    API::TrimOptions options;
+    options.normalize = normalize;
+    size_t removed = 0;
+    auto result = API::trim_waves(first, options, &removed);
+    check_result(result);
+    printf("Removed %zu wave block(s)\n", removed);
+
+    API::MemoryBlocks blocks;
+    result = API::MemoryObject::pack(first, blocks, file_type);
+    check_result(result);
+    printf("Writing %zu blocks to %s\n", blocks.count(), output.c_str());
+    result = API::BlockDumper(output).dump(blocks);
+    check_result(result);
+
+    printf("Success!\n");
+    return EXIT_SUCCESS;
+}
+
 int special_operation(const Args &args) {
     if(string_equals(args.option, { "?", "h", "help", "-help" })) {
         usage();
+    } else if(args.option == "c") {
+        return compact_file(args);
     } else if(args.option == "i") {
-        return display_info(args);
+        return display_info(args, false);
+    } else if(args.option == "iv") {
+        return display_info(args, true);
+    } else if(args.option == "l") {
+        return loop_file(args);
+    } else if(args.option == "m") {
+        return merge_files(args);
+    } else if(args.option == "p") {
+        return plan_memory(args);
+    } else if(args.option == "r") {
+        return render_voices(args);
+    } else if(args.option == "rb") {
+        return render_bank(args, API::BANK_STEREO);
+    } else if(args.option == "rbi") {
+        return render_bank(args, API::BANK_INDIVIDUAL);
+    } else if(args.option == "t") {
+        return trim_file(args, false);
+    } else if(args.option == "tn") {
+        return trim_file(args, true);
     } else if(args.option == "v") {
         return display_version(args);
     } else if(args.option == "w") {
-        return extract_wave(args);
+        return extract_wave(args, API::WAV_PCM16);
+    } else if(args.option == "wf") {
+        return extract_wave(args, API::WAV_FLOAT32);
+    } else if(args.option == "wv") {
+        return extract_voices(args, API::WAV_PCM16);
+    } else if(args.option == "wvf") {
+        return extract_voices(args, API::WAV_FLOAT32);
     }
 
     printf("Unknown option: use -? or -help for assistance\n");
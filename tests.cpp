@@ -1,11 +1,17 @@
 #undef NDEBUG
 #include "Casio/FZ-1.h"
 #include "Casio/FZ-1_API.h"
+#include "Casio/FZ-1_DSP.h"
 #include <assert.h>
+#include <math.h>
 #include <stddef.h>
 #include <stdio.h>
+#include <string.h>
 #include <functional>
+#include <map>
+#include <memory>
 #include <string>
+#include <thread>
 
 using namespace Casio::FZ_1;
 
@@ -339,6 +345,702 @@ T_(load_voice, {
     check_voice(*mb.voice(0));
 });
 
+T_(section_table, {
+    auto bl = API::BlockLoader("fz_data/bank.fzb");
+    API::MemoryBlocks mb;
+    auto r1 = bl.load(mb);
+    CHECK(API::result_success(r1));
+    CHECK(mb.section(API::BT_EFFECT).length == 0);
+    CHECK(mb.section(API::BT_BANK).start == 0);
+    CHECK(mb.section(API::BT_BANK).length == 1);
+    CHECK(mb.section(API::BT_VOICE).start == 1);
+    CHECK(mb.section(API::BT_VOICE).length == 1);
+    CHECK(mb.section(API::BT_WAVE).start == 2);
+    CHECK(mb.section(API::BT_WAVE).length == 4);
+    CHECK(mb.section(API::BT_NONE).length == 0);
+
+    auto banks = mb.banks();
+    CHECK(banks.size() == 1);
+    CHECK(&banks[0] == mb.bank(0));
+    check_bank(banks[0]);
+    auto voices = mb.voices();
+    CHECK(voices.size() == 1);
+    CHECK(&voices[0] == mb.voice(0));
+    check_voice(voices[0]);
+    auto waves = mb.waves();
+    CHECK(waves.size() == 4);
+    size_t n = 0;
+    for(Wave &w: waves) {
+        CHECK(&w == mb.wave(n++));
+    }
+    CHECK(n == 4);
+    CHECK(waves.data() + 4 == &*waves.end());
+
+    auto bl2 = API::BlockLoader("fz_data/full.fzf");
+    API::MemoryBlocks mb2;
+    auto r2 = bl2.load(mb2);
+    CHECK(API::result_success(r2));
+    CHECK(mb2.section(API::BT_EFFECT).length == 1);
+    CHECK(mb2.banks().empty());
+    CHECK(mb2.voices().size() == 1);
+    CHECK(mb2.waves().size() == 4);
+
+    // voices are strided inside their blocks, and can partially fill the last
+    API::MemoryObjectPtr first, current;
+    for(size_t i = 0; i < 6; i++) {
+        current = API::MemoryVoice::emplace([i](Voice &v) {
+            v.data_end = static_cast<int32_t>(i);
+        }, current);
+        if(!first) { first = current; }
+    }
+    API::MemoryBlocks mb3;
+    auto r3 = API::MemoryObject::pack(first, mb3, TYPE_VOICE);
+    CHECK(API::result_success(r3));
+    CHECK(mb3.section(API::BT_VOICE).length == 2);
+    voices = mb3.voices();
+    CHECK(voices.size() == 6);
+    n = 0;
+    for(Voice &v: voices) {
+        CHECK(&v == mb3.voice(n));
+        CHECK(v.data_end == static_cast<int32_t>(n++));
+    }
+    CHECK(n == 6);
+    CHECK(mb3.waves().empty());
+
+    mb3.reset();
+    CHECK(mb3.voices().empty());
+    CHECK(mb3.section(API::BT_VOICE).length == 0);
+});
+
+T_(flat_samples, {
+    auto bl = API::BlockLoader("fz_data/full.fzf");
+    API::MemoryBlocks mb;
+    auto r1 = bl.load(mb);
+    CHECK(API::result_success(r1));
+    auto samples = mb.samples();
+    CHECK(samples.size() == 4 * 512);
+    for(size_t i = 0; i < samples.size(); i++) {
+        CHECK(samples[i] == mb.wave(i / 512)->samples[i % 512]);
+    }
+
+    // the voice's play range, in absolute sample addresses
+    Voice *v = mb.voice(0);
+    auto play = mb.samples(v->play_start, v->play_end - v->play_start);
+    CHECK(play.size() == 1824);
+    CHECK(play.data() == &mb.wave(0)->samples[96]);
+    CHECK(&play[play.size() - 1] == &mb.wave(3)->samples[383]);
+    CHECK(mb.samples(2048, 0).empty());
+    CHECK(mb.samples(2000, 49).empty());
+    CHECK(mb.samples(4000, 1).empty());
+
+    // the same data, whether dumped from the blocks or from the object list
+    auto read_file = [](const char *filename) {
+        std::string result;
+        if(FILE *f = fopen(filename, "rb")) {
+            char buffer[4096];
+            while(size_t n = fread(buffer, 1, sizeof(buffer), f)) {
+                result.append(buffer, n);
+            }
+            fclose(f);
+        }
+        return result;
+    };
+    auto r2 = mb.dump_wav("fz_data/tmp1", API::SR_36kHz, 500, 1000);
+    CHECK(API::result_success(r2));
+    API::MemoryObjectPtr mo;
+    auto r3 = mb.unpack(mo);
+    CHECK(API::result_success(r3));
+    auto wave = std::static_pointer_cast<API::MemoryWave>(mo->next()->next());
+    CHECK(wave->wave());
+    auto r4 = wave->dump_wav("fz_data/tmp2", API::SR_36kHz, 500, 1000);
+    CHECK(API::result_success(r4));
+    auto wav1 = read_file("fz_data/tmp1");
+    auto wav2 = read_file("fz_data/tmp2");
+    remove("fz_data/tmp1");
+    remove("fz_data/tmp2");
+    CHECK(wav1.size() == 44 + (1000 * sizeof(int16_t)));
+    CHECK(wav1 == wav2);
+    // 16-bit PCM output holds the samples exactly
+    CHECK(!memcmp(wav1.data() + 44, &samples[500], 1000 * sizeof(int16_t)));
+
+    auto r7 = mb.dump_wav("fz_data/tmp1", API::SR_36kHz, 500, 1000,
+        API::WAV_FLOAT32);
+    CHECK(API::result_success(r7));
+    auto r8 = wave->dump_wav("fz_data/tmp2", API::SR_36kHz, 500, 1000,
+        API::WAV_FLOAT32);
+    CHECK(API::result_success(r8));
+    wav1 = read_file("fz_data/tmp1");
+    wav2 = read_file("fz_data/tmp2");
+    remove("fz_data/tmp1");
+    remove("fz_data/tmp2");
+    CHECK(wav1.size() == 44 + (1000 * sizeof(float)));
+    CHECK(wav1 == wav2);
+    float f;
+    memcpy(&f, wav1.data() + 44, sizeof(f));
+    CHECK(f == samples[500] / 32768.f);
+
+    auto r5 = mb.dump_wav("fz_data/tmp1", API::SR_36kHz, 2048, 1);
+    CHECK(r5 == API::RESULT_WAVE_BAD_OFFSET);
+    auto r6 = mb.dump_wav("fz_data/tmp1", API::SampleRate(3), 0, 1);
+    CHECK(r6 == API::RESULT_WAVE_BAD_SAMPLERATE);
+    auto r9 = mb.dump_wav("fz_data/tmp1", API::SR_36kHz, 0, 1,
+        API::WavFormat(2));
+    CHECK(r9 == API::RESULT_WAVE_BAD_FORMAT);
+});
+
+T_(voice_wavs, {
+    Voice v;
+    strcpy(v.name, "A/B C.d  ");
+    CHECK(API::voice_wav_filename("out", 0, v) == "out_01_A_B_C_d.wav");
+    strcpy(v.name, "");
+    CHECK(API::voice_wav_filename("out", 11, v) == "out_12.wav");
+
+    API::MemoryBlocks bank, mb;
+    auto r1 = API::BlockLoader("fz_data/bank.fzb").load(bank);
+    CHECK(API::result_success(r1));
+    auto r2 = API::MemoryBlocks::merge({ &bank, &bank }, mb);
+    CHECK(API::result_success(r2));
+    CHECK(mb.voice_samples(0).size() == 1929);
+    CHECK(mb.voice_samples(1).data() == &mb.samples()[2048]);
+    CHECK(mb.voice_samples(2).empty());
+    mb.voice(1)->frequency = API::SR_9kHz;
+    mb.voice(1)->data_end = 1000000; // clipped to the end of the wave data
+
+    std::vector<std::string> filenames;
+    auto r3 = mb.dump_voice_wavs("fz_data/tmp", API::WAV_PCM16, &filenames);
+    CHECK(API::result_success(r3));
+    CHECK(filenames.size() == 2);
+    CHECK(filenames[0] == "fz_data/tmp_01_AAAAAAAAAAAA.wav");
+    CHECK(filenames[1] == "fz_data/tmp_02_AAAAAAAAAAAA.wav");
+    const size_t expected_samples[2] = { 1929, 2048 };
+    const uint32_t expected_rates[2] = { 36000, 9000 };
+    for(size_t i = 0; i < 2; i++) {
+        FILE *f = fopen(filenames[i].c_str(), "rb");
+        CHECK(f);
+        uint8_t header[44];
+        CHECK(fread(header, 1, sizeof(header), f) == sizeof(header));
+        uint32_t rate, size;
+        memcpy(&rate, header + 24, sizeof(rate));
+        memcpy(&size, header + 40, sizeof(size));
+        std::vector<int16_t> data(size / sizeof(int16_t));
+        size_t n = fread(data.data(), sizeof(int16_t), data.size(), f);
+        fclose(f);
+        remove(filenames[i].c_str());
+        CHECK(rate == expected_rates[i]);
+        CHECK(n == expected_samples[i]);
+        CHECK(!memcmp(data.data(), mb.voice_samples(i).data(),
+            n * sizeof(int16_t)));
+    }
+
+    mb.voice(0)->frequency = 3;
+    auto r4 = mb.dump_voice_wavs("fz_data/tmp");
+    CHECK(r4 == API::RESULT_WAVE_BAD_SAMPLERATE);
+    mb.voice(0)->frequency = API::SR_36kHz;
+    auto r5 = mb.dump_voice_wavs("fz_data/missing/tmp");
+    CHECK(r5 == API::RESULT_WAVE_OPEN_ERROR);
+});
+
+T_(wav_sampler_chunks, {
+    API::MemoryBlocks mb;
+    auto r1 = API::BlockLoader("fz_data/bank.fzb").load(mb);
+    CHECK(API::result_success(r1));
+    Voice *v = mb.voice(0);
+    v->midi_origin = 60;
+    v->loop_end_point = 1;
+    v->loop_start[0] = 100 | 0x05000000; // (with a fine setting)
+    v->loop_end[0] = static_cast<int32_t>(1000 | 0x80000000); // (skip)
+    v->loop_start[1] = v->loop_end[1] = v->play_end; // (unused)
+
+    for(uint32_t rate: { 0, 72000 }) {
+        std::string filename;
+        API::WavOptions options(API::WAV_PCM16, rate);
+        auto r2 = mb.dump_voice_wav(0, "fz_data/tmp", options, &filename);
+        CHECK(API::result_success(r2));
+        FILE *f = fopen(filename.c_str(), "rb");
+        CHECK(f);
+        std::vector<uint8_t> file(65536);
+        file.resize(fread(file.data(), 1, file.size(), f));
+        fclose(f);
+        remove(filename.c_str());
+
+        // walk the chunks after the RIFF/WAVE header
+        auto word = [&](size_t offset) {
+            uint32_t w;
+            memcpy(&w, &file[offset], sizeof(w));
+            return w;
+        };
+        CHECK(word(4) == file.size() - 8);
+        std::map<std::string, size_t> chunks;
+        for(size_t offset = 12; offset + 8 <= file.size();
+            offset += 8 + word(offset + 4)) {
+            chunks[std::string(&file[offset], &file[offset + 4])] = offset + 8;
+        }
+        CHECK(chunks.size() == 4);
+        const uint32_t scale = rate ? 2 : 1;
+        CHECK(word(chunks["data"] - 4) == 1929 * scale * sizeof(int16_t));
+
+        size_t cue = chunks["cue "];
+        CHECK(word(cue) == 1);
+        CHECK(word(cue + 4) == 1);
+        CHECK(word(cue + 8) == 100 * scale);
+        CHECK(!memcmp(&file[cue + 12], "data", 4));
+
+        size_t smpl = chunks["smpl"];
+        CHECK(word(smpl - 4) == 36 + 24);
+        CHECK(word(smpl + 8) == (rate ? 13889 : 27778));
+        CHECK(word(smpl + 12) == 60);
+        CHECK(word(smpl + 28) == 1);
+        CHECK(word(smpl + 36) == 1);
+        CHECK(word(smpl + 40) == 0);
+        CHECK(word(smpl + 44) == 100 * scale);
+        CHECK(word(smpl + 48) == 1000 * scale);
+        CHECK(word(smpl + 56) == 0);
+    }
+});
+
+T_(batch_export, {
+    auto merged = std::make_shared<API::MemoryBlocks>();
+    API::MemoryBlocks bank;
+    auto r1 = API::BlockLoader("fz_data/bank.fzb").load(bank);
+    CHECK(API::result_success(r1));
+    auto r2 = API::MemoryBlocks::merge({ &bank, &bank }, *merged);
+    CHECK(API::result_success(r2));
+
+    API::BatchExporter::Options options;
+    options.threads = 4;
+    options.max_writers = 2;
+    API::BatchExporter exporter(options);
+    CHECK(exporter.thread_count() == 4);
+    exporter.add("fz_data/bank.fzb", "fz_data/tmpa");
+    exporter.add(merged, "fz_data/tmpb");
+    exporter.add("fz_data/full.fzf", "fz_data/tmpc");
+    std::vector<std::string> filenames;
+    auto r3 = exporter.run(&filenames);
+    CHECK(API::result_success(r3));
+    CHECK(filenames.size() == 4);
+    CHECK(filenames[0] == "fz_data/tmpa_01_AAAAAAAAAAAA.wav");
+    CHECK(filenames[1] == "fz_data/tmpb_01_AAAAAAAAAAAA.wav");
+    CHECK(filenames[2] == "fz_data/tmpb_02_AAAAAAAAAAAA.wav");
+    CHECK(filenames[3] == "fz_data/tmpc_01_AAAAAAAAAAAA.wav");
+    for(auto &filename: filenames) {
+        FILE *f = fopen(filename.c_str(), "rb");
+        CHECK(f);
+        uint8_t header[44];
+        CHECK(fread(header, 1, sizeof(header), f) == sizeof(header));
+        uint32_t size;
+        memcpy(&size, header + 40, sizeof(size));
+        std::vector<int16_t> data(size / sizeof(int16_t));
+        size_t n = fread(data.data(), sizeof(int16_t), data.size(), f);
+        fclose(f);
+        remove(filename.c_str());
+        CHECK(n == 1929);
+        CHECK(!memcmp(data.data(), bank.voice_samples(0).data(),
+            n * sizeof(int16_t)));
+    }
+
+    options.rate = 48000;
+    API::BatchExporter resampled(options);
+    resampled.add(merged, "fz_data/tmpb");
+    auto r5 = resampled.run(&filenames);
+    CHECK(API::result_success(r5));
+    CHECK(filenames.size() == 2);
+    for(auto &filename: filenames) {
+        FILE *f = fopen(filename.c_str(), "rb");
+        CHECK(f);
+        uint8_t header[44];
+        CHECK(fread(header, 1, sizeof(header), f) == sizeof(header));
+        fclose(f);
+        remove(filename.c_str());
+        uint32_t rate, size;
+        memcpy(&rate, header + 24, sizeof(rate));
+        memcpy(&size, header + 40, sizeof(size));
+        CHECK(rate == 48000);
+        CHECK(size == 2572 * sizeof(int16_t)); // 1929 * 4 / 3, rounded up
+    }
+    options.rate = 0;
+
+    API::BatchExporter bad(options);
+    bad.add("fz_data/bank.fzb", "fz_data/tmpa");
+    bad.add("fz_data/missing.fzb", "fz_data/tmpb");
+    filenames.clear();
+    auto r4 = bad.run(&filenames);
+    CHECK(!API::result_success(r4));
+    CHECK(filenames.empty());
+});
+
+T_(wav_import, {
+    API::MemoryBlocks bank;
+    auto r1 = API::BlockLoader("fz_data/bank.fzb").load(bank);
+    CHECK(API::result_success(r1));
+    auto expected = bank.voice_samples(0);
+    CHECK(expected.size() == 1929);
+
+    // round trip through both .wav formats
+    for(auto format: { API::WAV_PCM16, API::WAV_FLOAT32 }) {
+        std::string filename;
+        auto r2 = bank.dump_voice_wav(0, "fz_data/tmp", format, &filename);
+        CHECK(API::result_success(r2));
+        API::MemoryObjectPtr first;
+        auto r3 = API::WavLoader(filename).load(first);
+        remove(filename.c_str());
+        CHECK(API::result_success(r3));
+        Voice *v = first->voice();
+        CHECK(v);
+        CHECK(std::string{ v->name } == "TMP_01_AAAAA");
+        CHECK(v->data_start == 0);
+        CHECK(v->data_end == 1928);
+        CHECK(v->play_start == 0);
+        CHECK(v->play_end == 1926);
+        CHECK(v->loop_end[0] == 1926);
+        CHECK(v->frequency == API::SR_36kHz);
+
+        API::MemoryBlocks mb;
+        auto r4 = API::MemoryObject::pack(first, mb, TYPE_VOICE);
+        CHECK(API::result_success(r4));
+        CHECK(mb.waves().size() == 4);
+        auto samples = mb.samples();
+        CHECK(!memcmp(samples.data(), expected.data(),
+            expected.size() * sizeof(int16_t)));
+        for(size_t i = expected.size(); i < samples.size(); i++) {
+            CHECK(samples[i] == 0);
+        }
+    }
+
+    // stereo files are mixed down
+    const int16_t pcm[] = { 100, 300, -5, -6, 32767, 32767 };
+    write_wav_file("fz_data/tmp.wav", 1, 2, 9000, 16, pcm, sizeof(pcm));
+    API::MemoryObjectPtr first;
+    auto r5 = API::WavLoader("fz_data/tmp.wav").load(first);
+    CHECK(API::result_success(r5));
+    CHECK(first->voice()->data_end == 2);
+    CHECK(first->voice()->frequency == API::SR_9kHz);
+    CHECK(first->next()->wave()->samples[0] == 200);
+    CHECK(first->next()->wave()->samples[1] == -5);
+    CHECK(first->next()->wave()->samples[2] == 32767);
+    CHECK(first->next()->wave()->samples[3] == 0);
+    CHECK(!first->next()->next());
+
+    const float fp[] = { 0.5f, 0.25f, -1.f, -2.f };
+    write_wav_file("fz_data/tmp.wav", 3, 2, 18000, 32, fp, sizeof(fp));
+    auto r6 = API::WavLoader("fz_data/tmp.wav").load(first);
+    CHECK(API::result_success(r6));
+    CHECK(first->voice()->frequency == API::SR_18kHz);
+    CHECK(first->next()->wave()->samples[0] == 12288);
+    CHECK(first->next()->wave()->samples[1] == -32768);
+
+    // other rates are resampled (here, 1000 frames at 44.1kHz to 18kHz)
+    std::vector<int16_t> tone(1000);
+    for(size_t i = 0; i < tone.size(); i++) {
+        tone[i] = static_cast<int16_t>(
+            8000 * sin(i * 2 * DSP::PI * 441 / 44100));
+    }
+    write_wav_file("fz_data/tmp.wav", 1, 1, 44100, 16,
+        tone.data(), tone.size() * sizeof(int16_t));
+    auto r7 = API::WavLoader("fz_data/tmp.wav", API::SR_18kHz).load(first);
+    CHECK(API::result_success(r7));
+    CHECK(first->voice()->frequency == API::SR_18kHz);
+    CHECK(first->voice()->data_end == 408); // 409 samples
+    CHECK(first->next()->wave()->samples[409] == 0);
+    for(size_t i = 20; i < 388; i++) {
+        double expected = 8000 * sin(i * 2 * DSP::PI * 441 / 18000);
+        CHECK(fabs(first->next()->wave()->samples[i] - expected) < 16);
+    }
+
+    write_wav_file("fz_data/tmp.wav", 1, 1, 0, 16, pcm, sizeof(pcm));
+    auto r7b = API::WavLoader("fz_data/tmp.wav").load(first);
+    CHECK(r7b == API::RESULT_WAVE_UNSUPPORTED_SAMPLERATE);
+    CHECK(!first);
+    write_wav_file("fz_data/tmp.wav", 3, 1, 36000, 64, pcm, sizeof(pcm));
+    auto r8 = API::WavLoader("fz_data/tmp.wav").load(first);
+    CHECK(r8 == API::RESULT_WAVE_UNSUPPORTED_FORMAT);
+    write_wav_file("fz_data/tmp.wav", 1, 1, 36000, 16, pcm, 0);
+    auto r9 = API::WavLoader("fz_data/tmp.wav").load(first);
+    CHECK(r9 == API::RESULT_NO_BLOCKS);
+    remove("fz_data/tmp.wav");
+    auto r10 = API::WavLoader("fz_data/tmp.wav").load(first);
+    CHECK(r10 == API::RESULT_WAVE_OPEN_ERROR);
+});
+
+T_(merge_blocks, {
+    API::MemoryBlocks bank, full, out;
+    auto r1 = API::BlockLoader("fz_data/bank.fzb").load(bank);
+    CHECK(API::result_success(r1));
+    auto r2 = API::BlockLoader("fz_data/full.fzf").load(full);
+    CHECK(API::result_success(r2));
+
+    auto r3 = API::MemoryBlocks::merge({ &bank, &full, &bank }, out);
+    CHECK(API::result_success(r3));
+    CHECK(out.file_type() == TYPE_FULL);
+    CHECK(out.count() == 2 + 1 + 12);
+    CHECK(out.dirty_count() == out.count());
+    CHECK(out.header()->bank_count == 2);
+    CHECK(out.header()->voice_count == 3);
+    CHECK(out.header()->wave_block_count == 12);
+    CHECK(out.effect_header()->pitchbend_depth == 24);
+    CHECK(out.bank(0)->voice_index[0] == 0);
+    CHECK(out.bank(1)->voice_index[0] == 2);
+    check_bank(*out.bank(0));
+    check_voice(*out.voice(0));
+    for(size_t i = 0; i < 3; i++) {
+        Voice *v = out.voice(i);
+        CHECK(v->data_start == static_cast<int32_t>(i * 2048));
+        CHECK(v->data_end == static_cast<int32_t>((i * 2048) + 1928));
+        CHECK(v->play_start == static_cast<int32_t>((i * 2048) + 96));
+        CHECK(v->play_end == static_cast<int32_t>((i * 2048) + 1920));
+        CHECK(!memcmp(&out.samples()[i * 2048],
+            &bank.samples()[0], 2048 * sizeof(int16_t)));
+    }
+
+    // out can also be an input
+    auto r4 = API::MemoryBlocks::merge({ &out, &full }, out, TYPE_VOICE);
+    CHECK(API::result_success(r4));
+    CHECK(out.file_type() == TYPE_VOICE);
+    CHECK(out.voices().size() == 4);
+    CHECK(out.voice(3)->play_start == (3 * 2048) + 96);
+
+    // loop fine settings and skip/trace flags are preserved
+    Voice v;
+    v.loop_start[0] = 0x12000010;
+    v.loop_end[0] = static_cast<int32_t>(0x80000020);
+    v.loop_end[1] = 0x30;
+    API::rebase_voice(v, 0x100);
+    CHECK(v.loop_start[0] == 0x12000110);
+    CHECK(v.loop_end[0] == static_cast<int32_t>(0x80000120));
+    CHECK(v.loop_end[1] == 0x130);
+    CHECK(v.loop_start[1] == 0x100);
+
+    // a bank can only refer to 64 voices
+    std::vector<const API::MemoryBlocks*> many(64, &bank);
+    auto r5 = API::MemoryBlocks::merge(many, out);
+    CHECK(API::result_success(r5));
+    CHECK(out.header()->voice_count == 64);
+    CHECK(out.bank(63)->voice_index[0] == 63);
+    many.push_back(&bank);
+    auto r6 = API::MemoryBlocks::merge(many, out);
+    CHECK(r6 == API::RESULT_MERGE_TOO_LARGE);
+    API::MemoryBlocks empty;
+    auto r7 = API::MemoryBlocks::merge({ &full, &empty }, out);
+    CHECK(r7 == API::RESULT_BAD_HEADER);
+});
+
+T_(compact_waves, {
+    API::MemoryBlocks bank, mb;
+    auto r1 = API::BlockLoader("fz_data/bank.fzb").load(bank);
+    CHECK(API::result_success(r1));
+    auto r2 = API::MemoryBlocks::merge({ &bank, &bank, &bank }, mb);
+    CHECK(API::result_success(r2));
+    CHECK(mb.waves().size() == 12);
+
+    // nothing to do
+    size_t removed = 1;
+    auto r3 = mb.compact(&removed);
+    CHECK(API::result_success(r3));
+    CHECK(removed == 0);
+    CHECK(mb.count() == 3 + 1 + 12);
+
+    // shrink the middle voice to its first 1000 samples, leaving 2 dead blocks
+    mb.clean();
+    Voice *v = mb.voice(1);
+    v->data_end = v->play_end = v->data_start + 1000;
+    v->loop_end[0] = v->loop_start[0];
+    auto r4 = mb.compact(&removed);
+    CHECK(API::result_success(r4));
+    CHECK(removed == 2);
+    CHECK(mb.count() == 3 + 1 + 10);
+    CHECK(mb.dirty_count() == mb.count());
+    CHECK(mb.header()->block_count == 14);
+    CHECK(mb.header()->wave_block_count == 10);
+    CHECK(mb.samples().size() == 10 * 512);
+
+    // the first two voices are untouched, the last moves down
+    CHECK(mb.voice(0)->data_start == 0);
+    CHECK(mb.voice(1)->data_start == 2048);
+    CHECK(mb.voice(1)->data_end == 2048 + 1000);
+    v = mb.voice(2);
+    CHECK(v->data_start == 3072);
+    CHECK(v->data_end == 3072 + 1928);
+    CHECK(v->play_start == 3072 + 96);
+    CHECK(v->play_end == 3072 + 1920);
+    CHECK(v->loop_start[0] == 3072);
+    for(size_t i = 0; i < 3; i++) {
+        auto data = mb.samples(mb.voice(i)->data_start, 1000);
+        CHECK(!memcmp(data.data(), bank.samples().data(),
+            1000 * sizeof(int16_t)));
+    }
+
+    // a voice which only uses its first sample keeps only the first block
+    auto r5 = API::BlockLoader("fz_data/bank.fzb").load(mb);
+    CHECK(API::result_success(r5));
+    v = mb.voice(0);
+    v->data_end = v->play_start = v->play_end = v->loop_end[0] = 0;
+    auto r6 = mb.compact(&removed);
+    CHECK(API::result_success(r6));
+    CHECK(removed == 3);
+    CHECK(mb.waves().size() == 1);
+});
+
+T_(trim_waves, {
+    // two voices with silence at either end (the second quieter, and further
+    // on, with unused blocks after each)
+    std::vector<int16_t> data(8 * 512);
+    auto tone = [&](size_t from, size_t count, double level) {
+        for(size_t i = 0; i < count; i++) {
+            data[from + i] = static_cast<int16_t>(
+                lrint(cos(i * 2 * DSP::PI / 50) * level * 32767));
+        }
+    };
+    tone(100, 1000, .5);
+    tone(2048 + 50, 600, .25);
+    auto make_list = [&] {
+        API::MemoryObjectPtr first = API::MemoryVoice::emplace([](Voice &v) {
+            v.data_start = v.play_start = 0;
+            v.data_end = v.play_end = 1499;
+            v.loop_start[0] = 500;
+            v.loop_end[0] = 999;
+            v.loop_end_point = 0;
+        }, nullptr);
+        API::MemoryObjectPtr current = API::MemoryVoice::emplace([](Voice &v) {
+            v.data_start = 2048;
+            v.play_start = 2048 + 10;
+            v.data_end = v.play_end = 2048 + 999;
+            // (with a fine setting)
+            v.loop_start[0] = 0x01000000 | (2048 + 100);
+            v.loop_end[0] = 2048 + 399;
+            v.loop_start[1] = v.loop_end[1] = v.play_end;
+            v.loop_end_point = 0;
+        }, first);
+        for(size_t b = 0; b < 8; b++) {
+            current = API::MemoryWave::emplace([&](Wave &w) {
+                memcpy(w.samples, &data[b * 512], sizeof(w.samples));
+            }, current);
+        }
+        return first;
+    };
+
+    auto first = make_list();
+    size_t removed = 0;
+    auto r1 = API::trim_waves(first, {}, &removed);
+    CHECK(API::result_success(r1));
+    CHECK(removed == 4);
+    API::MemoryBlocks mb;
+    auto r2 = API::MemoryObject::pack(first, mb, TYPE_VOICE);
+    CHECK(API::result_success(r2));
+    CHECK(mb.waves().size() == 4);
+    const Voice *v = mb.voice(0);
+    CHECK(v->data_start == 0);
+    CHECK(v->data_end == 999);
+    CHECK(v->play_start == 0);
+    CHECK(v->play_end == 999);
+    CHECK(v->loop_start[0] == 400);
+    CHECK(v->loop_end[0] == 899);
+    v = mb.voice(1);
+    CHECK(v->data_start == 1000);
+    CHECK(v->data_end == 1599);
+    CHECK(v->play_start == 1000);
+    CHECK(v->play_end == 1599);
+    CHECK(v->loop_start[0] == (0x01000000 | 1050));
+    CHECK(v->loop_end[0] == 1349);
+    CHECK(v->loop_start[1] == 1599);
+    auto samples = mb.samples();
+    CHECK(!memcmp(&samples[0], &data[100], 1000 * sizeof(int16_t)));
+    CHECK(!memcmp(&samples[1000], &data[2098], 600 * sizeof(int16_t)));
+    CHECK(std::all_of(&samples[1600], &samples[2047] + 1,
+        [](int16_t s) { return s == 0; }));
+
+    // nothing more to trim
+    mb.clean();
+    auto r3 = API::trim_waves(first, {}, &removed);
+    CHECK(API::result_success(r3));
+    CHECK(removed == 0);
+    auto r4 = API::MemoryObject::repack(first, mb);
+    CHECK(API::result_success(r4));
+    CHECK(mb.dirty_count() == 0);
+
+    // both voices normalised to full scale
+    first = make_list();
+    API::TrimOptions options;
+    options.normalize = true;
+    auto r5 = API::trim_waves(first, options);
+    CHECK(API::result_success(r5));
+    auto r6 = API::MemoryObject::pack(first, mb, TYPE_VOICE);
+    CHECK(API::result_success(r6));
+    for(auto &a: mb.analyze_voices()) {
+        CHECK(a.peak == 32767.f / 32768.f);
+        CHECK(a.leading_silence == 0);
+        CHECK(a.trailing_silence == 0);
+    }
+    CHECK(mb.samples()[1] == lrintf(data[101] * (32767.f / 16384)));
+    CHECK(mb.samples()[1001] == lrintf(data[2099] * (32767.f / 8192)));
+});
+
+T_(block_hashes, {
+    // reference values from an independent XXH64 implementation
+    API::MemoryBlocks bank, full;
+    auto r1 = API::BlockLoader("fz_data/bank.fzb").load(bank);
+    CHECK(API::result_success(r1));
+    auto r2 = API::BlockLoader("fz_data/full.fzf").load(full);
+    CHECK(API::result_success(r2));
+    CHECK(bank.block_hash(0) == 0x2d41713d82a8beb2);
+    CHECK(bank.block_hash(1) == 0x77e1a813d1f316dd);
+    CHECK(bank.block_hash(5) == 0xa593f06ec4ad5ec0);
+    CHECK(bank.block_hash(6) == 0);
+    CHECK(bank.digest() == 0x00872a1f45dd7a45);
+    CHECK(full.block_hash(0) == 0xcbd838f4e7bacd24);
+    CHECK(full.digest() == 0xeddf4a8799f892e6);
+
+    // the same wave data hashes the same, wherever it is
+    for(size_t i = 0; i < 4; i++) {
+        CHECK(bank.block_hash(i + 2) == full.block_hash(i + 1));
+    }
+
+    // a short dump (fewer than four blocks) takes a different digest path
+    API::MemoryObjectPtr first = API::MemoryVoice::create(Voice{}, nullptr);
+    API::MemoryWave::emplace([](Wave &w) {
+        auto *bytes = reinterpret_cast<uint8_t*>(w.samples);
+        for(size_t i = 0; i < sizeof(w.samples); i++) {
+            bytes[i] = static_cast<uint8_t>(i);
+        }
+    }, first);
+    API::MemoryBlocks mb;
+    auto r3 = API::MemoryObject::pack(first, mb, TYPE_VOICE);
+    CHECK(API::result_success(r3));
+    CHECK(mb.block_hash(0) == 0x314eedc987bca5a5);
+    CHECK(mb.block_hash(1) == 0x6f3914f18fe4df57);
+    CHECK(mb.digest() == 0xe8e8b40697322f07);
+
+    // repack() keeps hashes up to date, and digests follow content
+    API::MemoryObjectPtr mo;
+    auto r4 = bank.unpack(mo);
+    CHECK(API::result_success(r4));
+    uint64_t digest = bank.digest();
+    auto voice = mo->next();
+    voice->voice()->filter = 12;
+    voice->touch();
+    auto r5 = API::MemoryObject::repack(mo, bank);
+    CHECK(API::result_success(r5));
+    CHECK(bank.block_hash(0) == 0x2d41713d82a8beb2);
+    CHECK(bank.block_hash(1) != 0x77e1a813d1f316dd);
+    CHECK(bank.digest() != digest);
+    uint64_t hash = bank.block_hash(1);
+    bank.rehash();
+    CHECK(bank.block_hash(1) == hash);
+    voice->voice()->filter = 0;
+    voice->touch();
+    auto r6 = API::MemoryObject::repack(mo, bank);
+    CHECK(API::result_success(r6));
+    CHECK(bank.block_hash(1) == 0x77e1a813d1f316dd);
+    CHECK(bank.digest() == digest);
+
+    // direct edits need rehash()
+    bank.wave(0)->samples[0] ^= 1;
+    CHECK(bank.digest() == digest);
+    bank.rehash();
+    CHECK(bank.digest() != digest);
+
+    bank.reset();
+    CHECK(bank.block_hash(0) == 0);
+});
+
 T_(load_dump_load, {
     auto bl1 = API::BlockLoader("fz_data/voice.fzv");
     API::MemoryBlocks mb1;
@@ -381,6 +1083,153 @@ T_(load_dump_load, {
     CHECK(mb3.count() == 5);
 });
 
+T_(repack_update, {
+    auto bl = API::BlockLoader("fz_data/bank.fzb");
+    API::MemoryBlocks mb;
+    auto r1 = bl.load(mb);
+    CHECK(API::result_success(r1));
+    CHECK(mb.dirty_count() == 0);
+    API::MemoryObjectPtr mo;
+    auto r2 = mb.unpack(mo);
+    CHECK(API::result_success(r2));
+    for(auto o = mo; o; o = o->next()) {
+        CHECK(!o->is_dirty());
+    }
+
+    uint8_t memory[6 * 1024];
+    auto bd1 = API::BlockDumper(memory);
+    auto r3 = bd1.dump(mb);
+    CHECK(API::result_success(r3));
+    auto bd2 = API::BlockDumper("fz_data/tmp");
+    auto r4 = bd2.dump(mb);
+    CHECK(API::result_success(r4));
+
+    // nothing to do
+    auto r5 = API::MemoryObject::repack(mo, mb);
+    CHECK(API::result_success(r5));
+    CHECK(mb.dirty_count() == 0);
+
+    // change the voice (block 1) and the last wave (block 5)
+    auto voice = mo->next();
+    voice->voice()->data_end = 1000;
+    voice->touch();
+    auto wave = voice->next()->next()->next()->next();
+    CHECK(wave->type() == API::BT_WAVE);
+    CHECK(!wave->next());
+    wave->wave()->samples[100] = 1234;
+    wave->touch();
+    auto r6 = API::MemoryObject::repack(mo, mb);
+    CHECK(API::result_success(r6));
+    CHECK(!voice->is_dirty());
+    CHECK(!wave->is_dirty());
+    CHECK(mb.dirty_count() == 2);
+    CHECK(!mb.is_dirty(0));
+    CHECK(mb.is_dirty(1));
+    CHECK(mb.is_dirty(5));
+    CHECK(!mb.is_dirty(6));
+    CHECK(mb.voice(0)->data_end == 1000);
+    CHECK(mb.wave(3)->samples[100] == 1234);
+
+    size_t bytes = 0;
+    auto r7 = bd1.update(mb, &bytes);
+    CHECK(API::result_success(r7));
+    CHECK(bytes == 2 * 1024);
+    CHECK(!memcmp(memory, mb.block(0), sizeof(memory)));
+
+    auto r8 = bd2.update(mb, &bytes);
+    CHECK(API::result_success(r8));
+    CHECK(bytes == 2 * 1024);
+    // until the blocks are cleaned, the same blocks are written again
+    CHECK(mb.dirty_count() == 2);
+    auto r9 = bd1.update(mb, &bytes);
+    CHECK(API::result_success(r9));
+    CHECK(bytes == 2 * 1024);
+    mb.clean();
+    CHECK(mb.dirty_count() == 0);
+    auto r10 = bd1.update(mb, &bytes);
+    CHECK(API::result_success(r10));
+    CHECK(bytes == 0);
+
+    auto bl2 = API::BlockLoader("fz_data/tmp");
+    remove("fz_data/tmp");
+    API::MemoryBlocks mb2;
+    auto r11 = bl2.load(mb2);
+    CHECK(API::result_success(r11));
+    CHECK(mb2.voice(0)->data_end == 1000);
+    CHECK(mb2.wave(3)->samples[100] == 1234);
+    check_bank(*mb2.bank(0));
+
+    // a layout change can't be repacked
+    API::MemoryWave::create(Wave{}, wave);
+    auto r12 = API::MemoryObject::repack(mo, mb);
+    CHECK(r12 == API::RESULT_MISMATCHED_BLOCK_COUNT);
+    CHECK(mb.dirty_count() == 0);
+
+    // a full pack dirties everything, and can't update a smaller dump
+    auto r13 = API::MemoryObject::pack(mo, mb, TYPE_BANK);
+    CHECK(API::result_success(r13));
+    CHECK(mb.count() == 7);
+    CHECK(mb.dirty_count() == 7);
+    auto r14 = bd1.update(mb);
+    CHECK(r14 == API::RESULT_MISMATCHED_DUMP_SIZE);
+});
+
+T_(repack_reorder, {
+    auto bl = API::BlockLoader("fz_data/bank.fzb");
+    API::MemoryBlocks mb;
+    auto r1 = bl.load(mb);
+    CHECK(API::result_success(r1));
+    API::MemoryObjectPtr mo;
+    auto r2 = mb.unpack(mo);
+    CHECK(API::result_success(r2));
+
+    // give the bank a second voice, and start again from a clean image
+    auto a = mo->next();
+    CHECK(a->type() == API::BT_VOICE);
+    Voice v = *a->voice();
+    v.data_end = 1000;
+    auto b = API::MemoryVoice::create(v, nullptr);
+    a->insert_before(b);
+    CHECK(a->next() == b);
+    auto r3 = API::MemoryObject::pack(mo, mb, TYPE_BANK);
+    CHECK(API::result_success(r3));
+    mb.clean();
+    CHECK(!a->is_dirty());
+    CHECK(!b->is_dirty());
+    const int32_t a_end = a->voice()->data_end;
+    CHECK(mb.voice(0)->data_end == a_end);
+    CHECK(mb.voice(1)->data_end == 1000);
+
+    // swap the voices: neither is dirty, but both have moved
+    a->remove();
+    b->insert_before(a);
+    CHECK(mo->next() == b);
+    CHECK(b->next() == a);
+    auto r4 = API::MemoryObject::repack(mo, mb);
+    CHECK(API::result_success(r4));
+    CHECK(mb.dirty_count() == 1);
+    CHECK(mb.is_dirty(1));
+    CHECK(mb.voice(0)->data_end == 1000);
+    CHECK(mb.voice(1)->data_end == a_end);
+
+    // once written, they stay put
+    mb.clean();
+    auto r5 = API::MemoryObject::repack(mo, mb);
+    CHECK(API::result_success(r5));
+    CHECK(mb.dirty_count() == 0);
+
+    // a wave moved in front of the voices changes the layout
+    auto wave = a->next();
+    CHECK(wave->type() == API::BT_WAVE);
+    wave->remove();
+    b->insert_after(wave);
+    CHECK(mo->next() == wave);
+    auto r6 = API::MemoryObject::repack(mo, mb);
+    CHECK(r6 == API::RESULT_MISMATCHED_BLOCK_COUNT);
+    CHECK(mb.dirty_count() == 0);
+    CHECK(mb.voice(0)->data_end == 1000);
+});
+
 T_(memory_object_list, {
     Effect e;
     auto me = API::MemoryEffect::create(e);
@@ -616,6 +1465,835 @@ T_(memory_object_insert, {
     CHECK(s->next() == mb2);
 });
 
+T_(memory_object_emplace, {
+    int16_t samples[300];
+    for(size_t i = 0; i < 300; i++) {
+        samples[i] = static_cast<int16_t>(i * 3);
+    }
+    auto mw1 = API::MemoryWave::create(samples, 300);
+    CHECK(mw1);
+    CHECK(mw1->type() == API::BT_WAVE);
+    CHECK(mw1->wave()->samples[0] == 0);
+    CHECK(mw1->wave()->samples[299] == 897);
+    CHECK(mw1->wave()->samples[300] == 0);
+    CHECK(mw1->wave()->samples[511] == 0);
+
+    auto mw2 = API::MemoryWave::emplace([](Wave &w) {
+        for(size_t i = 0; i < 512; i++) {
+            w.samples[i] = static_cast<int16_t>(-i);
+        }
+    }, mw1);
+    CHECK(mw2);
+    CHECK(mw1->next() == mw2);
+    CHECK(mw2->prev() == mw1);
+    CHECK(mw2->index() == 1);
+    CHECK(mw2->wave()->samples[511] == -511);
+
+    auto mv = API::MemoryVoice::emplace([](Voice &v) {
+        v.data_end = 1928;
+        memcpy(v.name, "EMPLACED", 9);
+    });
+    CHECK(mv);
+    CHECK(mv->voice()->data_start == 0);
+    CHECK(mv->voice()->data_end == 1928);
+    CHECK(std::string{ mv->voice()->name } == "EMPLACED");
+
+    auto mb = API::MemoryBank::create(Bank{}, mv);
+    CHECK(mb);
+    CHECK(mv->next() == mb);
+    CHECK(mb->bank()->voice_count == 0);
+
+    auto mw3 = API::MemoryWave::create(Wave{}, mb);
+    CHECK(mw3);
+    CHECK(mb->next() == mw3);
+});
+
+T_(memory_object_visit, {
+    auto bl = API::BlockLoader("fz_data/full.fzf");
+    API::MemoryBlocks mb;
+    auto r = bl.load(mb);
+    CHECK(API::result_success(r));
+    API::MemoryObjectPtr mo;
+    auto r2 = mb.unpack(mo);
+    CHECK(API::result_success(r2));
+
+    size_t
+        effects = 0,
+        voices = 0,
+        waves = 0,
+        others = 0;
+    API::visit(mo, API::overloaded{
+        [&](API::MemoryEffect &e) { CHECK(e.effect()); effects++; },
+        [&](API::MemoryVoice &v) { check_voice(*v.voice()); voices++; },
+        [&](API::MemoryWave &w) { CHECK(w.index() == waves); waves++; },
+    });
+    CHECK(effects == 1);
+    CHECK(voices == 1);
+    CHECK(waves == 4);
+
+    // generic handlers see every object
+    API::visit(mo, [&](auto &o) { others++; });
+    CHECK(others == 6);
+
+    API::MemoryObjectPtr empty;
+    API::visit(empty, [&](auto &o) { others++; });
+    CHECK(others == 6);
+});
+
+T_(memory_snapshot, {
+    auto bl = API::BlockLoader("fz_data/full.fzf");
+    API::MemoryBlocks mb;
+    auto r = bl.load(mb);
+    CHECK(API::result_success(r));
+    API::MemoryObjectPtr mo;
+    auto r2 = mb.unpack(mo);
+    CHECK(API::result_success(r2));
+
+    auto s1 = API::MemorySnapshot::capture(mo);
+    CHECK(s1);
+    CHECK(s1->count() == 6);
+    CHECK(s1->type(0) == API::BT_EFFECT);
+    CHECK(s1->type(1) == API::BT_VOICE);
+    CHECK(s1->type(5) == API::BT_WAVE);
+    CHECK(s1->type(6) == API::BT_NONE);
+    CHECK(s1->effect(0));
+    CHECK(!s1->voice(0));
+    CHECK(s1->voice(1));
+    check_voice(*s1->voice(1));
+    CHECK(!s1->wave(6));
+
+    // replacing a voice leaves the original version untouched, and shares all
+    // the other objects
+    Voice v = *s1->voice(1);
+    v.data_end = 1000;
+    auto s2 = s1->replace(1, v);
+    CHECK(s2);
+    CHECK(s2 != s1);
+    CHECK(s2->count() == 6);
+    CHECK(s2->voice(1)->data_end == 1000);
+    check_voice(*s1->voice(1));
+    CHECK(s2->wave(2) == s1->wave(2));
+    CHECK(s2->effect(0) == s1->effect(0));
+    CHECK(!s1->replace(6, v));
+
+    auto s3 = s2->insert(2, Voice{})->erase(0);
+    CHECK(s3);
+    CHECK(s3->count() == 6);
+    CHECK(s3->type(0) == API::BT_VOICE);
+    CHECK(s3->type(1) == API::BT_VOICE);
+    CHECK(s3->wave(5) == s1->wave(5));
+    CHECK(s2->count() == 6);
+    CHECK(!s3->erase(6));
+    CHECK(!s3->insert(7, Wave{}));
+
+    // lots of appends split chunks but preserve order
+    auto s4 = s3;
+    for(size_t i = 0; i < 100; i++) {
+        Wave w{};
+        w.samples[0] = static_cast<int16_t>(i);
+        s4 = s4->insert(s4->count(), w);
+    }
+    CHECK(s4->count() == 106);
+    for(size_t i = 0; i < 100; i++) {
+        CHECK(s4->wave(6 + i)->samples[0] == static_cast<int16_t>(i));
+    }
+
+    // back to a list that can be packed
+    auto mo2 = s2->unpack();
+    CHECK(mo2);
+    API::MemoryBlocks mb2;
+    auto r3 = API::MemoryObject::pack(mo2, mb2);
+    CHECK(API::result_success(r3));
+    CHECK(mb2.voice(0)->data_end == 1000);
+    CHECK(!API::MemorySnapshot::empty()->unpack());
+
+    // publishing
+    API::SnapshotPublisher publisher(s1);
+    CHECK(publisher.load() == s1);
+    std::thread reader([&publisher, s1] {
+        for(size_t i = 0; i < 1000; i++) {
+            auto s = publisher.load();
+            assert(s->count() == 6);
+            assert(s->wave(5) == s1->wave(5));
+        }
+    });
+    publisher.publish(s2);
+    auto expected = s1;
+    CHECK(!publisher.publish(expected, s3));
+    CHECK(expected == s2);
+    CHECK(publisher.publish(expected, s3));
+    reader.join();
+    CHECK(publisher.load() == s3);
+});
+
+T_(budget_planner, {
+    // four voices of 100 blocks each, at 36kHz (except the last, at 18kHz)
+    API::MemoryObjectPtr first, current;
+    for(int32_t i = 0; i < 4; i++) {
+        current = API::MemoryVoice::emplace([i](Voice &v) {
+            v.data_start = v.play_start = i * 51200;
+            v.data_end = v.play_end = (i * 51200) + 51199;
+            v.loop_end_point = 8;
+            for(size_t j = 0; j < 8; j++) {
+                v.loop_start[j] = v.loop_end[j] = v.play_end;
+            }
+            v.frequency = (i == 3) ? API::SR_18kHz : API::SR_36kHz;
+        }, current);
+        if(!first) { first = current; }
+    }
+    current = API::MemoryWave::create(Wave{}, current);
+
+    std::vector<API::VoiceFootprint> footprints;
+    auto r1 = API::voice_footprints(first, footprints);
+    CHECK(API::result_success(r1));
+    CHECK(footprints.size() == 4);
+    CHECK(footprints[1].voice == 1);
+    CHECK(footprints[1].samples == 51200);
+    CHECK(footprints[1].blocks == 100);
+    CHECK(footprints[3].rate == API::SR_18kHz);
+
+    // compare against every combination of options
+    std::vector<double> priorities = { 4, 3, 2, 1 };
+    API::BudgetOptions options;
+    for(size_t budget: { 0, 20, 60, 160, 250, 400, 1000 }) {
+        options.budget = budget;
+        API::BudgetPlan plan;
+        auto r2 = API::plan_budget(first, priorities, options, plan);
+        CHECK(API::result_success(r2));
+        CHECK(plan.choices.size() == 4);
+        CHECK(plan.blocks <= budget);
+        size_t blocks = 0;
+        for(auto &c: plan.choices) {
+            blocks += c.blocks;
+            CHECK(c.included == (c.blocks != 0));
+            CHECK(c.rate >= footprints[c.voice].rate);
+        }
+        CHECK(blocks == plan.blocks);
+
+        const size_t sizes[4][4] = {
+            { 0, 100, 50, 25 }, { 0, 100, 50, 25 },
+            { 0, 100, 50, 25 }, { 0, 100, 50, 0 },
+        };
+        const double weights[4] = { 0, 1.0, 0.5, 0.25 };
+        double best = 0;
+        for(size_t k = 0; k < 256; k++) {
+            size_t total = 0;
+            double score = 0;
+            bool valid = true;
+            for(size_t v = 0; v < 4; v++) {
+                size_t o = (k >> (v * 2)) & 3;
+                if(o && !sizes[v][o]) { valid = false; }
+                total += sizes[v][o];
+                score += priorities[v] * weights[o];
+            }
+            if(valid && (total <= budget) && (score > best)) {
+                best = score;
+            }
+        }
+        CHECK(plan.score == best);
+    }
+
+    options.budget = API::WAVE_MEMORY_BLOCKS;
+    API::BudgetPlan plan;
+    auto r3 = API::plan_budget(first, {}, options, plan);
+    CHECK(API::result_success(r3));
+    CHECK(plan.blocks == 400);
+    CHECK(plan.score == 4);
+});
+
+T_(int16_to_float, {
+    // every 16-bit value, with lengths and alignments that leave remainders
+    std::vector<int16_t> in(65536 + 32);
+    for(size_t i = 0; i < in.size(); i++) {
+        in[i] = static_cast<int16_t>(i - 32768);
+    }
+    std::vector<float> expected(in.size()), out(in.size());
+    DSP::int16_to_float_scalar(in.data(), expected.data(), in.size());
+    CHECK(expected[0] == -1.f);
+    CHECK(expected[32768] == 0.f);
+    CHECK(expected[65535] == 32767.f / 32768.f);
+    for(size_t offset: { 0, 1, 7 }) {
+        for(size_t count: { 0, 1, 15, 17, 65536 + 25 }) {
+            std::fill(out.begin(), out.end(), 2.f);
+            DSP::int16_to_float(&in[offset], &out[offset], count);
+            CHECK(!memcmp(&out[offset], &expected[offset],
+                count * sizeof(float)));
+            if(offset + count < out.size()) {
+                CHECK(out[offset + count] == 2.f);
+            }
+        }
+    }
+    std::vector<int16_t> back(in.size());
+    DSP::float_to_int16(expected.data(), back.data(), expected.size());
+    CHECK(back == in);
+    const float edges[] = { 2.f, -2.f, 0.49f / 32768.f, NAN };
+    int16_t clamped[4];
+    DSP::float_to_int16(edges, clamped, 4);
+    CHECK(clamped[0] == 32767);
+    CHECK(clamped[1] == -32768);
+    CHECK(clamped[2] == 0);
+    CHECK(clamped[3] == 0);
+
+    // gain matches scaling the converted floats
+    for(float gain: { .5f, 3.f }) {
+        std::vector<int16_t> scaled(in);
+        DSP::apply_gain(scaled.data(), scaled.size(), gain);
+        std::vector<float> f(expected);
+        for(float &x: f) {
+            x *= gain;
+        }
+        DSP::float_to_int16(f.data(), back.data(), f.size());
+        CHECK(scaled == back);
+    }
+
+    std::string kernel = DSP::int16_to_float_kernel();
+    CHECK((kernel == "avx2") || (kernel == "sse2") || (kernel == "scalar"));
+});
+
+T_(sample_stats, {
+    // every 16-bit value, with silent and clipped runs at either end, and
+    // lengths and alignments that leave remainders
+    std::vector<int16_t> in(100);
+    in.push_back(-32768);
+    for(size_t i = 0; i < 65536; i++) {
+        in.push_back(static_cast<int16_t>((i * 7919) - 32768));
+    }
+    in.push_back(32767);
+    in.push_back(-16);
+    in.insert(in.end(), 37, 0);
+    for(size_t offset: { 0, 1, 7, 101 }) {
+        const size_t rest = in.size() - offset;
+        for(size_t count:
+            { size_t(0), size_t(1), size_t(15), size_t(133), rest }) {
+            DSP::SampleStats expected, stats;
+            DSP::sample_stats_scalar(&in[offset], count, 16, expected);
+            DSP::sample_stats(&in[offset], count, 16, stats);
+            CHECK(stats.count == count);
+            CHECK(stats.min == expected.min);
+            CHECK(stats.max == expected.max);
+            CHECK(stats.sum == expected.sum);
+            CHECK(stats.sum_squares == expected.sum_squares);
+            CHECK(stats.clipped == expected.clipped);
+            CHECK(stats.leading_silence == expected.leading_silence);
+            CHECK(stats.trailing_silence == expected.trailing_silence);
+        }
+    }
+    DSP::SampleStats stats;
+    DSP::sample_stats(in.data(), in.size(), 16, stats);
+    CHECK(stats.min == -32768);
+    CHECK(stats.max == 32767);
+    CHECK(stats.clipped == 4);
+    CHECK(stats.leading_silence == 100);
+    CHECK(stats.trailing_silence == 38);
+    DSP::sample_stats(in.data(), 100, 16, stats);
+    CHECK(stats.min == 0);
+    CHECK(stats.leading_silence == 100);
+    CHECK(stats.trailing_silence == 100);
+});
+
+T_(sample_analysis, {
+    API::MemoryBlocks mb;
+    auto r1 = API::BlockLoader("fz_data/bank.fzb").load(mb);
+    CHECK(API::result_success(r1));
+    auto analyses = mb.analyze_voices();
+    CHECK(analyses.size() == 1);
+
+    // against a plain loop over the same samples
+    auto data = mb.voice_samples(0);
+    int32_t peak = 0;
+    double sum = 0, sum_squares = 0;
+    for(size_t i = 0; i < data.size(); i++) {
+        peak = std::max(peak, std::abs(int32_t{data[i]}));
+        sum += data[i];
+        sum_squares += double(data[i]) * data[i];
+    }
+    auto &a = analyses[0];
+    CHECK(a.count == 1929);
+    CHECK(a.peak == peak / 32768.f);
+    CHECK(fabs(a.rms - sqrt(sum_squares / a.count) / 32768) < 1e-6);
+    CHECK(fabs(a.dc_offset - sum / a.count / 32768) < 1e-6);
+
+    // a full scale square wave between stretches of silence
+    std::vector<int16_t> square(300, 5);
+    for(size_t i = 100; i < 200; i++) {
+        square[i] = (i & 1) ? 32767 : -32768;
+    }
+    auto b = API::analyze_samples({ square.data(), square.size() });
+    CHECK(b.peak == 1.f);
+    CHECK(b.clipped == 100);
+    CHECK(b.leading_silence == 100);
+    CHECK(b.trailing_silence == 100);
+    CHECK(fabs(b.rms - sqrt(1. / 3)) < 1e-4); // (a third of the samples)
+    CHECK(mb.analyze_voice(1).count == 0);
+});
+
+T_(resampler, {
+    // a 1kHz tone between FZ-1 and studio rates, fed in uneven chunks
+    const uint32_t rates[][2] = {
+        { 44100, 36000 }, { 36000, 48000 }, { 9000, 44100 }, { 48000, 18000 },
+    };
+    for(auto &r: rates) {
+        for(auto quality: { DSP::RESAMPLE_FAST, DSP::RESAMPLE_BEST }) {
+            std::vector<float> in(r[0] / 2), out, whole;
+            for(size_t i = 0; i < in.size(); i++) {
+                in[i] = static_cast<float>(
+                    0.5 * sin(i * 2 * DSP::PI * 1000 / r[0]));
+            }
+            DSP::Resampler rs(r[0], r[1], quality);
+            CHECK(rs.taps() % 8 == 0);
+            for(size_t i = 0; i < in.size(); i += 777) {
+                rs.process(&in[i], std::min<size_t>(777, in.size() - i), out);
+            }
+            rs.flush(out);
+            CHECK(out.size() == rs.output_length(in.size()));
+            CHECK(out.size() == r[1] / 2);
+            const float tolerance =
+                (quality == DSP::RESAMPLE_FAST) ? 2e-3f : 2e-5f;
+            for(size_t k = 100; k < out.size() - 100; k++) {
+                double expected = 0.5 * sin(k * 2 * DSP::PI * 1000 / r[1]);
+                CHECK(fabs(out[k] - expected) < tolerance);
+            }
+            // (the chunking doesn't change the result)
+            rs.process(in.data(), in.size(), whole);
+            rs.flush(whole);
+            CHECK(whole == out);
+        }
+    }
+
+    // a tone above the output's Nyquist rate is filtered out
+    std::vector<float> high(48000), out;
+    for(size_t i = 0; i < high.size(); i++) {
+        high[i] = static_cast<float>(sin(i * 2 * DSP::PI * 6000 / 48000));
+    }
+    DSP::Resampler down(48000, 9000);
+    down.process(high.data(), high.size(), out);
+    down.flush(out);
+    for(size_t k = 100; k < out.size() - 100; k++) {
+        CHECK(fabsf(out[k]) < 1e-3f);
+    }
+
+    // the same rate in and out is a copy
+    DSP::Resampler same(36000, 36000);
+    std::vector<float> copy;
+    same.process(high.data(), 1000, copy);
+    same.flush(copy);
+    CHECK(copy.size() == 1000);
+    CHECK(!memcmp(copy.data(), high.data(), 1000 * sizeof(float)));
+});
+
+T_(envelope, {
+    // attack to 1 over 100 samples, decay to .5 over 50 (the sustain), then
+    // release to 0 over 200
+    const float
+        steps[8] = { .01f, .01f, .0025f, 1, 1, 1, 1, 1 },
+        targets[8] = { 1, .5f, 0, 0, 0, 0, 0, 0 };
+    DSP::Envelope e;
+    e.start(steps, targets, 1, 2);
+    CHECK(fabsf(e.advance(50) - .5f) < 1e-5f);
+    CHECK(fabsf(e.advance(50) - 1) < 1e-5f);
+    CHECK(fabsf(e.advance(25) - .75f) < 1e-5f);
+    CHECK(e.advance(1000) == .5f); // (held at the sustain level)
+    CHECK(!e.finished());
+    e.release();
+    CHECK(fabsf(e.advance(100) - .25f) < 1e-5f);
+    CHECK(e.advance(100) == 0);
+    CHECK(e.finished());
+
+    // a level per sample, or per block, matches advancing one at a time
+    for(size_t interval: { 1, 7, 32 }) {
+        DSP::Envelope a, b;
+        a.start(steps, targets, 1, 2);
+        b.start(steps, targets, 1, 2);
+        std::vector<float> levels(600 / interval);
+        CHECK(a.render(levels.data(), levels.size(), interval) ==
+            levels.size());
+        bool close = true;
+        for(float level: levels) {
+            close = close && (fabsf(level - b.advance(interval)) < 1e-4f);
+        }
+        CHECK(close);
+        CHECK(levels.back() == .5f);
+        a.release();
+        b.release();
+        const size_t finish = (200 + interval - 1) / interval - 1;
+        CHECK(a.render(levels.data(), levels.size(), interval) == finish);
+        CHECK(levels[finish] == 0);
+        CHECK(levels.back() == 0);
+    }
+});
+
+T_(low_pass_filter, {
+    // a constant passes at unity gain, at any resonance
+    for(float q: { .7071f, 4.f }) {
+        DSP::LowPassFilter f;
+        std::vector<float> x(4096, .5f);
+        f.process(x.data(), x.size(), 1000, q, 36000);
+        CHECK(fabsf(x.back() - .5f) < 1e-4f);
+    }
+
+    // a tone two octaves above the cutoff is cut, and one well below it
+    // isn't: with fixed coefficients, the block size makes no difference
+    auto level = [](float hz, float cutoff, size_t block) {
+        DSP::LowPassFilter f;
+        std::vector<float> x(36000);
+        for(size_t i = 0; i < x.size(); i++) {
+            x[i] = sinf(i * 2 * static_cast<float>(DSP::PI) * hz / 36000);
+        }
+        for(size_t i = 0; i < x.size(); i += block) {
+            f.process(&x[i], std::min(block, x.size() - i), cutoff, .7071f,
+                36000);
+        }
+        float peak = 0;
+        for(size_t i = x.size() / 2; i < x.size(); i++) {
+            peak = std::max(peak, fabsf(x[i]));
+        }
+        return peak;
+    };
+    CHECK(level(4000, 1000, 32) < .07f);
+    CHECK(level(100, 1000, 32) > .99f);
+    CHECK(level(4000, 1000, 32) == level(4000, 1000, 36000));
+
+    // opening the filter fully in one block ramps it open across the block
+    DSP::LowPassFilter ramp;
+    std::vector<float> tone(36000 + 32);
+    for(size_t i = 0; i < tone.size(); i++) {
+        tone[i] =
+            sinf((i * 2 * static_cast<float>(DSP::PI) * 4000 / 36000) + 1);
+    }
+    ramp.process(tone.data(), 36000, 100, .7071f, 36000);
+    ramp.process(tone.data() + 36000, 32, 16000, .7071f, 36000);
+    CHECK(fabsf(tone[36000]) < .05f);
+    CHECK(fabsf(tone[36000 - 1]) < .01f);
+
+    // resonance peaks at the cutoff
+    CHECK(level(1000, 1000, 32) < .75f);
+    DSP::LowPassFilter r;
+    std::vector<float> x(36000);
+    for(size_t i = 0; i < x.size(); i++) {
+        x[i] = sinf(i * 2 * static_cast<float>(DSP::PI) * 1000 / 36000);
+    }
+    r.process(x.data(), x.size(), 1000, 4, 36000);
+    CHECK(fabsf(x.back()) < 4.01f);
+    CHECK(*std::max_element(x.begin() + 18000, x.end()) > 3.9f);
+});
+
+T_(loop_search, {
+    // a voice of 16 blocks of a sine wave with a period of 100 samples
+    const size_t blocks = 16, count = blocks * 512;
+    API::MemoryObjectPtr first = API::MemoryVoice::emplace([](Voice &v) {
+        v.data_start = v.play_start = 0;
+        v.data_end = v.play_end = count - 1;
+        v.loop_end_point = 0;
+    }, nullptr);
+    API::MemoryObjectPtr current = first;
+    for(size_t i = 0; i < blocks; i++) {
+        current = API::MemoryWave::emplace([i](Wave &w) {
+            for(size_t j = 0; j < std::size(w.samples); j++) {
+                double t = static_cast<double>(i * 512 + j) / 100;
+                w.samples[j] = static_cast<int16_t>(
+                    lrint(sin(t * 2 * DSP::PI) * 16384));
+            }
+        }, current);
+    }
+    API::MemoryBlocks mb;
+    auto r1 = API::MemoryObject::pack(first, mb, TYPE_VOICE);
+    CHECK(API::result_success(r1));
+
+    API::LoopSearchOptions options;
+    options.candidates = 2;
+    std::vector<API::LoopCandidate> loops;
+    mb.clean();
+    auto r2 = mb.find_voice_loops(0, options, &loops);
+    CHECK(API::result_success(r2));
+    CHECK(loops.size() == 2);
+    CHECK(mb.dirty_count() == 1);
+    CHECK(mb.is_dirty(mb.section(API::BT_VOICE).start));
+    const Voice *v = mb.voice(0);
+    CHECK(v->loop_end_point == 1);
+    CHECK(v->loop_sustain_point == 0);
+    for(size_t i = 0; i < loops.size(); i++) {
+        auto &l = loops[i];
+        // whole periods, long enough, joined at a rising zero crossing
+        CHECK(l.end - l.start + 1 >= 1024);
+        CHECK((l.end - l.start + 1) % 100 == 0);
+        CHECK(l.score > .99f);
+        CHECK(l.xfade_time < 16);
+        CHECK((v->loop_start[i] & API::LOOP_START_ADDRESS_MASK) == l.start);
+        CHECK((v->loop_end[i] & API::LOOP_END_ADDRESS_MASK) == l.end);
+        CHECK(v->loop_xfade_time[i] == l.xfade_time);
+    }
+    CHECK(v->loop_start[2] == v->play_end);
+
+    // silence has no loops
+    std::vector<int16_t> silence(4096);
+    std::vector<API::LoopCandidate> none;
+    auto r3 = API::find_loops({ silence.data(), silence.size() },
+        0, silence.size() - 1, options, none);
+    CHECK(API::result_success(r3));
+    CHECK(none.empty());
+    auto r5 = API::find_loops(mb.samples(), 0, count, options, none);
+    CHECK(r5 == API::RESULT_WAVE_BAD_OFFSET);
+    CHECK(mb.find_voice_loops(1) == API::RESULT_MISSING_VOICE);
+});
+
+T_(voice_render, {
+    // 10 periods of a sine wave (100 samples each, so 360Hz at 36kHz), looped
+    // while the key is held, with a fast attack and release
+    std::vector<int16_t> wave(2000);
+    for(size_t i = 0; i < wave.size(); i++) {
+        wave[i] = static_cast<int16_t>(
+            lrint(sin(i * 2 * DSP::PI / 100) * 16384));
+    }
+    Voice v;
+    v.data_end = v.play_end = static_cast<int32_t>(wave.size() - 1);
+    v.loop_end[0] = 999;
+    v.loop_time[0] = 1023;
+    v.dca_end = v.dcf_end = 1;
+    v.dca_rate[0] = v.dcf_rate[0] = 127;
+    v.dca_rate[1] = v.dcf_rate[1] = 100;
+    v.dca_end_level[0] = v.dcf_end_level[0] = 255;
+    v.midi_origin = 60;
+    const API::Span<int16_t> samples{ wave.data(), wave.size() };
+
+    // count rising zero crossings over the first count samples
+    auto crossings = [](const std::vector<float> &out, size_t count) {
+        size_t n = 0;
+        for(size_t i = 1; i < count; i++) {
+            n += (out[i - 1] < 0) && (out[i] >= 0);
+        }
+        return n;
+    };
+
+    API::RenderNote note;
+    note.hold = .5;
+    std::vector<float> out;
+    auto r1 = API::render_voice(v, samples, note, API::RENDER_RATE, out);
+    CHECK(API::result_success(r1));
+    // held for 18000 samples, then released in well under the tail
+    CHECK(out.size() > 18000);
+    CHECK(out.size() < 18000 + 3600);
+    float peak = 0;
+    for(float x: out) {
+        peak = std::max(peak, fabsf(x));
+    }
+    CHECK((peak > .45f) && (peak < .55f));
+    CHECK(fabsf(out.back()) < .01f);
+    size_t low = crossings(out, 18000);
+    CHECK((low >= 178) && (low <= 181));
+
+    // an octave up
+    note.note = 72;
+    auto r2 = API::render_voice(v, samples, note, API::RENDER_RATE, out);
+    CHECK(API::result_success(r2));
+    size_t high = crossings(out, 18000);
+    CHECK((high >= 358) && (high <= 361));
+
+    // without its loop (or a sustain loop), the voice plays through once
+    v.loop_time[0] = 0;
+    v.loop_sustain_point = 8;
+    note.note = 60;
+    auto r3 = API::render_voice(v, samples, note, API::RENDER_RATE, out);
+    CHECK(API::result_success(r3));
+    CHECK(out.size() == wave.size());
+
+    v.frequency = 3;
+    auto r4 = API::render_voice(v, samples, note, API::RENDER_RATE, out);
+    CHECK(r4 == API::RESULT_WAVE_BAD_SAMPLERATE);
+    CHECK(out.empty());
+});
+
+T_(midi_parse, {
+    // format 1: a tempo track (120bpm, then 60bpm after two beats), and a track
+    // of notes at 96 ticks per beat, using running status and note on with
+    // velocity 0 as note off
+    const uint8_t data[] = {
+        'M', 'T', 'h', 'd', 0, 0, 0, 6, 0, 1, 0, 2, 0, 96,
+        'M', 'T', 'r', 'k', 0, 0, 0, 15,
+            0, 0xff, 0x51, 3, 0x07, 0xa1, 0x20,
+            0x81, 0x40, 0xff, 0x51, 3, 0x0f, 0x42, 0x40,
+        'M', 'T', 'r', 'k', 0, 0, 0, 26,
+            0, 0x90, 60, 100,
+            0x60, 64, 90, // (running status)
+            0x81, 0x40, 60, 0,
+            0, 0x81, 64, 0,
+            0, 0xc3, 5, // (program change)
+            0, 0x93, 67, 1,
+            0, 0xff, 0x2f, 0,
+    };
+    std::vector<API::MidiNote> notes;
+    auto r1 = API::parse_midi(data, sizeof(data), notes);
+    CHECK(API::result_success(r1));
+    CHECK(notes.size() == 3);
+    CHECK((notes[0].channel == 0) && (notes[0].note == 60));
+    CHECK((notes[0].start == 0) && (fabs(notes[0].end - 2) < 1e-9));
+    CHECK(notes[0].velocity == 100);
+    // (the note off on channel 1 doesn't end the note on channel 0)
+    CHECK((notes[1].channel == 0) && (notes[1].note == 64));
+    CHECK((fabs(notes[1].start - .5) < 1e-9) && (notes[1].end == notes[0].end));
+    // (left sounding at the end of its track)
+    CHECK((notes[2].channel == 3) && (notes[2].velocity == 1));
+    CHECK((notes[2].start == notes[2].end) && (notes[2].end == notes[0].end));
+
+    auto r2 = API::parse_midi(data, sizeof(data) - 1, notes);
+    CHECK(r2 == API::RESULT_MIDI_BAD_FILE);
+    CHECK(notes.empty());
+    auto r3 = API::parse_midi(data + 1, sizeof(data) - 1, notes);
+    CHECK(r3 == API::RESULT_MIDI_BAD_FILE);
+    CHECK(API::load_midi_file("fz_data/missing.mid", notes) ==
+        API::RESULT_FILE_OPEN_ERROR);
+});
+
+T_(bank_key_map, {
+    // a full bank of areas with pseudo-random ranges (including some empty
+    // ones and some invalid channels), checked against a scan of every area
+    Bank b;
+    b.voice_count = Bank::MAXV;
+    uint32_t seed = 1;
+    auto next = [&seed](uint32_t n) {
+        seed = (seed * 1664525u) + 1013904223u;
+        return static_cast<uint8_t>((seed >> 16) % n);
+    };
+    for(size_t a = 0; a < Bank::MAXV; a++) {
+        b.midi_channel[a] = next(18);
+        b.midi_lo[a] = next(128);
+        b.midi_hi[a] = next(128);
+        b.velocity_lo[a] = next(128);
+        b.velocity_hi[a] = next(128);
+    }
+    auto matches = [&b](size_t a, uint8_t c, uint8_t n, uint8_t v) {
+        return (b.midi_channel[a] == c) &&
+            (b.midi_lo[a] <= n) && (n <= b.midi_hi[a]) &&
+            (b.velocity_lo[a] <= v) && (v <= b.velocity_hi[a]);
+    };
+    const API::BankKeyMap map(b);
+    uint64_t seen = 0;
+    bool all_match = true;
+    for(uint8_t c = 0; c < 16; c++) {
+        for(uint8_t n = 0; n < 128; n++) {
+            for(uint8_t v = 0; v < 128; v++) {
+                uint64_t expected = 0;
+                for(size_t a = 0; a < Bank::MAXV; a++) {
+                    expected |= uint64_t(matches(a, c, n, v)) << a;
+                }
+                all_match = all_match && (map.areas(c, n, v) == expected);
+                seen |= expected;
+            }
+        }
+    }
+    CHECK(all_match);
+    CHECK(map.reachable() == seen);
+    CHECK(seen != ~uint64_t(0));
+    for(size_t a = 0; a < Bank::MAXV; a++) {
+        uint64_t expected = 0;
+        for(size_t o = 0; o < Bank::MAXV; o++) {
+            bool overlap = (o != a) &&
+                (b.midi_channel[a] == b.midi_channel[o]) &&
+                (b.midi_channel[a] < 16) &&
+                (std::max(b.midi_lo[a], b.midi_lo[o]) <=
+                    std::min(b.midi_hi[a], b.midi_hi[o])) &&
+                (std::max(b.velocity_lo[a], b.velocity_lo[o]) <=
+                    std::min(b.velocity_hi[a], b.velocity_hi[o]));
+            expected |= uint64_t(overlap) << o;
+        }
+        CHECK(map.overlaps(a) == expected);
+    }
+
+    // areas past voice_count are left out
+    b.voice_count = 1;
+    CHECK((API::BankKeyMap(b).reachable() & ~uint64_t(1)) == 0);
+});
+
+T_(bank_render, {
+    // two voices of a sine wave (looped while held): the low half of the
+    // keyboard plays voice 1 on output 1, and the high half plays voice 2 on
+    // output 8
+    const size_t blocks = 4, count = blocks * 512;
+    API::MemoryObjectPtr first = API::MemoryBank::emplace([](Bank &b) {
+        b.voice_count = 2;
+        for(size_t a = 0; a < 2; a++) {
+            b.midi_lo[a] = a ? 64 : 0;
+            b.midi_hi[a] = a ? 127 : 63;
+            b.velocity_lo[a] = 1;
+            b.velocity_hi[a] = 127;
+            b.output_mask[a] = a ? 0x80 : 0x01;
+            b.area_volume[a] = 127;
+            b.voice_index[a] = static_cast<uint16_t>(a);
+        }
+    }, nullptr);
+    API::MemoryObjectPtr current = first;
+    for(int32_t i = 0; i < 2; i++) {
+        current = API::MemoryVoice::emplace([i](Voice &v) {
+            v.data_start = v.play_start = i * count;
+            v.data_end = v.play_end = v.data_start + count - 1;
+            v.loop_start[0] = v.data_start;
+            v.loop_end[0] = v.data_start + 1999;
+            v.loop_time[0] = 1023;
+            v.loop_end_point = 0;
+            v.dca_end = v.dcf_end = 1;
+            v.dca_rate[0] = v.dcf_rate[0] = 127;
+            v.dca_rate[1] = v.dcf_rate[1] = 100;
+            v.dca_end_level[0] = v.dcf_end_level[0] = 255;
+            v.midi_origin = 60;
+        }, current);
+    }
+    for(size_t i = 0; i < blocks * 2; i++) {
+        current = API::MemoryWave::emplace([i](Wave &w) {
+            for(size_t j = 0; j < std::size(w.samples); j++) {
+                w.samples[j] = static_cast<int16_t>(
+                    lrint(sin((i * 512 + j) * 2 * DSP::PI / 100) * 16384));
+            }
+        }, current);
+    }
+    API::MemoryBlocks mb;
+    auto r1 = API::MemoryObject::pack(first, mb, TYPE_FULL);
+    CHECK(API::result_success(r1));
+
+    // overlapping notes, longer than a segment, and one no area plays
+    std::vector<API::MidiNote> notes = {
+        { 0.0, 1.0, 0, 60, 100 },
+        { 0.5, 1.5, 0, 72, 100 },
+        { 0.5, 1.5, 1, 60, 100 },
+    };
+    API::BankRenderOptions options;
+    options.threads = 1;
+    std::vector<float> out, threaded, individual;
+    auto r2 = API::render_bank(mb, 0, notes, options, out);
+    CHECK(API::result_success(r2));
+    CHECK(out.size() % 2 == 0);
+    const size_t frames = out.size() / 2;
+    CHECK((frames > 54000) && (frames < 54000 + 3600));
+    // the first note is hard left, the second hard right
+    auto peak = [&](size_t c, double from, double to) {
+        float p = 0;
+        for(size_t f = static_cast<size_t>(from * 36000);
+            f < std::min(frames, static_cast<size_t>(to * 36000)); f++) {
+            p = std::max(p, fabsf(out[(f * 2) + c]));
+        }
+        return p;
+    };
+    CHECK((peak(0, 0, .5) > .45f) && (peak(1, 0, .5) < 1e-6f));
+    CHECK((peak(0, 1.1, 1.5) < 1e-3f) && (peak(1, 1.1, 1.5) > .45f));
+
+    // the mix is the same on any number of threads
+    options.threads = 4;
+    auto r3 = API::render_bank(mb, 0, notes, options, threaded);
+    CHECK(API::result_success(r3));
+    CHECK(threaded == out);
+
+    options.outputs = API::BANK_INDIVIDUAL;
+    auto r4 = API::render_bank(mb, 0, notes, options, individual);
+    CHECK(API::result_success(r4));
+    CHECK(individual.size() == frames * 9);
+    for(size_t f = 0; f < frames; f++) {
+        const float *frame = individual.data() + (f * 9);
+        CHECK(frame[0] == frame[1] + frame[8]);
+        CHECK(frame[2] == 0 && frame[7] == 0);
+    }
+
+    CHECK(API::render_bank(mb, 1, notes, options, out) ==
+        API::RESULT_MISSING_BANK);
+});
+
 T_(xml_roundtrip_bank, {
     auto bl = API::BlockLoader("fz_data/bank.fzb");
     API::MemoryBlocks mb;
@@ -695,6 +2373,34 @@ T_(xml_roundtrip_full, {
         CHECK(std::string{ bank.name } == "BBBBBBBBBBBB");
     }
 
+    // Write a minimal .wav file: just the 'fmt ' and 'data' chunks
+    void write_wav_file(const char *filename, uint16_t format,
+        uint16_t channels, uint32_t rate, uint16_t bits,
+        const void *data, uint32_t size) {
+
+        FILE *f = fopen(filename, "wb");
+        CHECK(f);
+        const uint16_t align = channels * bits / 8;
+        const uint32_t
+            riff_size = 36 + size,
+            fmt_size = 16,
+            byte_rate = rate * align;
+        fwrite("RIFF", 4, 1, f);
+        fwrite(&riff_size, 4, 1, f);
+        fwrite("WAVEfmt ", 8, 1, f);
+        fwrite(&fmt_size, 4, 1, f);
+        fwrite(&format, 2, 1, f);
+        fwrite(&channels, 2, 1, f);
+        fwrite(&rate, 4, 1, f);
+        fwrite(&byte_rate, 4, 1, f);
+        fwrite(&align, 2, 1, f);
+        fwrite(&bits, 2, 1, f);
+        fwrite("data", 4, 1, f);
+        fwrite(&size, 4, 1, f);
+        fwrite(data, 1, size, f);
+        fclose(f);
+    }
+
     void check_voice(const Voice &voice) {
         CHECK(voice.data_start == 0);
         CHECK(voice.data_end == 1928);